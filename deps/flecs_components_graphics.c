@@ -3,6 +3,8 @@
 #include "flecs_components_graphics.h"
 
 ECS_TAG_DECLARE(EcsSun);
+ECS_COMPONENT_DECLARE(EcsParticleBuffer);
+ECS_COMPONENT_DECLARE(EcsTilemap);
 
 ECS_CTOR(EcsCamera, ptr, {
     ptr->position[0] = 0.0f;
@@ -35,6 +37,136 @@ ECS_CTOR(EcsAtmosphere, ptr, {
     ptr->mie_scatter_dir = 0.758;
 })
 
+/* Number of float arrays in a particle buffer. The arrays are stored one after
+ * another in the lanes allocation, each with room for capacity particles. */
+#define PARTICLE_LANES (12)
+
+/* Point attributes to their array in the lanes allocation */
+static
+void particle_buffer_set_lanes(
+    EcsParticleBuffer *pb)
+{
+    float *lanes = pb->lanes;
+    int32_t capacity = pb->capacity;
+    pb->x = &lanes[0 * capacity];
+    pb->y = &lanes[1 * capacity];
+    pb->z = &lanes[2 * capacity];
+    pb->vx = &lanes[3 * capacity];
+    pb->vy = &lanes[4 * capacity];
+    pb->vz = &lanes[5 * capacity];
+    pb->size = &lanes[6 * capacity];
+    pb->rotation = &lanes[7 * capacity];
+    pb->r = &lanes[8 * capacity];
+    pb->g = &lanes[9 * capacity];
+    pb->b = &lanes[10 * capacity];
+    pb->age = &lanes[11 * capacity];
+}
+
+static
+void particle_buffer_grow(
+    EcsParticleBuffer *pb)
+{
+    int32_t i, capacity = pb->capacity ? pb->capacity * 2 : 64;
+    float *lanes = ecs_os_malloc_n(float, capacity * PARTICLE_LANES);
+
+    if (pb->count) {
+        for (i = 0; i < PARTICLE_LANES; i ++) {
+            ecs_os_memcpy_n(&lanes[i * capacity], 
+                &pb->lanes[i * pb->capacity], float, pb->count);
+        }
+    }
+
+    ecs_os_free(pb->lanes);
+    pb->lanes = lanes;
+    pb->capacity = capacity;
+    particle_buffer_set_lanes(pb);
+}
+
+int32_t ecs_particle_buffer_add(
+    EcsParticleBuffer *pb)
+{
+    ecs_assert(pb != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    if (pb->count == pb->capacity) {
+        particle_buffer_grow(pb);
+    }
+
+    return pb->count ++;
+}
+
+void ecs_particle_buffer_remove(
+    EcsParticleBuffer *pb,
+    int32_t index)
+{
+    ecs_assert(pb != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(index >= 0 && index < pb->count, ECS_INVALID_PARAMETER, NULL);
+
+    int32_t i, last = -- pb->count;
+    if (index != last) {
+        for (i = 0; i < PARTICLE_LANES; i ++) {
+            float *lane = &pb->lanes[i * pb->capacity];
+            lane[index] = lane[last];
+        }
+    }
+}
+
+ECS_CTOR(EcsParticleBuffer, ptr, {
+    ecs_os_memset_t(ptr, 0, EcsParticleBuffer);
+})
+
+ECS_MOVE(EcsParticleBuffer, dst, src, {
+    ecs_os_free(dst->lanes);
+    ecs_os_memcpy_t(dst, src, EcsParticleBuffer);
+    ecs_os_memset_t(src, 0, EcsParticleBuffer);
+})
+
+ECS_DTOR(EcsParticleBuffer, ptr, {
+    ecs_os_free(ptr->lanes);
+})
+
+void ecs_tilemap_resize(
+    EcsTilemap *tm,
+    int32_t width,
+    int32_t height)
+{
+    ecs_assert(tm != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(width >= 0 && height >= 0, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_os_free(tm->tiles);
+    tm->tiles = NULL;
+    if (width && height) {
+        tm->tiles = ecs_os_calloc_n(uint8_t, width * height);
+    }
+
+    tm->width = width;
+    tm->height = height;
+}
+
+ECS_CTOR(EcsTilemap, ptr, {
+    ecs_os_memset_t(ptr, 0, EcsTilemap);
+})
+
+ECS_COPY(EcsTilemap, dst, src, {
+    uint8_t *tiles = dst->tiles;
+    ecs_os_memcpy_t(dst, src, EcsTilemap);
+    dst->tiles = tiles;
+    ecs_tilemap_resize(dst, src->width, src->height);
+    if (src->tiles) {
+        ecs_os_memcpy_n(dst->tiles, src->tiles, uint8_t, 
+            src->width * src->height);
+    }
+})
+
+ECS_MOVE(EcsTilemap, dst, src, {
+    ecs_os_free(dst->tiles);
+    ecs_os_memcpy_t(dst, src, EcsTilemap);
+    ecs_os_memset_t(src, 0, EcsTilemap);
+})
+
+ECS_DTOR(EcsTilemap, ptr, {
+    ecs_os_free(ptr->tiles);
+})
+
 static void UpdateSelfLights(ecs_iter_t *it) {
     EcsSelfLight *sl = ecs_field(it, EcsSelfLight, 0);
     EcsRgb *color = ecs_field(it, EcsRgb, 1);
@@ -74,6 +206,8 @@ void FlecsComponentsGraphicsImport(
     ECS_META_COMPONENT(world, EcsLightIntensity);
     ECS_META_COMPONENT(world, EcsAtmosphere);
     ECS_TAG_DEFINE(world, EcsSun);
+    ECS_COMPONENT_DEFINE(world, EcsParticleBuffer);
+    ECS_COMPONENT_DEFINE(world, EcsTilemap);
 
     ecs_add_pair(world, ecs_id(EcsRgb), EcsOnInstantiate, EcsInherit);
     ecs_add_pair(world, ecs_id(EcsSpecular), EcsOnInstantiate, EcsInherit);
@@ -101,6 +235,19 @@ void FlecsComponentsGraphicsImport(
         .ctor = ecs_ctor(EcsAtmosphere)
     });
 
+    ecs_set_hooks(world, EcsParticleBuffer, {
+        .ctor = ecs_ctor(EcsParticleBuffer),
+        .move = ecs_move(EcsParticleBuffer),
+        .dtor = ecs_dtor(EcsParticleBuffer)
+    });
+
+    ecs_set_hooks(world, EcsTilemap, {
+        .ctor = ecs_ctor(EcsTilemap),
+        .copy = ecs_copy(EcsTilemap),
+        .move = ecs_move(EcsTilemap),
+        .dtor = ecs_dtor(EcsTilemap)
+    });
+
     ECS_SYSTEM(world, UpdateSelfLights, EcsPostUpdate,
         [in]  SelfLight, 
         [in]  Rgb, 
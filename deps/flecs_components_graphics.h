@@ -139,6 +139,70 @@ ECS_STRUCT(EcsAtmosphere, {
 FLECS_COMPONENTS_GRAPHICS_API
 extern ECS_TAG_DECLARE(EcsSun);
 
+/* Particles that are rendered as boxes without being stored as entities, so
+ * they don't need a transform or any other per-entity data. Each attribute is
+ * stored in its own array so particles can be updated by vectorized code. */
+typedef struct EcsParticleBuffer {
+    float *x, *y, *z;       /* Position */
+    float *vx, *vy, *vz;    /* Velocity */
+    float *size;            /* Width, height and depth */
+    float *rotation;        /* Rotation around the y axis */
+    float *r, *g, *b;       /* Color */
+    float *age;             /* Time since particle was added */
+    float *lanes;           /* Allocation that holds the attribute arrays */
+    int32_t count;
+    int32_t capacity;
+} EcsParticleBuffer;
+
+FLECS_COMPONENTS_GRAPHICS_API
+extern ECS_COMPONENT_DECLARE(EcsParticleBuffer);
+
+/* Add particle to buffer. Returns the index of the new particle. Attributes
+ * of the new particle are not initialized. */
+FLECS_COMPONENTS_GRAPHICS_API
+int32_t ecs_particle_buffer_add(
+    EcsParticleBuffer *pb);
+
+/* Remove particle from buffer. The last particle is moved into the slot of
+ * the removed particle. */
+FLECS_COMPONENTS_GRAPHICS_API
+void ecs_particle_buffer_remove(
+    EcsParticleBuffer *pb,
+    int32_t index);
+
+/* Maximum number of tile kinds in a tilemap */
+#define ECS_TILEMAP_MAX_KINDS (8)
+
+/* Appearance of a tile kind. Tiles are rendered as boxes that are centered on
+ * the tilemap position. Tiles of a kind with a height of 0 are not rendered. */
+typedef struct EcsTileKind {
+    ecs_rgb_t color;
+    float height;
+} EcsTileKind;
+
+/* Grid of tiles that is rendered as a single batch of boxes, without storing
+ * tiles as entities. Tile (0, 0) is centered on the position of the tilemap
+ * entity, and tiles are laid out along the x and z axes. Each tile is stored
+ * as an index into the kinds array. Call ecs_modified for the component after
+ * changing tiles, so the renderer knows it has to update its buffers. */
+typedef struct EcsTilemap {
+    uint8_t *tiles;         /* width * height tile kinds, row by row */
+    int32_t width;
+    int32_t height;
+    float tile_size;        /* Width and depth of a tile */
+    EcsTileKind kinds[ECS_TILEMAP_MAX_KINDS];
+} EcsTilemap;
+
+FLECS_COMPONENTS_GRAPHICS_API
+extern ECS_COMPONENT_DECLARE(EcsTilemap);
+
+/* Resize tilemap. All tiles are reset to kind 0. */
+FLECS_COMPONENTS_GRAPHICS_API
+void ecs_tilemap_resize(
+    EcsTilemap *tm,
+    int32_t width,
+    int32_t height);
+
 FLECS_COMPONENTS_GRAPHICS_API
 void FlecsComponentsGraphicsImport(
     ecs_world_t *world);
@@ -229,6 +293,30 @@ public:
     using PointLight = EcsPointLight;
     using SelfLight = EcsSelfLight;
 
+    struct ParticleBuffer : EcsParticleBuffer {
+        int32_t add() {
+            return ecs_particle_buffer_add(this);
+        }
+
+        void remove(int32_t index) {
+            ecs_particle_buffer_remove(this, index);
+        }
+    };
+
+    struct Tilemap : EcsTilemap {
+        void resize(int32_t w, int32_t h) {
+            ecs_tilemap_resize(this, w, h);
+        }
+
+        void set(int32_t x, int32_t y, uint8_t kind) {
+            this->tiles[y * this->width + x] = kind;
+        }
+
+        uint8_t get(int32_t x, int32_t y) const {
+            return this->tiles[y * this->width + x];
+        }
+    };
+
     graphics(flecs::world& ecs) {
         // Load module contents
         FlecsComponentsGraphicsImport(ecs);
@@ -243,6 +331,8 @@ public:
         ecs.component<Opacity>();
         ecs.component<Specular>();
         ecs.component<Emissive>();
+        ecs.component<ParticleBuffer>();
+        ecs.component<Tilemap>();
     }
 };
 
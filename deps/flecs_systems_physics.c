@@ -2,6 +2,8 @@
 #include "flecs_systems_physics.h"
 
 ECS_CTOR(EcsSpatialQuery, ptr, {
+    ptr->kind = EcsSpatialQueryOctree;
+    ptr->cell_size = 0;
     ptr->query = NULL;
 })
 
@@ -12,6 +14,8 @@ ECS_MOVE(EcsSpatialQuery, dst, src, {
 
     ecs_os_memcpy_t(dst->center, src->center, vec3);
     dst->size = src->size;
+    dst->kind = src->kind;
+    dst->cell_size = src->cell_size;
     dst->query = src->query;
     src->query = NULL;
 })
@@ -41,6 +45,31 @@ ECS_DTOR(EcsSpatialQueryResult, ptr, {
     }
 })
 
+ECS_CTOR(EcsBroadphase, ptr, {
+    ptr->a = 0;
+    ptr->b = 0;
+    ptr->exclusive = false;
+    ptr->broadphase = NULL;
+})
+
+ECS_MOVE(EcsBroadphase, dst, src, {
+    if (dst->broadphase) {
+        ecs_broadphase_free(dst->broadphase);
+    }
+
+    dst->a = src->a;
+    dst->b = src->b;
+    dst->exclusive = src->exclusive;
+    dst->broadphase = src->broadphase;
+    src->broadphase = NULL;
+})
+
+ECS_DTOR(EcsBroadphase, ptr, {
+    if (ptr->broadphase) {
+        ecs_broadphase_free(ptr->broadphase);
+    }
+})
+
 static
 void EcsMove2(ecs_iter_t *it) {
     EcsPosition2 *p = ecs_field(it, EcsPosition2, 0);
@@ -121,11 +150,69 @@ void EcsOnSetSpatialQuery(ecs_iter_t *it) {
     ecs_id_t filter = ecs_pair_second(it->world, id);
 
     for (int i = 0; i < it->count; i ++) {
-        q[i].query = ecs_squery_new(it->world, filter, q[i].center, q[i].size);
+        if (q[i].query) {
+            ecs_squery_free(q[i].query);
+            q[i].query = NULL;
+        }
+
+        if (q[i].kind == EcsSpatialQueryGrid) {
+            float cell_size = q[i].cell_size;
+            if (cell_size <= 0) {
+                cell_size = q[i].size / ECS_SPATIAL_GRID_DEFAULT_CELLS;
+            }
+            q[i].query = ecs_squery_new_w_grid(
+                it->world, filter, q[i].center, q[i].size, cell_size);
+        } else {
+            q[i].query = ecs_squery_new(
+                it->world, filter, q[i].center, q[i].size);
+        }
         if (!q[i].query) {
             char *filter_str = ecs_id_str(it->world, filter);
             ecs_err("failed to create query for filter '%s'", filter_str);
             ecs_os_free(filter_str);
+            continue;
+        }
+
+        ecs_add_pair(it->world, it->entities[i], 
+            ecs_id(EcsSpatialQueryStats), filter);
+    }
+}
+
+static
+void EcsOnSetBroadphase(ecs_iter_t *it) {
+    EcsBroadphase *bp = ecs_field(it, EcsBroadphase, 0);
+
+    for (int i = 0; i < it->count; i ++) {
+        if (bp[i].broadphase) {
+            ecs_broadphase_free(bp[i].broadphase);
+            bp[i].broadphase = NULL;
+        }
+
+        if (!bp[i].a || !bp[i].b) {
+            ecs_err("broadphase requires two filters");
+            continue;
+        }
+
+        bp[i].broadphase = ecs_broadphase_new(
+            it->world, bp[i].a, bp[i].b, bp[i].exclusive);
+        if (!bp[i].broadphase) {
+            char *a_str = ecs_id_str(it->world, bp[i].a);
+            char *b_str = ecs_id_str(it->world, bp[i].b);
+            ecs_err("failed to create broadphase for '%s', '%s'", 
+                a_str, b_str);
+            ecs_os_free(a_str);
+            ecs_os_free(b_str);
+        }
+    }
+}
+
+static
+void EcsUpdateBroadphase(ecs_iter_t *it) {
+    EcsBroadphase *bp = ecs_field(it, EcsBroadphase, 0);
+
+    for (int i = 0; i < it->count; i ++) {
+        if (bp[i].broadphase) {
+            ecs_broadphase_invalidate(bp[i].broadphase);
         }
     }
 }
@@ -142,7 +229,29 @@ void EcsUpdateSpatialQuery(ecs_iter_t *it) {
             continue;
         }
 
-        ecs_squery_update(q[i].query);
+        /* Publish statistics of previous frame */
+        ecs_id_t filter = ecs_pair_second(it->world, ecs_field_id(it, 0));
+        EcsSpatialQueryStats *stats = ecs_get_mut_pair(
+            it->world, it->entities[i], EcsSpatialQueryStats, filter);
+        if (stats) {
+            ecs_squery_stats_t s;
+            ecs_squery_stats(q[i].query, &s);
+            stats->update_time = s.update_time;
+            stats->entity_count = s.entity_count;
+            stats->node_count = s.node_count;
+            stats->leaf_count = s.leaf_count;
+            stats->depth = s.depth;
+            stats->max_leaf_entities = s.max_leaf_entities;
+            stats->avg_leaf_entities = s.avg_leaf_entities;
+            stats->dropped = s.dropped;
+            stats->query_count = s.query_count;
+            stats->nodes_visited = s.nodes_visited;
+            stats->result_count = s.result_count;
+            stats->memory = s.memory;
+            ecs_squery_stats_reset(q[i].query);
+        }
+
+        ecs_squery_invalidate(q[i].query);
     }
 }
 
@@ -156,14 +265,27 @@ void FlecsSystemsPhysicsImport(
 
     ecs_set_name_prefix(world, "Ecs");
 
+    ECS_COMPONENT_DEFINE(world, EcsSpatialQueryKind);
     ECS_COMPONENT_DEFINE(world, EcsSpatialQuery);
     ECS_COMPONENT_DEFINE(world, EcsSpatialQueryResult);
+    ECS_COMPONENT_DEFINE(world, EcsSpatialQueryStats);
+    ECS_COMPONENT_DEFINE(world, EcsBroadphase);
+
+    ecs_enum(world, {
+        .entity = ecs_id(EcsSpatialQueryKind),
+        .constants = {
+            {"Octree", EcsSpatialQueryOctree},
+            {"Grid", EcsSpatialQueryGrid}
+        }
+    });
 
     ecs_struct(world, {
         .entity = ecs_id(EcsSpatialQuery),
         .members = {
             {"center", ecs_id(vec3)},
-            {"size", ecs_id(ecs_f32_t)}
+            {"size", ecs_id(ecs_f32_t)},
+            {"kind", ecs_id(EcsSpatialQueryKind)},
+            {"cell_size", ecs_id(ecs_f32_t)}
         }
     });
 
@@ -181,6 +303,43 @@ void FlecsSystemsPhysicsImport(
         .move = ecs_move(EcsSpatialQueryResult)
     });    
 
+    ecs_struct(world, {
+        .entity = ecs_id(EcsSpatialQueryStats),
+        .members = {
+            {"update_time", ecs_id(ecs_f32_t)},
+            {"entity_count", ecs_id(ecs_i32_t)},
+            {"node_count", ecs_id(ecs_i32_t)},
+            {"leaf_count", ecs_id(ecs_i32_t)},
+            {"depth", ecs_id(ecs_i32_t)},
+            {"max_leaf_entities", ecs_id(ecs_i32_t)},
+            {"avg_leaf_entities", ecs_id(ecs_f32_t)},
+            {"dropped", ecs_id(ecs_i32_t)},
+            {"query_count", ecs_id(ecs_i32_t)},
+            {"nodes_visited", ecs_id(ecs_i32_t)},
+            {"result_count", ecs_id(ecs_i32_t)},
+            {"memory", ecs_id(ecs_i32_t)}
+        }
+    });
+
+    /* Statistics are collected for the entity that owns the query */
+    ecs_add_pair(world, ecs_id(EcsSpatialQueryStats), 
+        EcsOnInstantiate, EcsDontInherit);
+
+    ecs_struct(world, {
+        .entity = ecs_id(EcsBroadphase),
+        .members = {
+            {"a", ecs_id(ecs_entity_t)},
+            {"b", ecs_id(ecs_entity_t)},
+            {"exclusive", ecs_id(ecs_bool_t)}
+        }
+    });
+
+    ecs_set_hooks(world, EcsBroadphase, {
+        .ctor = ecs_ctor(EcsBroadphase),
+        .dtor = ecs_dtor(EcsBroadphase),
+        .move = ecs_move(EcsBroadphase)
+    });
+
     ECS_SYSTEM(world, EcsMove2, EcsOnUpdate, 
         [inout] flecs.components.transform.Position2,
         [in]    flecs.components.physics.Velocity2);
@@ -208,6 +367,12 @@ void FlecsSystemsPhysicsImport(
     ECS_SYSTEM(world, EcsUpdateSpatialQuery, EcsPreUpdate, 
         SpatialQuery(self, *), ?Prefab);
 
+    ECS_OBSERVER(world, EcsOnSetBroadphase, EcsOnSet,
+        Broadphase, ?Prefab);
+
+    ECS_SYSTEM(world, EcsUpdateBroadphase, EcsPreUpdate, 
+        Broadphase, ?Prefab);
+
     ecs_add_pair(world, ecs_id(EcsVelocity2), 
         EcsWith, ecs_id(EcsPosition2));
     ecs_add_pair(world, ecs_id(EcsVelocity3), 
@@ -221,50 +386,158 @@ void FlecsSystemsPhysicsImport(
 
 #define MAX_PER_OCTANT (8)
 
+/* Overlap tests use SSE when available at compile time, and AVX when it is
+ * supported by the CPU at runtime. Define ECS_OCTREE_NO_SIMD to only use the
+ * scalar implementation. */
+#ifndef ECS_OCTREE_NO_SIMD
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define OCT_SIMD_SSE
+#include <xmmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define OCT_SIMD_AVX
+#include <immintrin.h>
+#endif
+#endif
+#endif
+
+/* Entities in a cube are stored as a structure of arrays, so that overlap
+ * tests can be evaluated for multiple entities at once. The lanes array holds
+ * six arrays of size elements: x, y, z, followed by the size in x, y, z. */
+typedef struct cube_entities_t {
+    ecs_entity_t *ids;
+    float *lanes;
+    int32_t count;
+    int32_t size;
+} cube_entities_t;
+
+#define CUBE_X (0)
+#define CUBE_Y (1)
+#define CUBE_Z (2)
+#define CUBE_SIZE_X (3)
+#define CUBE_SIZE_Y (4)
+#define CUBE_SIZE_Z (5)
+#define CUBE_LANE_COUNT (6)
+
+#define cube_lane(ents, lane) (&(ents)->lanes[(lane) * (ents)->size])
+
 typedef struct cube_t {
     struct cube_t *parent;
     struct cube_t *nodes[8];
-    ecs_vec_t entities;
+    cube_entities_t entities;
+    vec3 center;
+    float size;
     int32_t id;
     bool is_leaf;
+
+    /* Entity storage for leaf cubes. Only cubes that store more entities than
+     * MAX_PER_OCTANT allocate entity storage on the heap. */
+    ecs_entity_t inline_ids[MAX_PER_OCTANT];
+    float inline_lanes[MAX_PER_OCTANT * CUBE_LANE_COUNT];
 } cube_t;
 
+/* Cubes are allocated from an arena of fixed size chunks. Cubes are never
+ * moved, and are only released when the octree is freed. */
+#define OCT_CHUNK_SIZE (64)
+
 struct ecs_octree_t {
-    ecs_sparse_t cubes;
+    ecs_vec_t chunks;     /* cube_t[OCT_CHUNK_SIZE] */
     ecs_vec_t free_cubes;
+    ecs_map_t locations;  /* entity -> (cube id, index in cube) */
     cube_t root;
     vec3 center;
     float size;
     int32_t count;
+    int32_t cube_count;   /* Number of cubes handed out by the arena */
+    int32_t high_water;   /* Largest number of cubes in use */
+    ecs_size_t heap_size; /* Entity storage allocated outside of cubes */
+
+    /* Counter for statistics, never reset. Queries are counted by the
+     * caller, so that finds don't write to the octree. */
+    int64_t dropped;
 };
 
-static
-void cube_split(
-    ecs_octree_t *ot,
-    cube_t *cube,
-    vec3 center,
-    float size);
+/* Entity locations are stored as a cube id in the upper 32 bits and the index
+ * of the entity in the cube's entity vector in the lower 32 bits. The root cube
+ * is not stored in the arena and always has id 0, other cubes have their arena
+ * index + 1. */
+#define OCT_LOC(cube_id, index) (((uint64_t)(uint32_t)(cube_id) << 32) | (uint32_t)(index))
+#define OCT_LOC_CUBE(loc) ((int32_t)((loc) >> 32))
+#define OCT_LOC_INDEX(loc) ((int32_t)((loc) & 0xFFFFFFFF))
 
 static
 cube_t *new_cube(
     ecs_octree_t *ot,
-    cube_t *parent)
+    cube_t *parent,
+    vec3 center,
+    float size)
 {
     cube_t *result = NULL;
     if (!ecs_vec_count(&ot->free_cubes)) {
-        result = ecs_sparse_add_t(&ot->cubes, cube_t);
-        result->id = (int32_t)ecs_sparse_last_id(&ot->cubes);
+        int32_t index = ot->cube_count ++;
+        int32_t chunk = index / OCT_CHUNK_SIZE;
+        if (chunk == ecs_vec_count(&ot->chunks)) {
+            ecs_vec_append_t(NULL, &ot->chunks, cube_t*)[0] = 
+                ecs_os_calloc_n(cube_t, OCT_CHUNK_SIZE);
+        }
+
+        result = &ecs_vec_get_t(&ot->chunks, cube_t*, chunk)[0][
+            index % OCT_CHUNK_SIZE];
+        result->id = index + 1;
     } else {
         result = ecs_vec_last_t(&ot->free_cubes, cube_t*)[0];
         ecs_vec_remove_last(&ot->free_cubes);
     }
-    
+
+    int32_t in_use = ot->cube_count - ecs_vec_count(&ot->free_cubes);
+    if (in_use > ot->high_water) {
+        ot->high_water = in_use;
+    }
+
+    /* Cubes handed out after the arena was reset can have stale data. Heap
+     * storage of previous use is kept so memory stabilizes. */
+    ecs_os_memset_n(result->nodes, 0, cube_t*, 8);
+    cube_entities_t *ents = &result->entities;
+    if (!ents->lanes) {
+        ents->ids = result->inline_ids;
+        ents->lanes = result->inline_lanes;
+        ents->size = MAX_PER_OCTANT;
+    }
+    ents->count = 0;
+
     result->parent = parent;
     result->is_leaf = true;
+    glm_vec3_copy(center, result->center);
+    result->size = size;
 
     return result;
 }
 
+static
+void free_cube(
+    ecs_octree_t *ot,
+    cube_t *cube)
+{
+    ecs_assert(cube->parent != NULL, ECS_INTERNAL_ERROR, NULL);
+    ecs_assert(!cube->entities.count, ECS_INTERNAL_ERROR, NULL);
+
+    cube_t **cptr = ecs_vec_append_t(NULL, &ot->free_cubes, cube_t*);
+    *cptr = cube;
+    cube->parent = NULL;
+}
+
+static
+cube_t* get_cube(
+    ecs_octree_t *ot,
+    int32_t id)
+{
+    if (!id) {
+        return &ot->root;
+    }
+    id --;
+    return &ecs_vec_get_t(&ot->chunks, cube_t*, id / OCT_CHUNK_SIZE)[0][
+        id % OCT_CHUNK_SIZE];
+}
+
 static
 bool is_inside_dim(
     float center,
@@ -314,20 +587,6 @@ int overlap_dim(
     return (!(left_nomatch | right_nomatch)) * (1 + (left_outside && right_outside));
 }
 
-/* Returns 0 if no overlap, 8 if contains, < 8 if overlaps */
-static
-int entity_overlaps(
-    vec3 center,
-    float size,
-    vec3 e_pos,
-    vec3 e_size)
-{
-    int result = overlap_dim(center[0], size, e_pos[0], e_size[0]);
-    result *=    overlap_dim(center[1], size, e_pos[1], e_size[1]);
-    result *=    overlap_dim(center[2], size, e_pos[2], e_size[2]);
-    return result;
-}
-
 static
 int cube_overlaps(
     vec3 center,
@@ -390,64 +649,190 @@ void get_cube_center(
     result[2] = center[2] + cube_map[index][2] * size;
 }
 
+static
+void cube_entities_grow(
+    ecs_octree_t *ot,
+    cube_t *cube)
+{
+    cube_entities_t *ents = &cube->entities;
+    int32_t i, size = ents->size * 2;
+    float *lanes = ecs_os_malloc_n(float, size * CUBE_LANE_COUNT);
+    for (i = 0; i < CUBE_LANE_COUNT; i ++) {
+        ecs_os_memcpy_n(&lanes[i * size], cube_lane(ents, i), float, 
+            ents->count);
+    }
+
+    if (ents->lanes == cube->inline_lanes) {
+        ents->ids = ecs_os_malloc_n(ecs_entity_t, size);
+        ecs_os_memcpy_n(ents->ids, cube->inline_ids, ecs_entity_t, 
+            ents->count);
+    } else {
+        ot->heap_size -= ents->size * 
+            (ECS_SIZEOF(ecs_entity_t) + ECS_SIZEOF(float) * CUBE_LANE_COUNT);
+        ecs_os_free(ents->lanes);
+        ents->ids = ecs_os_realloc_n(ents->ids, ecs_entity_t, size);
+    }
+
+    ot->heap_size += size * 
+        (ECS_SIZEOF(ecs_entity_t) + ECS_SIZEOF(float) * CUBE_LANE_COUNT);
+    ents->lanes = lanes;
+    ents->size = size;
+}
+
+static
+void cube_entities_fini(
+    cube_t *cube)
+{
+    cube_entities_t *ents = &cube->entities;
+    if (ents->lanes && ents->lanes != cube->inline_lanes) {
+        ecs_os_free(ents->lanes);
+        ecs_os_free(ents->ids);
+    }
+}
+
+static
+void cube_entities_set(
+    cube_entities_t *ents,
+    int32_t index,
+    vec3 pos,
+    vec3 size)
+{
+    cube_lane(ents, CUBE_X)[index] = pos[0];
+    cube_lane(ents, CUBE_Y)[index] = pos[1];
+    cube_lane(ents, CUBE_Z)[index] = pos[2];
+    cube_lane(ents, CUBE_SIZE_X)[index] = size[0];
+    cube_lane(ents, CUBE_SIZE_Y)[index] = size[1];
+    cube_lane(ents, CUBE_SIZE_Z)[index] = size[2];
+}
+
+static
+void cube_entities_get(
+    const cube_entities_t *ents,
+    int32_t index,
+    ecs_oct_entity_t *result)
+{
+    result->id = ents->ids[index];
+    result->pos[0] = cube_lane(ents, CUBE_X)[index];
+    result->pos[1] = cube_lane(ents, CUBE_Y)[index];
+    result->pos[2] = cube_lane(ents, CUBE_Z)[index];
+    result->size[0] = cube_lane(ents, CUBE_SIZE_X)[index];
+    result->size[1] = cube_lane(ents, CUBE_SIZE_Y)[index];
+    result->size[2] = cube_lane(ents, CUBE_SIZE_Z)[index];
+}
+
 static
 void cube_add_entity(
+    ecs_octree_t *ot,
     cube_t *cube,
     ecs_oct_entity_t *ce)
 {
-    ecs_vec_init_if_t(&cube->entities, ecs_oct_entity_t);
-    ecs_oct_entity_t *elem = ecs_vec_append_t(
-        NULL, &cube->entities, ecs_oct_entity_t);
-    *elem = *ce;
+    cube_entities_t *ents = &cube->entities;
+    if (ents->count == ents->size) {
+        cube_entities_grow(ot, cube);
+    }
+
+    int32_t index = ents->count ++;
+    ents->ids[index] = ce->id;
+    cube_entities_set(ents, index, ce->pos, ce->size);
+
+    ecs_map_ensure(&ot->locations, ce->id)[0] = OCT_LOC(cube->id, index);
 }
 
+/* Remove entity at index from cube. Does not remove the entity's location. */
 static
-cube_t* cube_insert(
+void cube_remove_entity(
     ecs_octree_t *ot,
-    ecs_oct_entity_t *ce,
     cube_t *cube,
-    vec3 cube_center,
-    float cube_size)
+    int32_t index)
 {
-    /* create private variable that can be modified during iteration */
-    vec3 center;
-    glm_vec3_copy(cube_center, center);
-    float size = cube_size / 2;
-    cube_t *cur = cube;
-    ecs_oct_entity_t e = *ce;
+    cube_entities_t *ents = &cube->entities;
+    int32_t i, last = -- ents->count;
+
+    if (index != last) {
+        /* Last entity is moved into the removed slot, update its location */
+        ecs_map_val_t *loc = ecs_map_get(&ot->locations, ents->ids[last]);
+        ecs_assert(loc != NULL, ECS_INTERNAL_ERROR, NULL);
+        loc[0] = OCT_LOC(cube->id, index);
+
+        ents->ids[index] = ents->ids[last];
+        for (i = 0; i < CUBE_LANE_COUNT; i ++) {
+            float *lane = cube_lane(ents, i);
+            lane[index] = lane[last];
+        }
+    }
+}
 
-    if (!is_inside(center, size, ce->pos, ce->size)) {
-        return NULL;
+/* Release cubes that no longer have entities or children */
+static
+void cube_prune(
+    ecs_octree_t *ot,
+    cube_t *cube)
+{
+    while (cube->parent && !cube->entities.count) {
+        int32_t i;
+        for (i = 0; i < 8; i ++) {
+            if (cube->nodes[i]) {
+                return;
+            }
+        }
+
+        cube_t *parent = cube->parent;
+        for (i = 0; i < 8; i ++) {
+            if (parent->nodes[i] == cube) {
+                parent->nodes[i] = NULL;
+                break;
+            }
+        }
+
+        free_cube(ot, cube);
+        cube = parent;
     }
+}
+
+static
+void cube_split(
+    ecs_octree_t *ot,
+    cube_t *cube);
+
+/* Find the cube in which an entity should be stored, starting from the
+ * provided cube. The entity must fit inside the provided cube. Splits leaf
+ * cubes and creates child cubes as necessary. */
+static
+cube_t* cube_locate(
+    ecs_octree_t *ot,
+    ecs_oct_entity_t *ce,
+    cube_t *cube)
+{
+    cube_t *cur = cube;
 
     do {
         bool is_leaf = cur->is_leaf;
 
         /* If cube is a leaf and has space, insert */
-        if (is_leaf && ecs_vec_count(&cur->entities) < MAX_PER_OCTANT) {
+        if (is_leaf && cur->entities.count < MAX_PER_OCTANT) {
             break;
         }
 
         /* Find next cube */
         vec3 child_center;
-        glm_vec3_copy(center, child_center);
-        float child_size = size / 2;
-        int8_t cube_i = next_cube_index(child_center, child_size, e.pos);
-        
+        glm_vec3_copy(cur->center, child_center);
+        float child_size = cur->size / 4;
+        int8_t cube_i = next_cube_index(child_center, child_size, ce->pos);
+
         /* If entity does not fit in child cube, insert into current */
-        if (!is_inside(child_center, child_size, e.pos, e.size)) {
+        if (!is_inside(child_center, child_size, ce->pos, ce->size)) {
             break;
         }
 
         /* Entity should not be inserted in current node. Check if node is a
          * leaf. If it is, split it up */
         if (is_leaf) {
-            cube_split(ot, cur, center, size * 2);
+            cube_split(ot, cur);
         }
 
         cube_t *next = cur->nodes[cube_i];
         if (!next) {
-            next = new_cube(ot, cur);
+            next = new_cube(ot, cur, child_center, child_size * 2);
             ecs_assert(next != cur, ECS_INTERNAL_ERROR, NULL);
 
             cur->nodes[cube_i] = next;
@@ -459,12 +844,23 @@ cube_t* cube_insert(
             ecs_assert(next != cur, ECS_INTERNAL_ERROR, NULL);
             cur = next;
         }
-
-        size = child_size;
-        glm_vec3_copy(child_center, center);
     } while (1);
 
-    cube_add_entity(cur, &e);
+    return cur;
+}
+
+static
+cube_t* cube_insert(
+    ecs_octree_t *ot,
+    ecs_oct_entity_t *ce,
+    cube_t *cube)
+{
+    if (!is_inside(cube->center, cube->size / 2, ce->pos, ce->size)) {
+        return NULL;
+    }
+
+    cube_t *cur = cube_locate(ot, ce, cube);
+    cube_add_entity(ot, cur, ce);
 
     return cur;
 }
@@ -472,52 +868,224 @@ cube_t* cube_insert(
 static
 void cube_split(
     ecs_octree_t *ot,
-    cube_t *cube,
-    vec3 center,
-    float size)
+    cube_t *cube)
 {
-    int32_t i, count = ecs_vec_count(&cube->entities);
+    int32_t i = 0;
 
     /* This will force entities to be pushed to child nodes */
     cube->is_leaf = false; 
 
-    for (i = 0; i < count; i ++) {
-        ecs_oct_entity_t *entities = ecs_vec_first_t(&cube->entities, ecs_oct_entity_t);
-        cube_t *new_cube = cube_insert(ot, &entities[i], cube, center, size);
-        ecs_assert(new_cube != NULL, ECS_INTERNAL_ERROR, NULL);
-
+    while (i < cube->entities.count) {
+        ecs_oct_entity_t e;
+        cube_entities_get(&cube->entities, i, &e);
+        cube_t *new_cube = cube_locate(ot, &e, cube);
         if (new_cube != cube) {
-            ecs_vec_remove_t(&cube->entities, ecs_oct_entity_t, i);
-            i --;
-            count --;
-            ecs_assert(count == ecs_vec_count(&cube->entities), ECS_INTERNAL_ERROR, NULL);
+            cube_remove_entity(ot, cube, i);
+            cube_add_entity(ot, new_cube, &e);
         } else {
-            ecs_vec_remove_last(&cube->entities);
+            i ++;
         }
     }
-
-    ecs_assert(count == ecs_vec_count(&cube->entities), ECS_INTERNAL_ERROR, NULL);
 }
 
 static
 void result_add_entity(
     ecs_vec_t *result,
-    ecs_oct_entity_t *e)
+    const cube_entities_t *ents,
+    int32_t index)
 {
     ecs_oct_entity_t *elem = ecs_vec_append_t(NULL, result, ecs_oct_entity_t);
-    *elem = *e;
+    cube_entities_get(ents, index, elem);
+}
+
+/* Overlap kernels append all entities in a cube that overlap with the query
+ * bounds to the result, starting from the provided index. */
+typedef void (*cube_overlap_fn)(
+    const cube_entities_t *ents,
+    int32_t start,
+    const vec3 q_min,
+    const vec3 q_max,
+    ecs_vec_t *result);
+
+static
+void cube_overlap_scalar(
+    const cube_entities_t *ents,
+    int32_t start,
+    const vec3 q_min,
+    const vec3 q_max,
+    ecs_vec_t *result)
+{
+    const float *x = cube_lane(ents, CUBE_X);
+    const float *y = cube_lane(ents, CUBE_Y);
+    const float *z = cube_lane(ents, CUBE_Z);
+    const float *sx = cube_lane(ents, CUBE_SIZE_X);
+    const float *sy = cube_lane(ents, CUBE_SIZE_Y);
+    const float *sz = cube_lane(ents, CUBE_SIZE_Z);
+
+    int32_t i, count = ents->count;
+    for (i = start; i < count; i ++) {
+        bool
+        result_x =  x[i] - sx[i] <= q_max[0];
+        result_x &= x[i] + sx[i] >= q_min[0];
+        bool
+        result_y =  y[i] - sy[i] <= q_max[1];
+        result_y &= y[i] + sy[i] >= q_min[1];
+        bool
+        result_z =  z[i] - sz[i] <= q_max[2];
+        result_z &= z[i] + sz[i] >= q_min[2];
+
+        if (result_x & result_y & result_z) {
+            result_add_entity(result, ents, i);
+        }
+    }
+}
+
+#ifdef OCT_SIMD_SSE
+static
+void cube_overlap_sse(
+    const cube_entities_t *ents,
+    int32_t start,
+    const vec3 q_min,
+    const vec3 q_max,
+    ecs_vec_t *result)
+{
+    const float *x = cube_lane(ents, CUBE_X);
+    const float *y = cube_lane(ents, CUBE_Y);
+    const float *z = cube_lane(ents, CUBE_Z);
+    const float *sx = cube_lane(ents, CUBE_SIZE_X);
+    const float *sy = cube_lane(ents, CUBE_SIZE_Y);
+    const float *sz = cube_lane(ents, CUBE_SIZE_Z);
+
+    __m128 min_x = _mm_set1_ps(q_min[0]), max_x = _mm_set1_ps(q_max[0]);
+    __m128 min_y = _mm_set1_ps(q_min[1]), max_y = _mm_set1_ps(q_max[1]);
+    __m128 min_z = _mm_set1_ps(q_min[2]), max_z = _mm_set1_ps(q_max[2]);
+
+    int32_t i, b, count = ents->count;
+    for (i = start; i + 4 <= count; i += 4) {
+        __m128 px = _mm_loadu_ps(&x[i]), ex = _mm_loadu_ps(&sx[i]);
+        __m128 py = _mm_loadu_ps(&y[i]), ey = _mm_loadu_ps(&sy[i]);
+        __m128 pz = _mm_loadu_ps(&z[i]), ez = _mm_loadu_ps(&sz[i]);
+
+        __m128 m = _mm_and_ps(
+            _mm_cmple_ps(_mm_sub_ps(px, ex), max_x),
+            _mm_cmpge_ps(_mm_add_ps(px, ex), min_x));
+        m = _mm_and_ps(m, _mm_and_ps(
+            _mm_cmple_ps(_mm_sub_ps(py, ey), max_y),
+            _mm_cmpge_ps(_mm_add_ps(py, ey), min_y)));
+        m = _mm_and_ps(m, _mm_and_ps(
+            _mm_cmple_ps(_mm_sub_ps(pz, ez), max_z),
+            _mm_cmpge_ps(_mm_add_ps(pz, ez), min_z)));
+
+        int mask = _mm_movemask_ps(m);
+        for (b = 0; mask; b ++, mask >>= 1) {
+            if (mask & 1) {
+                result_add_entity(result, ents, i + b);
+            }
+        }
+    }
+
+    cube_overlap_scalar(ents, i, q_min, q_max, result);
 }
+#endif
 
+#ifdef OCT_SIMD_AVX
+__attribute__((target("avx")))
 static
-void cube_find_all(
+void cube_overlap_avx(
+    const cube_entities_t *ents,
+    int32_t start,
+    const vec3 q_min,
+    const vec3 q_max,
+    ecs_vec_t *result)
+{
+    const float *x = cube_lane(ents, CUBE_X);
+    const float *y = cube_lane(ents, CUBE_Y);
+    const float *z = cube_lane(ents, CUBE_Z);
+    const float *sx = cube_lane(ents, CUBE_SIZE_X);
+    const float *sy = cube_lane(ents, CUBE_SIZE_Y);
+    const float *sz = cube_lane(ents, CUBE_SIZE_Z);
+
+    __m256 min_x = _mm256_set1_ps(q_min[0]), max_x = _mm256_set1_ps(q_max[0]);
+    __m256 min_y = _mm256_set1_ps(q_min[1]), max_y = _mm256_set1_ps(q_max[1]);
+    __m256 min_z = _mm256_set1_ps(q_min[2]), max_z = _mm256_set1_ps(q_max[2]);
+
+    int32_t i, b, count = ents->count;
+    for (i = start; i + 8 <= count; i += 8) {
+        __m256 px = _mm256_loadu_ps(&x[i]), ex = _mm256_loadu_ps(&sx[i]);
+        __m256 py = _mm256_loadu_ps(&y[i]), ey = _mm256_loadu_ps(&sy[i]);
+        __m256 pz = _mm256_loadu_ps(&z[i]), ez = _mm256_loadu_ps(&sz[i]);
+
+        __m256 m = _mm256_and_ps(
+            _mm256_cmp_ps(_mm256_sub_ps(px, ex), max_x, _CMP_LE_OQ),
+            _mm256_cmp_ps(_mm256_add_ps(px, ex), min_x, _CMP_GE_OQ));
+        m = _mm256_and_ps(m, _mm256_and_ps(
+            _mm256_cmp_ps(_mm256_sub_ps(py, ey), max_y, _CMP_LE_OQ),
+            _mm256_cmp_ps(_mm256_add_ps(py, ey), min_y, _CMP_GE_OQ)));
+        m = _mm256_and_ps(m, _mm256_and_ps(
+            _mm256_cmp_ps(_mm256_sub_ps(pz, ez), max_z, _CMP_LE_OQ),
+            _mm256_cmp_ps(_mm256_add_ps(pz, ez), min_z, _CMP_GE_OQ)));
+
+        int mask = _mm256_movemask_ps(m);
+        for (b = 0; mask; b ++, mask >>= 1) {
+            if (mask & 1) {
+                result_add_entity(result, ents, i + b);
+            }
+        }
+    }
+
+    /* Process remaining entities four at a time */
+    cube_overlap_sse(ents, i, q_min, q_max, result);
+}
+#endif
+
+static cube_overlap_fn cube_overlap = cube_overlap_scalar;
+
+/* Select the widest overlap kernel supported by the CPU */
+static
+void cube_overlap_init(void)
+{
+#ifdef OCT_SIMD_AVX
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")) {
+        cube_overlap = cube_overlap_avx;
+        return;
+    }
+#endif
+#ifdef OCT_SIMD_SSE
+    cube_overlap = cube_overlap_sse;
+#endif
+}
+
+/* Returns number of visited cubes */
+static
+int32_t cube_find_all(
     cube_t *cube,
     ecs_vec_t *result)
 {
-    ecs_vec_init_if_t(result, ecs_oct_entity_t);
-    ecs_oct_entity_t *entities = ecs_vec_first_t(&cube->entities, ecs_oct_entity_t);
-    int32_t i, count = ecs_vec_count(&cube->entities);
-    for (i = 0; i < count; i ++) {
-        result_add_entity(result, &entities[i]);
+    int32_t visited = 1;
+
+    /* Grow result once, and copy entities lane by lane */
+    const cube_entities_t *ents = &cube->entities;
+    int32_t i, count = ents->count;
+    if (count) {
+        ecs_oct_entity_t *elems = ecs_vec_grow_t(
+            NULL, result, ecs_oct_entity_t, count);
+
+        const float *x = cube_lane(ents, CUBE_X);
+        const float *y = cube_lane(ents, CUBE_Y);
+        const float *z = cube_lane(ents, CUBE_Z);
+        const float *sx = cube_lane(ents, CUBE_SIZE_X);
+        const float *sy = cube_lane(ents, CUBE_SIZE_Y);
+        const float *sz = cube_lane(ents, CUBE_SIZE_Z);
+        for (i = 0; i < count; i ++) {
+            elems[i].id = ents->ids[i];
+            elems[i].pos[0] = x[i];
+            elems[i].pos[1] = y[i];
+            elems[i].pos[2] = z[i];
+            elems[i].size[0] = sx[i];
+            elems[i].size[1] = sy[i];
+            elems[i].size[2] = sz[i];
+        }
     }
 
     for (i = 0; i < 8; i ++) {
@@ -526,32 +1094,31 @@ void cube_find_all(
             continue;
         }
 
-        cube_find_all(child, result);
+        visited += cube_find_all(child, result);
     }
+
+    return visited;
 }
 
+/* Returns number of visited cubes */
 static
-void cube_findn(
+int32_t cube_findn(
     cube_t *cube,
     vec3 center,
     float size,
     vec3 pos,
+    vec3 q_min,
+    vec3 q_max,
     float range,
     ecs_vec_t *result)
 {
     size /= 2;
 
-    ecs_vec_init_if_t(result, ecs_oct_entity_t);
-    ecs_oct_entity_t *entities = ecs_vec_first_t(&cube->entities, ecs_oct_entity_t);
-    int32_t i, count = ecs_vec_count(&cube->entities);
-
-    for (i = 0; i < count; i ++) {
-        ecs_oct_entity_t *e = &entities[i];
-        if (entity_overlaps(pos, range, e->pos, e->size)) {
-            result_add_entity(result, e);
-        }
+    if (cube->entities.count) {
+        cube_overlap(&cube->entities, 0, q_min, q_max, result);
     }
 
+    int32_t i, visited = 1;
     for (i = 0; i < 8; i ++) {
         cube_t *child = cube->nodes[i];
         if (!child) {
@@ -563,11 +1130,14 @@ void cube_findn(
         int overlap = cube_overlaps(child_center, size, pos, range);
 
         if (overlap == CONTAINS_CUBE) {
-            cube_find_all(child, result);
+            visited += cube_find_all(child, result);
         } else if (overlap) {
-            cube_findn(child, child_center, size, pos, range, result);
+            visited += cube_findn(child, child_center, size, pos, q_min, q_max, 
+                range, result);
         }
     }
+
+    return visited;
 }
 
 ecs_octree_t* ecs_octree_new(
@@ -577,7 +1147,15 @@ ecs_octree_t* ecs_octree_new(
     ecs_octree_t *result = ecs_os_calloc(sizeof(ecs_octree_t));
     glm_vec3_copy(center, result->center);
     result->size = size;
-    ecs_sparse_init_t(&result->cubes, cube_t);
+    glm_vec3_copy(center, result->root.center);
+    result->root.size = size;
+    result->root.entities.ids = result->root.inline_ids;
+    result->root.entities.lanes = result->root.inline_lanes;
+    result->root.entities.size = MAX_PER_OCTANT;
+    ecs_vec_init_t(NULL, &result->chunks, cube_t*, 0);
+    ecs_vec_init_t(NULL, &result->free_cubes, cube_t*, 0);
+    ecs_map_init(&result->locations, NULL);
+    cube_overlap_init();
     return result;
 }
 
@@ -586,32 +1164,82 @@ void ecs_octree_clear(
 {
     ecs_assert(ot != NULL, ECS_INVALID_PARAMETER, NULL);
 
-    /* Keep existing cubes intact so that we can reuse them when the octree is
-     * repopulated. This lets us keep the entity vectors, and should cause the
-     * octree memory to stabilize eventually. */
-    int32_t i, count = ecs_sparse_count(&ot->cubes);
-    for (i = 0; i < count; i ++) {
-        cube_t *cube = ecs_sparse_get_dense_t(&ot->cubes, cube_t, i);
-        ecs_vec_clear(&cube->entities);
-        ecs_os_memset_n(cube->nodes, 0, cube_t*, 8);
-
-        if (cube->parent) {
-            ecs_vec_init_if_t(&ot->free_cubes, cube_t*);
-            cube_t **cptr = ecs_vec_append_t(NULL, &ot->free_cubes, cube_t*);
-            *cptr = cube;
-            cube->parent = NULL;
-        }
-    }
+    /* Reset the arena without visiting cubes. Cubes are reinitialized when
+     * they are handed out again, which keeps their entity storage so that the
+     * octree memory stabilizes eventually. */
+    ot->cube_count = 0;
+    ecs_vec_clear(&ot->free_cubes);
 
     /* Clear entities of root */
-    ecs_vec_clear(&ot->root.entities);
+    ot->root.entities.count = 0;
     ecs_os_memset_n(ot->root.nodes, 0, cube_t*, 8);
+    ecs_map_clear(&ot->locations);
     ot->count = 0;
 }
 
 void ecs_octree_free(
     ecs_octree_t *ot)
 {
+    ecs_assert(ot != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    cube_t **chunks = ecs_vec_first_t(&ot->chunks, cube_t*);
+    int32_t i, c, count = ecs_vec_count(&ot->chunks);
+    for (c = 0; c < count; c ++) {
+        for (i = 0; i < OCT_CHUNK_SIZE; i ++) {
+            cube_entities_fini(&chunks[c][i]);
+        }
+        ecs_os_free(chunks[c]);
+    }
+
+    cube_entities_fini(&ot->root);
+    ecs_vec_fini_t(NULL, &ot->chunks, cube_t*);
+    ecs_vec_fini_t(NULL, &ot->free_cubes, cube_t*);
+    ecs_map_fini(&ot->locations);
+    ecs_os_free(ot);
+}
+
+static
+void cube_stats(
+    const cube_t *cube,
+    int32_t depth,
+    ecs_octree_stats_t *stats)
+{
+    int32_t i, count = cube->entities.count;
+    if (count) {
+        stats->leaf_count ++;
+        if (count > stats->max_leaf_entities) {
+            stats->max_leaf_entities = count;
+        }
+    }
+
+    if (depth > stats->depth) {
+        stats->depth = depth;
+    }
+
+    for (i = 0; i < 8; i ++) {
+        if (cube->nodes[i]) {
+            cube_stats(cube->nodes[i], depth + 1, stats);
+        }
+    }
+}
+
+void ecs_octree_stats(
+    const ecs_octree_t *ot,
+    ecs_octree_stats_t *stats)
+{
+    ecs_assert(ot != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(stats != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_os_zeromem(stats);
+    cube_stats(&ot->root, 1, stats);
+
+    stats->entity_count = ot->count;
+    stats->cube_count = ot->cube_count - ecs_vec_count(&ot->free_cubes);
+    stats->cube_high_water = ot->high_water;
+    stats->chunk_count = ecs_vec_count(&ot->chunks);
+    stats->memory = ECS_SIZEOF(ecs_octree_t) + ot->heap_size +
+        stats->chunk_count * OCT_CHUNK_SIZE * ECS_SIZEOF(cube_t);
+    stats->dropped = ot->dropped;
 }
 
 int32_t ecs_octree_insert(
@@ -626,31 +1254,327 @@ int32_t ecs_octree_insert(
     ce.id = e;
     glm_vec3_copy(e_pos, ce.pos);
     glm_vec3_copy(e_size, ce.size);
-    cube_t *cube = cube_insert(ot, &ce, &ot->root, ot->center, ot->size);
+    cube_t *cube = cube_insert(ot, &ce, &ot->root);
     if (cube) {
         ot->count ++;
         return cube->id;
     } else {
+        ot->dropped ++;
         return -1;
     }
 }
 
-void ecs_octree_findn(
+int32_t ecs_octree_update(
     ecs_octree_t *ot,
-    vec3 pos,
-    float range,
-    ecs_vec_t *result)
+    ecs_entity_t e,
+    vec3 e_pos,
+    vec3 e_size)
 {
     ecs_assert(ot != NULL, ECS_INVALID_PARAMETER, NULL);
 
-    ecs_vec_clear(result);
-    cube_findn(&ot->root, ot->center, ot->size / 2, pos, range, result);
-}
+    ecs_map_val_t *loc = ecs_map_get(&ot->locations, e);
+    if (!loc) {
+        return ecs_octree_insert(ot, e, e_pos, e_size);
+    }
 
-static
-int cube_dump(
-    cube_t *cube,
-    vec3 center,
+    cube_t *cube = get_cube(ot, OCT_LOC_CUBE(loc[0]));
+    int32_t index = OCT_LOC_INDEX(loc[0]);
+    ecs_assert(cube->entities.ids[index] == e, ECS_INTERNAL_ERROR, NULL);
+    cube_entities_set(&cube->entities, index, e_pos, e_size);
+
+    /* Fast path: entity is still inside the bounds of its current cube */
+    if (is_inside(cube->center, cube->size / 2, e_pos, e_size)) {
+        return cube->id;
+    }
+
+    /* Entity left its cube. Find the closest ancestor that contains it, and
+     * reinsert it from there. */
+    ecs_oct_entity_t moved;
+    cube_entities_get(&cube->entities, index, &moved);
+    cube_remove_entity(ot, cube, index);
+
+    cube_t *dst = cube->parent;
+    while (dst && !is_inside(dst->center, dst->size / 2, e_pos, e_size)) {
+        dst = dst->parent;
+    }
+
+    cube_t *result = NULL;
+    if (dst) {
+        result = cube_insert(ot, &moved, dst);
+        ecs_assert(result != NULL, ECS_INTERNAL_ERROR, NULL);
+    } else {
+        /* Entity moved outside of the octree bounds */
+        ecs_map_remove(&ot->locations, e);
+        ot->count --;
+        ot->dropped ++;
+    }
+
+    cube_prune(ot, cube);
+
+    return result ? result->id : -1;
+}
+
+void ecs_octree_remove(
+    ecs_octree_t *ot,
+    ecs_entity_t e)
+{
+    ecs_assert(ot != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_map_val_t *loc = ecs_map_get(&ot->locations, e);
+    if (!loc) {
+        return;
+    }
+
+    cube_t *cube = get_cube(ot, OCT_LOC_CUBE(loc[0]));
+    cube_remove_entity(ot, cube, OCT_LOC_INDEX(loc[0]));
+    ecs_map_remove(&ot->locations, e);
+    ot->count --;
+
+    cube_prune(ot, cube);
+}
+
+/* Append entities that overlap with the query to result. Returns number of
+ * visited cubes. */
+static
+int32_t octree_findn(
+    ecs_octree_t *ot,
+    vec3 pos,
+    float range,
+    ecs_vec_t *result)
+{
+    vec3 q_min = { pos[0] - range, pos[1] - range, pos[2] - range };
+    vec3 q_max = { pos[0] + range, pos[1] + range, pos[2] + range };
+    return cube_findn(&ot->root, ot->center, ot->size / 2, 
+        pos, q_min, q_max, range, result);
+}
+
+void ecs_octree_findn(
+    ecs_octree_t *ot,
+    vec3 pos,
+    float range,
+    ecs_vec_t *result)
+{
+    ecs_assert(ot != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_vec_init_if_t(result, ecs_oct_entity_t);
+    ecs_vec_clear(result);
+    octree_findn(ot, pos, range, result);
+}
+
+/* Insert candidate into result array that is sorted by distance. Returns new
+ * number of elements in the result array. */
+static
+int32_t nearest_insert(
+    ecs_oct_nearest_t *result,
+    int32_t count,
+    int32_t k,
+    ecs_entity_t id,
+    float dist_sq)
+{
+    int32_t i = count < k ? count : k - 1;
+    while (i > 0 && result[i - 1].dist_sq > dist_sq) {
+        result[i] = result[i - 1];
+        i --;
+    }
+
+    result[i].id = id;
+    result[i].dist_sq = dist_sq;
+    return count < k ? count + 1 : k;
+}
+
+/* Squared distance between a point and the bounds of a cube */
+static
+float cube_dist_sq(
+    cube_t *cube,
+    vec3 pos)
+{
+    float half = cube->size / 2, result = 0;
+    int i;
+    for (i = 0; i < 3; i ++) {
+        float d = fabsf(pos[i] - cube->center[i]) - half;
+        if (d > 0) {
+            result += d * d;
+        }
+    }
+    return result;
+}
+
+typedef struct cube_visit_t {
+    cube_t *cube;
+    float dist_sq;
+} cube_visit_t;
+
+#define CUBE_VISIT_STACK_SIZE (64)
+
+/* Min-heap of cubes ordered by distance to the query position. Starts out on
+ * the stack, and is moved to the heap if the tree is very deep. */
+typedef struct cube_queue_t {
+    cube_visit_t *elems;
+    int32_t count;
+    int32_t size;
+    cube_visit_t buffer[CUBE_VISIT_STACK_SIZE];
+} cube_queue_t;
+
+static
+void cube_queue_push(
+    cube_queue_t *q,
+    cube_t *cube,
+    float dist_sq)
+{
+    if (q->count == q->size) {
+        int32_t size = q->size * 2;
+        if (q->elems == q->buffer) {
+            q->elems = ecs_os_malloc_n(cube_visit_t, size);
+            ecs_os_memcpy_n(q->elems, q->buffer, cube_visit_t, q->count);
+        } else {
+            q->elems = ecs_os_realloc_n(q->elems, cube_visit_t, size);
+        }
+        q->size = size;
+    }
+
+    int32_t i = q->count ++;
+    while (i) {
+        int32_t parent = (i - 1) / 2;
+        if (q->elems[parent].dist_sq <= dist_sq) {
+            break;
+        }
+        q->elems[i] = q->elems[parent];
+        i = parent;
+    }
+
+    q->elems[i].cube = cube;
+    q->elems[i].dist_sq = dist_sq;
+}
+
+static
+cube_visit_t cube_queue_pop(
+    cube_queue_t *q)
+{
+    cube_visit_t result = q->elems[0];
+    cube_visit_t last = q->elems[-- q->count];
+    int32_t i = 0, count = q->count;
+
+    while (true) {
+        int32_t child = i * 2 + 1;
+        if (child >= count) {
+            break;
+        }
+        if (child + 1 < count && 
+            q->elems[child + 1].dist_sq < q->elems[child].dist_sq) 
+        {
+            child ++;
+        }
+        if (last.dist_sq <= q->elems[child].dist_sq) {
+            break;
+        }
+        q->elems[i] = q->elems[child];
+        i = child;
+    }
+
+    if (count) {
+        q->elems[i] = last;
+    }
+
+    return result;
+}
+
+/* Stores number of visited cubes in visited */
+static
+int32_t octree_find_knn(
+    ecs_octree_t *ot,
+    vec3 pos,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result,
+    int32_t *visited)
+{
+    cube_queue_t q;
+    q.elems = q.buffer;
+    q.count = 0;
+    q.size = CUBE_VISIT_STACK_SIZE;
+
+    /* Best first traversal: always visit the cube closest to the position
+     * next, and stop once the closest cube is further away than the k-th
+     * closest entity found so far. */
+    float max_dist_sq = max_range * max_range;
+    int32_t count = 0;
+    cube_queue_push(&q, &ot->root, cube_dist_sq(&ot->root, pos));
+
+    while (q.count) {
+        cube_visit_t v = cube_queue_pop(&q);
+        float worst = count == k ? result[k - 1].dist_sq : max_dist_sq;
+        if (v.dist_sq > worst) {
+            break;
+        }
+
+        cube_t *cube = v.cube;
+        cube_entities_t *ents = &cube->entities;
+        (*visited) ++;
+        const float *x = cube_lane(ents, CUBE_X);
+        const float *y = cube_lane(ents, CUBE_Y);
+        const float *z = cube_lane(ents, CUBE_Z);
+        int32_t i, e_count = ents->count;
+        for (i = 0; i < e_count; i ++) {
+            float dx = x[i] - pos[0], dy = y[i] - pos[1], dz = z[i] - pos[2];
+            float dist_sq = dx * dx + dy * dy + dz * dz;
+            if (dist_sq > max_dist_sq) {
+                continue;
+            }
+            if (count == k && dist_sq >= result[k - 1].dist_sq) {
+                continue;
+            }
+            count = nearest_insert(result, count, k, ents->ids[i], dist_sq);
+        }
+
+        worst = count == k ? result[k - 1].dist_sq : max_dist_sq;
+        for (i = 0; i < 8; i ++) {
+            cube_t *child = cube->nodes[i];
+            if (!child) {
+                continue;
+            }
+
+            float dist_sq = cube_dist_sq(child, pos);
+            if (dist_sq <= worst) {
+                cube_queue_push(&q, child, dist_sq);
+            }
+        }
+    }
+
+    if (q.elems != q.buffer) {
+        ecs_os_free(q.elems);
+    }
+
+    return count;
+}
+
+int32_t ecs_octree_find_knn(
+    ecs_octree_t *ot,
+    vec3 pos,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result)
+{
+    ecs_assert(ot != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(k > 0, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(result != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    int32_t visited = 0;
+    return octree_find_knn(ot, pos, max_range, k, result, &visited);
+}
+
+bool ecs_octree_find_nearest(
+    ecs_octree_t *ot,
+    vec3 pos,
+    float max_range,
+    ecs_oct_nearest_t *result)
+{
+    return ecs_octree_find_knn(ot, pos, max_range, 1, result) != 0;
+}
+
+static
+int cube_dump(
+    cube_t *cube,
+    vec3 center,
     float size)
 {
     vec3 c;
@@ -666,7 +1590,7 @@ int cube_dump(
         }
     }
 
-    return ecs_vec_count(&cube->entities) + count;
+    return cube->entities.count + count;
 }
 
 int32_t ecs_octree_dump(
@@ -680,111 +1604,1401 @@ int32_t ecs_octree_dump(
 }
 
 
-struct ecs_squery_t {
-    ecs_query_t *q;
-    ecs_octree_t *ot;
+struct ecs_sgrid_t {
+    ecs_vec_t *cells;    /* width * width cells with ecs_oct_entity_t */
+    ecs_map_t locations; /* entity -> (cell, index in cell) */
+    vec3 center;
+    float size;
+    float cell_size;
+    float inv_cell_size;
+    float min_x;
+    float min_z;
+    float max_extent;    /* Largest horizontal half extent of an entity */
+    int32_t width;
+    int32_t count;
+
+    /* Kept up to date on insert and remove, so that statistics don't have to
+     * visit all cells, which is expensive for large grids. */
+    int32_t used_cell_count;
+    int32_t max_cell_entities;
+    ecs_size_t cell_memory;
 };
 
-#define EXPR_PREFIX\
-    "[in] flecs.components.transform.Position3,"\
-    "[in] (flecs.components.physics.Collider, flecs.components.geometry.Box) || flecs.components.geometry.Box,"
+#define GRID_LOC(cell, index) (((uint64_t)(uint32_t)(cell) << 32) | (uint32_t)(index))
+#define GRID_LOC_CELL(loc) ((int32_t)((loc) >> 32))
+#define GRID_LOC_INDEX(loc) ((int32_t)((loc) & 0xFFFFFFFF))
 
-ecs_squery_t* ecs_squery_new(
-    ecs_world_t *world,
-    ecs_id_t filter,
+/* Convert coordinate to cell coordinate. Coordinates outside of the grid are
+ * clamped to the border cells, so entities are never dropped. */
+static
+int32_t grid_coord(
+    const ecs_sgrid_t *g,
+    float min,
+    float coord)
+{
+    int32_t result = (int32_t)floorf((coord - min) * g->inv_cell_size);
+    if (result < 0) {
+        return 0;
+    }
+    if (result >= g->width) {
+        return g->width - 1;
+    }
+    return result;
+}
+
+static
+int32_t grid_cell(
+    const ecs_sgrid_t *g,
+    vec3 pos)
+{
+    int32_t x = grid_coord(g, g->min_x, pos[0]);
+    int32_t z = grid_coord(g, g->min_z, pos[2]);
+    return z * g->width + x;
+}
+
+static
+bool grid_entity_overlaps(
+    vec3 pos,
+    float range,
+    vec3 e_pos,
+    vec3 e_size)
+{
+    bool
+    result =  fabsf(e_pos[0] - pos[0]) <= range + e_size[0];
+    result &= fabsf(e_pos[1] - pos[1]) <= range + e_size[1];
+    result &= fabsf(e_pos[2] - pos[2]) <= range + e_size[2];
+    return result;
+}
+
+static
+void grid_add_entity(
+    ecs_sgrid_t *g,
+    int32_t cell,
+    ecs_oct_entity_t *ge)
+{
+    ecs_vec_t *v = &g->cells[cell];
+    ecs_vec_init_if_t(v, ecs_oct_entity_t);
+    int32_t index = ecs_vec_count(v);
+    int32_t size = ecs_vec_size(v);
+    ecs_oct_entity_t *elem = ecs_vec_append_t(NULL, v, ecs_oct_entity_t);
+    *elem = *ge;
+
+    g->cell_memory += (ecs_vec_size(v) - size) * ECS_SIZEOF(ecs_oct_entity_t);
+    if (!index) {
+        g->used_cell_count ++;
+    }
+    if (index >= g->max_cell_entities) {
+        g->max_cell_entities = index + 1;
+    }
+
+    ecs_map_ensure(&g->locations, ge->id)[0] = GRID_LOC(cell, index);
+
+    float extent = glm_max(ge->size[0], ge->size[2]);
+    if (extent > g->max_extent) {
+        g->max_extent = extent;
+    }
+}
+
+static
+void grid_remove_entity(
+    ecs_sgrid_t *g,
+    int32_t cell,
+    int32_t index)
+{
+    ecs_vec_t *v = &g->cells[cell];
+    int32_t last = ecs_vec_count(v) - 1;
+    ecs_oct_entity_t *entities = ecs_vec_first_t(v, ecs_oct_entity_t);
+
+    if (index != last) {
+        /* Last entity is moved into the removed slot, update its location */
+        ecs_map_val_t *loc = ecs_map_get(&g->locations, entities[last].id);
+        ecs_assert(loc != NULL, ECS_INTERNAL_ERROR, NULL);
+        loc[0] = GRID_LOC(cell, index);
+    }
+
+    ecs_vec_remove_t(v, ecs_oct_entity_t, index);
+    if (!last) {
+        g->used_cell_count --;
+    }
+}
+
+ecs_sgrid_t* ecs_sgrid_new(
     vec3 center,
-    float size)
+    float size,
+    float cell_size)
 {
-    ecs_assert(world != NULL, ECS_INVALID_PARAMETER, NULL);
     ecs_assert(size > 0, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(cell_size > 0, ECS_INVALID_PARAMETER, NULL);
 
-    ecs_squery_t *result = ecs_os_calloc(sizeof(ecs_squery_t));
+    ecs_sgrid_t *result = ecs_os_calloc_t(ecs_sgrid_t);
+    glm_vec3_copy(center, result->center);
+    result->size = size;
+    result->cell_size = cell_size;
+    result->inv_cell_size = 1.0f / cell_size;
+    result->min_x = center[0] - size / 2;
+    result->min_z = center[2] - size / 2;
+    result->width = (int32_t)ceilf(size / cell_size);
+    if (!result->width) {
+        result->width = 1;
+    }
 
-    result->q = ecs_query(world, {
-        .terms = {
-            { ecs_id(EcsPosition3), .inout = EcsIn },
-            { ecs_pair(EcsCollider, ecs_id(EcsBox)), .inout = EcsIn, .oper = EcsOr }, 
-            { ecs_id(EcsBox) },
-            { filter, .inout = EcsIn }
-        },
-        .cache_kind = EcsQueryCacheAuto
-    });
+    result->cells = ecs_os_calloc_n(ecs_vec_t, result->width * result->width);
+    ecs_map_init(&result->locations, NULL);
+    return result;
+}
 
-    result->ot = ecs_octree_new(center, size);
+void ecs_sgrid_free(
+    ecs_sgrid_t *g)
+{
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
 
-    ecs_assert(result->q != NULL, ECS_INTERNAL_ERROR, NULL);
-    ecs_assert(result->ot != NULL, ECS_INTERNAL_ERROR, NULL);
+    int32_t i, count = g->width * g->width;
+    for (i = 0; i < count; i ++) {
+        ecs_vec_fini_t(NULL, &g->cells[i], ecs_oct_entity_t);
+    }
 
-    return result;
+    ecs_map_fini(&g->locations);
+    ecs_os_free(g->cells);
+    ecs_os_free(g);
 }
 
-void ecs_squery_free(
-    ecs_squery_t *sq)
+void ecs_sgrid_stats(
+    const ecs_sgrid_t *g,
+    ecs_sgrid_stats_t *stats)
 {
-    ecs_query_fini(sq->q);
-    ecs_octree_free(sq->ot);
-    ecs_os_free(sq);
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(stats != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_os_zeromem(stats);
+    stats->entity_count = g->count;
+    stats->cell_count = g->width * g->width;
+    stats->used_cell_count = g->used_cell_count;
+    stats->max_cell_entities = g->max_cell_entities;
+    stats->memory = ECS_SIZEOF(ecs_sgrid_t) + 
+        stats->cell_count * ECS_SIZEOF(ecs_vec_t) + g->cell_memory;
 }
 
-void ecs_squery_update(
-    ecs_squery_t *sq)
+void ecs_sgrid_clear(
+    ecs_sgrid_t *g)
 {
-    ecs_assert(sq != NULL,     ECS_INVALID_PARAMETER, NULL);
-    ecs_assert(sq->q != NULL,  ECS_INVALID_PARAMETER, NULL);
-    ecs_assert(sq->ot != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
 
-    if (ecs_query_changed(sq->q)) {
-        ecs_octree_clear(sq->ot);
+    /* Keep cell vectors so memory stabilizes when the grid is repopulated */
+    int32_t i, count = g->width * g->width;
+    for (i = 0; i < count; i ++) {
+        ecs_vec_clear(&g->cells[i]);
+    }
 
-        const ecs_world_t *world = ecs_get_world(sq->q);
-        ecs_iter_t it = ecs_query_iter(world, sq->q);
-        while (ecs_query_next(&it)) {
-            EcsPosition3 *p = ecs_field(&it, EcsPosition3, 0);
-            EcsBox *b = ecs_field(&it, EcsBox, 1);
-
-            if (ecs_field_is_self(&it, 1)) {
-                int i;
-                for (i = 0; i < it.count; i ++) {
-                    vec3 vp, vs;
-                    vp[0] = p[i].x;
-                    vp[1] = p[i].y;
-                    vp[2] = p[i].z;
-
-                    vs[0] = b[i].width;
-                    vs[1] = b[i].height;
-                    vs[2] = b[i].depth;
-
-                    ecs_octree_insert(sq->ot, it.entities[i], vp, vs);
-                }
-            } else {
-                int i;
-                for (i = 0; i < it.count; i ++) {
-                    vec3 vp, vs;
-                    vp[0] = p[i].x;
-                    vp[1] = p[i].y;
-                    vp[2] = p[i].z;
-
-                    vs[0] = b->width;
-                    vs[1] = b->height;
-                    vs[2] = b->depth;
-
-                    ecs_octree_insert(sq->ot, it.entities[i], vp, vs);
+    ecs_map_clear(&g->locations);
+    g->max_extent = 0;
+    g->count = 0;
+    g->used_cell_count = 0;
+    g->max_cell_entities = 0;
+}
+
+int32_t ecs_sgrid_insert(
+    ecs_sgrid_t *g,
+    ecs_entity_t e,
+    vec3 e_pos,
+    vec3 e_size)
+{
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(!ecs_map_get(&g->locations, e), ECS_INVALID_PARAMETER, NULL);
+
+    ecs_oct_entity_t ge;
+    ge.id = e;
+    glm_vec3_copy(e_pos, ge.pos);
+    glm_vec3_copy(e_size, ge.size);
+
+    int32_t cell = grid_cell(g, e_pos);
+    grid_add_entity(g, cell, &ge);
+    g->count ++;
+    return cell;
+}
+
+int32_t ecs_sgrid_update(
+    ecs_sgrid_t *g,
+    ecs_entity_t e,
+    vec3 e_pos,
+    vec3 e_size)
+{
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_map_val_t *loc = ecs_map_get(&g->locations, e);
+    if (!loc) {
+        return ecs_sgrid_insert(g, e, e_pos, e_size);
+    }
+
+    int32_t cell = GRID_LOC_CELL(loc[0]);
+    int32_t index = GRID_LOC_INDEX(loc[0]);
+    ecs_oct_entity_t *ge = ecs_vec_get_t(
+        &g->cells[cell], ecs_oct_entity_t, index);
+    ecs_assert(ge->id == e, ECS_INTERNAL_ERROR, NULL);
+    glm_vec3_copy(e_pos, ge->pos);
+    glm_vec3_copy(e_size, ge->size);
+
+    int32_t new_cell = grid_cell(g, e_pos);
+    if (new_cell == cell) {
+        float extent = glm_max(e_size[0], e_size[2]);
+        if (extent > g->max_extent) {
+            g->max_extent = extent;
+        }
+        return cell;
+    }
+
+    ecs_oct_entity_t moved = *ge;
+    grid_remove_entity(g, cell, index);
+    grid_add_entity(g, new_cell, &moved);
+    return new_cell;
+}
+
+void ecs_sgrid_remove(
+    ecs_sgrid_t *g,
+    ecs_entity_t e)
+{
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_map_val_t *loc = ecs_map_get(&g->locations, e);
+    if (!loc) {
+        return;
+    }
+
+    grid_remove_entity(g, GRID_LOC_CELL(loc[0]), GRID_LOC_INDEX(loc[0]));
+    ecs_map_remove(&g->locations, e);
+    g->count --;
+}
+
+/* Append entities that overlap with the query to result. Returns number of
+ * visited cells. */
+static
+int32_t sgrid_findn(
+    ecs_sgrid_t *g,
+    vec3 pos,
+    float range,
+    ecs_vec_t *result)
+{
+    /* Entities are stored in the cell that contains their center, so extend
+     * the range with the largest entity extent to find overlapping entities
+     * stored in neighbouring cells. */
+    float r = range + g->max_extent;
+    int32_t x_min = grid_coord(g, g->min_x, pos[0] - r);
+    int32_t x_max = grid_coord(g, g->min_x, pos[0] + r);
+    int32_t z_min = grid_coord(g, g->min_z, pos[2] - r);
+    int32_t z_max = grid_coord(g, g->min_z, pos[2] + r);
+
+    int32_t x, z;
+    for (z = z_min; z <= z_max; z ++) {
+        ecs_vec_t *row = &g->cells[z * g->width];
+        for (x = x_min; x <= x_max; x ++) {
+            ecs_vec_t *v = &row[x];
+            ecs_oct_entity_t *entities = ecs_vec_first_t(v, ecs_oct_entity_t);
+            int32_t i, count = ecs_vec_count(v);
+            for (i = 0; i < count; i ++) {
+                ecs_oct_entity_t *e = &entities[i];
+                if (grid_entity_overlaps(pos, range, e->pos, e->size)) {
+                    ecs_oct_entity_t *elem = ecs_vec_append_t(
+                        NULL, result, ecs_oct_entity_t);
+                    *elem = *e;
                 }
             }
         }
     }
+
+    return (x_max - x_min + 1) * (z_max - z_min + 1);
 }
 
-void ecs_squery_findn(
-    const ecs_squery_t *sq,
-    vec3 position,
+void ecs_sgrid_findn(
+    ecs_sgrid_t *g,
+    vec3 pos,
     float range,
     ecs_vec_t *result)
 {
-    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
-    ecs_assert(sq->q != NULL, ECS_INVALID_PARAMETER, NULL);
-    ecs_assert(sq->ot != NULL, ECS_INVALID_PARAMETER, NULL);    
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
 
-    ecs_octree_findn(sq->ot, position, range, result);
+    ecs_vec_init_if_t(result, ecs_oct_entity_t);
+    ecs_vec_clear(result);
+    sgrid_findn(g, pos, range, result);
 }
 
+/* Stores number of visited cells in visited */
+static
+int32_t sgrid_find_knn(
+    ecs_sgrid_t *g,
+    vec3 pos,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result,
+    int32_t *visited)
+{
+    float max_dist_sq = max_range * max_range;
+    int32_t cx = grid_coord(g, g->min_x, pos[0]);
+    int32_t cz = grid_coord(g, g->min_z, pos[2]);
+    int32_t count = 0, r;
+
+    /* Visit rings of cells around the cell that contains the position. After
+     * visiting ring r, all entities in cells that have not been visited yet
+     * are at least as far away as the edge of the visited square. */
+    for (r = 0; ; r ++) {
+        int32_t x_min = cx - r, x_max = cx + r;
+        int32_t z_min = cz - r, z_max = cz + r;
+        int32_t x, z;
+
+        for (z = z_min; z <= z_max; z ++) {
+            if (z < 0 || z >= g->width) {
+                continue;
+            }
+
+            /* Inner rows only have cells on the edge of the ring */
+            bool z_edge = z == z_min || z == z_max;
+            int32_t step = z_edge ? 1 : x_max - x_min;
+            for (x = x_min; x <= x_max; x += step) {
+                if (x < 0 || x >= g->width) {
+                    continue;
+                }
+
+                ecs_vec_t *v = &g->cells[z * g->width + x];
+                ecs_oct_entity_t *entities = ecs_vec_first_t(
+                    v, ecs_oct_entity_t);
+                (*visited) ++;
+                int32_t i, e_count = ecs_vec_count(v);
+                for (i = 0; i < e_count; i ++) {
+                    float dist_sq = glm_vec3_distance2(pos, entities[i].pos);
+                    if (dist_sq > max_dist_sq) {
+                        continue;
+                    }
+                    if (count == k && dist_sq >= result[k - 1].dist_sq) {
+                        continue;
+                    }
+                    count = nearest_insert(
+                        result, count, k, entities[i].id, dist_sq);
+                }
+            }
+        }
+
+        /* Compute distance to closest cell that hasn't been visited. Sides
+         * that reached the grid border have no more cells to visit. */
+        float bound = FLT_MAX;
+        if (x_min > 0) {
+            bound = glm_min(bound, pos[0] - (g->min_x + x_min * g->cell_size));
+        }
+        if (x_max < g->width - 1) {
+            bound = glm_min(bound, 
+                (g->min_x + (x_max + 1) * g->cell_size) - pos[0]);
+        }
+        if (z_min > 0) {
+            bound = glm_min(bound, pos[2] - (g->min_z + z_min * g->cell_size));
+        }
+        if (z_max < g->width - 1) {
+            bound = glm_min(bound, 
+                (g->min_z + (z_max + 1) * g->cell_size) - pos[2]);
+        }
+
+        if (bound == FLT_MAX) {
+            break; /* Visited all cells */
+        }
+
+        bound = glm_max(bound, 0);
+        float bound_sq = bound * bound;
+        if (bound_sq > max_dist_sq) {
+            break;
+        }
+        if (count == k && bound_sq >= result[k - 1].dist_sq) {
+            break;
+        }
+    }
+
+    return count;
+}
+
+int32_t ecs_sgrid_find_knn(
+    ecs_sgrid_t *g,
+    vec3 pos,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result)
+{
+    ecs_assert(g != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(k > 0, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(result != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    int32_t visited = 0;
+    return sgrid_find_knn(g, pos, max_range, k, result, &visited);
+}
+
+bool ecs_sgrid_find_nearest(
+    ecs_sgrid_t *g,
+    vec3 pos,
+    float max_range,
+    ecs_oct_nearest_t *result)
+{
+    return ecs_sgrid_find_knn(g, pos, max_range, 1, result) != 0;
+}
+
+
+/* Shared between a spatial query and its observer, so that the observer can
+ * outlive the spatial query without accessing freed memory. */
+typedef struct squery_link_t {
+    ecs_squery_t *sq;
+} squery_link_t;
+
+/* Work done by finds since the last call to ecs_squery_stats_reset. Counted
+ * per stage, so that stages can search the same query at the same time.
+ * Padded so that counters of different stages don't share a cache line. */
+typedef struct squery_counters_t {
+    int64_t query_count;
+    int64_t nodes_visited;
+    int64_t result_count;
+    char padding[40];
+} squery_counters_t;
+
+struct ecs_squery_t {
+    ecs_world_t *world;
+    ecs_query_t *q;
+    ecs_octree_t *ot;   /* Set for EcsSpatialQueryOctree */
+    ecs_sgrid_t *grid;  /* Set for EcsSpatialQueryGrid */
+    ecs_entity_t observer;
+    squery_link_t *link;
+    vec3 center;
+    float size;
+    bool dirty;
+
+    /* Statistics since last call to ecs_squery_stats_reset */
+    float update_time;
+    ecs_vec_t counters; /* squery_counters_t, one per stage */
+};
+
+#define EXPR_PREFIX\
+    "[in] flecs.components.transform.Position3,"\
+    "[in] (flecs.components.physics.Collider, flecs.components.geometry.Box) || flecs.components.geometry.Box,"
+
+static
+void squery_on_remove(
+    ecs_iter_t *it)
+{
+    squery_link_t *link = it->ctx;
+    if (!link->sq) {
+        return;
+    }
+
+    ecs_squery_t *sq = link->sq;
+    int i;
+    for (i = 0; i < it->count; i ++) {
+        if (sq->grid) {
+            ecs_sgrid_remove(sq->grid, it->entities[i]);
+        } else {
+            ecs_octree_remove(sq->ot, it->entities[i]);
+        }
+    }
+}
+
+static
+void squery_link_free(
+    void *ptr)
+{
+    ecs_os_free(ptr);
+}
+
+/* Make sure there are counters for each stage. Called from the main thread,
+ * before stages search the query. */
+static
+void squery_counters_init(
+    ecs_squery_t *sq)
+{
+    int32_t stage_count = ecs_get_stage_count(sq->world);
+    ecs_vec_set_min_count_zeromem_t(NULL, &sq->counters, squery_counters_t,
+        stage_count ? stage_count : 1);
+}
+
+/* Lazily updating the index while stages search it would race with their
+ * finds, so a query that stages search must be updated before they run. */
+static
+void squery_sync(
+    ecs_squery_t *sq)
+{
+    if (sq->dirty) {
+        ecs_assert(!(ecs_world_get_flags(sq->world) & EcsWorldMultiThreaded),
+            ECS_INVALID_OPERATION, 
+            "spatial query must be updated before it is searched by stages");
+        ecs_squery_update(sq);
+    }
+}
+
+static
+squery_counters_t* squery_counters(
+    ecs_squery_t *sq,
+    const ecs_world_t *world)
+{
+    int32_t stage = ecs_stage_get_id(world);
+    ecs_assert(stage < ecs_vec_count(&sq->counters), ECS_INVALID_OPERATION,
+        "spatial query must be updated after changing the number of threads");
+    return ecs_vec_get_t(&sq->counters, squery_counters_t, stage);
+}
+
+static
+ecs_squery_t* squery_new(
+    ecs_world_t *world,
+    ecs_id_t filter,
+    vec3 center,
+    float size)
+{
+    ecs_squery_t *result = ecs_os_calloc(sizeof(ecs_squery_t));
+    result->world = world;
+    glm_vec3_copy(center, result->center);
+    result->size = size;
+
+    result->q = ecs_query(world, {
+        .terms = {
+            { ecs_id(EcsPosition3), .inout = EcsIn },
+            { ecs_pair(EcsCollider, ecs_id(EcsBox)), .inout = EcsIn, .oper = EcsOr },
+            { ecs_id(EcsBox) },
+            { filter, .inout = EcsIn }
+        },
+        .cache_kind = EcsQueryCacheAuto,
+        .flags = EcsQueryDetectChanges
+    });
+
+    ecs_assert(result->q != NULL, ECS_INTERNAL_ERROR, NULL);
+
+    /* Entities that stop matching the query are removed from the index by an
+     * observer, so that updates only have to visit changed tables. The box is
+     * observed as well, so an entity that loses its extents doesn't leave an
+     * entry with the old extents behind. */
+    result->link = ecs_os_calloc_t(squery_link_t);
+    result->link->sq = result;
+    result->observer = ecs_observer(world, {
+        .query.terms = {
+            { ecs_id(EcsPosition3) },
+            { ecs_pair(EcsCollider, ecs_id(EcsBox)), .oper = EcsOr },
+            { ecs_id(EcsBox) },
+            { filter }
+        },
+        .events = { EcsOnRemove },
+        .callback = squery_on_remove,
+        .ctx = result->link,
+        .ctx_free = squery_link_free
+    });
+
+    ecs_vec_init_t(NULL, &result->counters, squery_counters_t, 0);
+    squery_counters_init(result);
+    result->dirty = true;
+
+    return result;
+}
+
+ecs_squery_t* ecs_squery_new(
+    ecs_world_t *world,
+    ecs_id_t filter,
+    vec3 center,
+    float size)
+{
+    ecs_assert(world != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(size > 0, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_squery_t *result = squery_new(world, filter, center, size);
+    result->ot = ecs_octree_new(center, size);
+    ecs_assert(result->ot != NULL, ECS_INTERNAL_ERROR, NULL);
+
+    return result;
+}
+
+ecs_squery_t* ecs_squery_new_w_grid(
+    ecs_world_t *world,
+    ecs_id_t filter,
+    vec3 center,
+    float size,
+    float cell_size)
+{
+    ecs_assert(world != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(size > 0, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(cell_size > 0, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_squery_t *result = squery_new(world, filter, center, size);
+    result->grid = ecs_sgrid_new(center, size, cell_size);
+    ecs_assert(result->grid != NULL, ECS_INTERNAL_ERROR, NULL);
+
+    return result;
+}
+
+void ecs_squery_free(
+    ecs_squery_t *sq)
+{
+    sq->link->sq = NULL;
+
+    /* When the world is deleted the observer and the cached query are cleaned
+     * up with the entities that own them, which may have already happened. */
+    if (!ecs_is_fini(sq->world)) {
+        ecs_delete(sq->world, sq->observer);
+        ecs_query_fini(sq->q);
+    }
+
+    if (sq->grid) {
+        ecs_sgrid_free(sq->grid);
+    } else {
+        ecs_octree_free(sq->ot);
+    }
+    ecs_vec_fini_t(NULL, &sq->counters, squery_counters_t);
+    ecs_os_free(sq);
+}
+
+static
+void squery_update_entity(
+    ecs_squery_t *sq,
+    ecs_entity_t e,
+    vec3 pos,
+    vec3 size)
+{
+    if (sq->grid) {
+        ecs_sgrid_update(sq->grid, e, pos, size);
+    } else {
+        ecs_octree_update(sq->ot, e, pos, size);
+    }
+}
+
+static
+void squery_insert(
+    ecs_squery_t *sq,
+    ecs_iter_t *it)
+{
+    EcsPosition3 *p = ecs_field(it, EcsPosition3, 0);
+    EcsBox *b = ecs_field(it, EcsBox, 1);
+
+    if (ecs_field_is_self(it, 1)) {
+        int i;
+        for (i = 0; i < it->count; i ++) {
+            vec3 vp, vs;
+            vp[0] = p[i].x;
+            vp[1] = p[i].y;
+            vp[2] = p[i].z;
+
+            vs[0] = b[i].width;
+            vs[1] = b[i].height;
+            vs[2] = b[i].depth;
+
+            squery_update_entity(sq, it->entities[i], vp, vs);
+        }
+    } else {
+        int i;
+        for (i = 0; i < it->count; i ++) {
+            vec3 vp, vs;
+            vp[0] = p[i].x;
+            vp[1] = p[i].y;
+            vp[2] = p[i].z;
+
+            vs[0] = b->width;
+            vs[1] = b->height;
+            vs[2] = b->depth;
+
+            squery_update_entity(sq, it->entities[i], vp, vs);
+        }
+    }
+}
+
+void ecs_squery_update(
+    ecs_squery_t *sq)
+{
+    ecs_assert(sq != NULL,     ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(sq->q != NULL,  ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(sq->ot != NULL || sq->grid != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    sq->dirty = false;
+    squery_counters_init(sq);
+
+    if (ecs_query_changed(sq->q)) {
+        ecs_time_t t = {0};
+        ecs_time_measure(&t);
+
+        /* Only visit tables that changed since the last update. Entities that
+         * stay inside the bounds of their cube are updated in place. */
+        const ecs_world_t *world = ecs_get_world(sq->q);
+        ecs_iter_t it = ecs_query_iter(world, sq->q);
+        while (ecs_query_next(&it)) {
+            if (!ecs_iter_changed(&it)) {
+                ecs_iter_skip(&it);
+                continue;
+            }
+
+            squery_insert(sq, &it);
+        }
+
+        sq->update_time += (float)ecs_time_measure(&t);
+    }
+}
+
+void ecs_squery_stats(
+    const ecs_squery_t *sq,
+    ecs_squery_stats_t *stats)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(stats != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_os_zeromem(stats);
+    stats->update_time = sq->update_time;
+
+    if (sq->grid) {
+        ecs_sgrid_stats_t s;
+        ecs_sgrid_stats(sq->grid, &s);
+        stats->entity_count = s.entity_count;
+        stats->node_count = s.cell_count;
+        stats->leaf_count = s.used_cell_count;
+        stats->depth = 1;
+        stats->max_leaf_entities = s.max_cell_entities;
+        stats->memory = s.memory;
+    } else {
+        ecs_octree_stats_t s;
+        ecs_octree_stats(sq->ot, &s);
+        stats->entity_count = s.entity_count;
+        stats->node_count = s.cube_count + 1; /* Root is not in arena */
+        stats->leaf_count = s.leaf_count;
+        stats->depth = s.depth;
+        stats->max_leaf_entities = s.max_leaf_entities;
+        stats->dropped = (int32_t)s.dropped;
+        stats->memory = s.memory;
+    }
+
+    if (stats->leaf_count) {
+        stats->avg_leaf_entities = 
+            (float)stats->entity_count / (float)stats->leaf_count;
+    }
+
+    const squery_counters_t *counters = ecs_vec_first_t(
+        &sq->counters, squery_counters_t);
+    int32_t i, count = ecs_vec_count(&sq->counters);
+    for (i = 0; i < count; i ++) {
+        stats->query_count += (int32_t)counters[i].query_count;
+        stats->nodes_visited += (int32_t)counters[i].nodes_visited;
+        stats->result_count += (int32_t)counters[i].result_count;
+    }
+}
+
+void ecs_squery_stats_reset(
+    ecs_squery_t *sq)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    sq->update_time = 0;
+    ecs_os_memset_n(ecs_vec_first(&sq->counters), 0, squery_counters_t,
+        ecs_vec_count(&sq->counters));
+}
+
+void ecs_squery_invalidate(
+    ecs_squery_t *sq)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    sq->dirty = true;
+}
+
+void ecs_squery_findn_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    vec3 position,
+    float range,
+    ecs_vec_t *result)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(sq->q != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(sq->ot != NULL || sq->grid != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    /* Indices are only brought up to date when they're queried */
+    squery_sync(sq);
+
+    ecs_vec_init_if_t(result, ecs_oct_entity_t);
+    ecs_vec_clear(result);
+
+    squery_counters_t *counters = squery_counters(sq, world);
+    if (sq->grid) {
+        counters->nodes_visited += 
+            sgrid_findn(sq->grid, position, range, result);
+    } else {
+        counters->nodes_visited += 
+            octree_findn(sq->ot, position, range, result);
+    }
+    counters->query_count ++;
+    counters->result_count += ecs_vec_count(result);
+}
+
+int32_t ecs_squery_find_knn_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(sq->ot != NULL || sq->grid != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(k > 0, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(result != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    squery_sync(sq);
+
+    int32_t count, visited = 0;
+    if (sq->grid) {
+        count = sgrid_find_knn(
+            sq->grid, position, max_range, k, result, &visited);
+    } else {
+        count = octree_find_knn(
+            sq->ot, position, max_range, k, result, &visited);
+    }
+
+    squery_counters_t *counters = squery_counters(sq, world);
+    counters->query_count ++;
+    counters->nodes_visited += visited;
+    counters->result_count += count;
+    return count;
+}
+
+bool ecs_squery_find_nearest_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    ecs_oct_nearest_t *result)
+{
+    return ecs_squery_find_knn_w_stage(
+        world, sq, position, max_range, 1, result) != 0;
+}
+
+void ecs_squery_findn(
+    ecs_squery_t *sq,
+    vec3 position,
+    float range,
+    ecs_vec_t *result)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_squery_findn_w_stage(sq->world, sq, position, range, result);
+}
+
+int32_t ecs_squery_find_knn(
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    return ecs_squery_find_knn_w_stage(
+        sq->world, sq, position, max_range, k, result);
+}
+
+bool ecs_squery_find_nearest(
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    ecs_oct_nearest_t *result)
+{
+    return ecs_squery_find_knn(sq, position, max_range, 1, result) != 0;
+}
+
+/* Interleave lower 16 bits of x and z */
+static
+uint32_t squery_morton(
+    uint32_t x,
+    uint32_t z)
+{
+    x &= 0xFFFF; z &= 0xFFFF;
+    x = (x | (x << 8)) & 0x00FF00FF;
+    x = (x | (x << 4)) & 0x0F0F0F0F;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    z = (z | (z << 8)) & 0x00FF00FF;
+    z = (z | (z << 4)) & 0x0F0F0F0F;
+    z = (z | (z << 2)) & 0x33333333;
+    z = (z | (z << 1)) & 0x55555555;
+    return x | (z << 1);
+}
+
+static
+int squery_compare_order(
+    const void *ptr1,
+    const void *ptr2)
+{
+    const uint64_t *o1 = ptr1, *o2 = ptr2;
+    return (*o1 > *o2) - (*o1 < *o2);
+}
+
+/* Probes that are visited with a single walk of the index. Candidates are the
+ * entities that overlap with the union of the probe bounds. */
+typedef struct squery_group_t {
+    int32_t first;           /* First probe in sorted probe order */
+    int32_t count;
+    int32_t candidates;      /* First candidate of group */
+    int32_t candidate_count;
+} squery_group_t;
+
+/* Max number of probes that share a walk of the index */
+#define SQUERY_GROUP_SIZE (16)
+
+/* Same test as the octree uses for a single query, so that a probe in a batch
+ * finds the same entities as a separate query. */
+static
+bool squery_overlaps(
+    const ecs_squery_probe_t *probe,
+    const ecs_oct_entity_t *e)
+{
+    const float *pos = probe->pos;
+    float range = probe->range;
+    bool
+    result =  e->pos[0] - e->size[0] <= pos[0] + range;
+    result &= e->pos[0] + e->size[0] >= pos[0] - range;
+    result &= e->pos[1] - e->size[1] <= pos[1] + range;
+    result &= e->pos[1] + e->size[1] >= pos[1] - range;
+    result &= e->pos[2] - e->size[2] <= pos[2] + range;
+    result &= e->pos[2] + e->size[2] >= pos[2] - range;
+    return result;
+}
+
+void ecs_squery_findn_batch_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    const ecs_squery_probe_t *probes,
+    int32_t count,
+    ecs_squery_batch_t *result)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(result != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(!count || probes != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_vec_init_if_t(&result->offsets, int32_t);
+    ecs_vec_init_if_t(&result->results, ecs_oct_entity_t);
+    ecs_vec_init_if_t(&result->order, uint64_t);
+    ecs_vec_init_if_t(&result->groups, squery_group_t);
+    ecs_vec_init_if_t(&result->candidates, ecs_oct_entity_t);
+
+    ecs_vec_set_count_t(NULL, &result->offsets, int32_t, count + 1);
+    ecs_vec_clear(&result->results);
+    ecs_vec_clear(&result->groups);
+    ecs_vec_clear(&result->candidates);
+    int32_t *offsets = ecs_vec_first_t(&result->offsets, int32_t);
+    ecs_os_memset_n(offsets, 0, int32_t, count + 1);
+    if (!count) {
+        return;
+    }
+
+    squery_sync(sq);
+
+    squery_counters_t *counters = squery_counters(sq, world);
+    counters->query_count += count;
+
+    int32_t i;
+    if (sq->grid) {
+        /* A grid query only visits the cells that overlap with the probe,
+         * which is cheaper than testing the candidates of a shared walk. Each
+         * probe appends its results directly. */
+        for (i = 0; i < count; i ++) {
+            vec3 pos;
+            glm_vec3_copy((float*)probes[i].pos, pos);
+            counters->nodes_visited += sgrid_findn(
+                sq->grid, pos, probes[i].range, &result->results);
+            offsets[i + 1] = ecs_vec_count(&result->results);
+        }
+        counters->result_count += offsets[count];
+        return;
+    }
+
+    /* Visit probes in Morton order of their position on the XZ plane, so that
+     * consecutive probes walk the same part of the index. The upper 32 bits
+     * of an order element contain the sort key, the lower 32 bits the index
+     * of the probe. */
+    ecs_vec_set_count_t(NULL, &result->order, uint64_t, count);
+    uint64_t *order = ecs_vec_first_t(&result->order, uint64_t);
+    float scale = 65535.0f / sq->size;
+    float min_x = sq->center[0] - sq->size / 2;
+    float min_z = sq->center[2] - sq->size / 2;
+    for (i = 0; i < count; i ++) {
+        float x = glm_clamp((probes[i].pos[0] - min_x) * scale, 0, 65535);
+        float z = glm_clamp((probes[i].pos[2] - min_z) * scale, 0, 65535);
+        uint64_t key = squery_morton((uint32_t)x, (uint32_t)z);
+        order[i] = (key << 32) | (uint32_t)i;
+    }
+
+    qsort(order, (size_t)count, sizeof(uint64_t), squery_compare_order);
+
+    /* Split sorted probes into groups of neighbouring probes, and walk the
+     * index once per group with the union of the probe bounds. A probe only
+     * joins a group if the half extent of the union stays within twice the
+     * largest range in the group, so a walk doesn't collect many entities
+     * that no probe overlaps.
+     * The number of results of each probe is stored in offsets[probe + 1]. */
+    i = 0;
+    while (i < count) {
+        const ecs_squery_probe_t *p = &probes[order[i] & 0xFFFFFFFF];
+        vec3 g_min, g_max;
+        glm_vec3_subs((float*)p->pos, p->range, g_min);
+        glm_vec3_adds((float*)p->pos, p->range, g_max);
+        float max_range = p->range;
+
+        int32_t end = i + 1;
+        for (; end < count && (end - i) < SQUERY_GROUP_SIZE; end ++) {
+            p = &probes[order[end] & 0xFFFFFFFF];
+            vec3 u_min, u_max;
+            glm_vec3_subs((float*)p->pos, p->range, u_min);
+            glm_vec3_adds((float*)p->pos, p->range, u_max);
+            glm_vec3_minv(g_min, u_min, u_min);
+            glm_vec3_maxv(g_max, u_max, u_max);
+            vec3 extent;
+            glm_vec3_sub(u_max, u_min, extent);
+            if (glm_vec3_max(extent) > 4 * glm_max(max_range, p->range)) {
+                break;
+            }
+
+            glm_vec3_copy(u_min, g_min);
+            glm_vec3_copy(u_max, g_max);
+            max_range = glm_max(max_range, p->range);
+        }
+
+        vec3 center, half;
+        glm_vec3_add(g_min, g_max, center);
+        glm_vec3_scale(center, 0.5f, center);
+        glm_vec3_sub(g_max, g_min, half);
+        float range = glm_vec3_max(half) / 2;
+
+        squery_group_t *group = ecs_vec_append_t(
+            NULL, &result->groups, squery_group_t);
+        group->first = i;
+        group->count = end - i;
+        group->candidates = ecs_vec_count(&result->candidates);
+        counters->nodes_visited += octree_findn(
+            sq->ot, center, range, &result->candidates);
+        group->candidate_count = 
+            ecs_vec_count(&result->candidates) - group->candidates;
+
+        const ecs_oct_entity_t *candidates = ecs_vec_first_t(
+            &result->candidates, ecs_oct_entity_t) + group->candidates;
+        for (; i < end; i ++) {
+            int32_t probe = (int32_t)(order[i] & 0xFFFFFFFF);
+            int32_t c, n = 0;
+            for (c = 0; c < group->candidate_count; c ++) {
+                n += squery_overlaps(&probes[probe], &candidates[c]);
+            }
+            offsets[probe + 1] = n;
+        }
+    }
+
+    /* Convert result counts to offsets, and write results of each probe in
+     * place. Results are only copied once, from candidates to results. */
+    for (i = 0; i < count; i ++) {
+        offsets[i + 1] += offsets[i];
+    }
+    counters->result_count += offsets[count];
+
+    ecs_vec_set_count_t(NULL, &result->results, ecs_oct_entity_t,
+        offsets[count]);
+    ecs_oct_entity_t *results = ecs_vec_first_t(
+        &result->results, ecs_oct_entity_t);
+    const squery_group_t *groups = ecs_vec_first_t(
+        &result->groups, squery_group_t);
+    int32_t g, group_count = ecs_vec_count(&result->groups);
+    for (g = 0; g < group_count; g ++) {
+        const squery_group_t *group = &groups[g];
+        const ecs_oct_entity_t *candidates = ecs_vec_first_t(
+            &result->candidates, ecs_oct_entity_t) + group->candidates;
+        for (i = group->first; i < group->first + group->count; i ++) {
+            int32_t probe = (int32_t)(order[i] & 0xFFFFFFFF);
+            ecs_oct_entity_t *dst = &results[offsets[probe]];
+            int32_t c;
+            for (c = 0; c < group->candidate_count; c ++) {
+                if (squery_overlaps(&probes[probe], &candidates[c])) {
+                    *(dst ++) = candidates[c];
+                }
+            }
+        }
+    }
+}
+
+void ecs_squery_findn_batch(
+    ecs_squery_t *sq,
+    const ecs_squery_probe_t *probes,
+    int32_t count,
+    ecs_squery_batch_t *result)
+{
+    ecs_assert(sq != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_squery_findn_batch_w_stage(sq->world, sq, probes, count, result);
+}
+
+void ecs_squery_batch_fini(
+    ecs_squery_batch_t *batch)
+{
+    ecs_vec_fini_t(NULL, &batch->offsets, int32_t);
+    ecs_vec_fini_t(NULL, &batch->results, ecs_oct_entity_t);
+    ecs_vec_fini_t(NULL, &batch->order, uint64_t);
+    ecs_vec_fini(NULL, &batch->groups, ECS_SIZEOF(squery_group_t));
+    ecs_vec_fini_t(NULL, &batch->candidates, ecs_oct_entity_t);
+}
+
+
+/* Interval of an entity on the x axis, with its bounds on the y and z axis */
+typedef struct bp_item_t {
+    float min_x;
+    float max_x;
+    float min_y;
+    float max_y;
+    float min_z;
+    float max_z;
+    ecs_entity_t e;
+    int32_t set;
+} bp_item_t;
+
+struct ecs_broadphase_t {
+    ecs_world_t *world;
+    ecs_query_t *q[2];
+    ecs_vec_t items;  /* bp_item_t */
+    ecs_vec_t order;  /* uint64_t, sort key + item index */
+    ecs_vec_t active[2]; /* int32_t, items overlapping the sweep position */
+    ecs_vec_t pairs;  /* ecs_collision_pair_t */
+    ecs_vec_t dist;   /* float, squared distance for each pair */
+    ecs_map_t unique; /* b -> index of pair in pairs */
+    bool exclusive;
+    bool dirty;
+};
+
+ecs_broadphase_t* ecs_broadphase_new(
+    ecs_world_t *world,
+    ecs_id_t filter_a,
+    ecs_id_t filter_b,
+    bool exclusive)
+{
+    ecs_assert(world != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(filter_a != 0, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(filter_b != 0, ECS_INVALID_PARAMETER, NULL);
+
+    ecs_broadphase_t *result = ecs_os_calloc_t(ecs_broadphase_t);
+    ecs_id_t filters[2] = { filter_a, filter_b };
+    result->world = world;
+
+    int i;
+    for (i = 0; i < 2; i ++) {
+        result->q[i] = ecs_query(world, {
+            .terms = {
+                { ecs_id(EcsPosition3), .inout = EcsIn },
+                { ecs_pair(EcsCollider, ecs_id(EcsBox)), .inout = EcsIn, .oper = EcsOr },
+                { ecs_id(EcsBox) },
+                { filters[i], .inout = EcsIn }
+            },
+            .cache_kind = EcsQueryCacheAuto
+        });
+
+        if (!result->q[i]) {
+            ecs_broadphase_free(result);
+            return NULL;
+        }
+
+        ecs_vec_init_t(NULL, &result->active[i], int32_t, 0);
+    }
+
+    ecs_vec_init_t(NULL, &result->items, bp_item_t, 0);
+    ecs_vec_init_t(NULL, &result->order, uint64_t, 0);
+    ecs_vec_init_t(NULL, &result->pairs, ecs_collision_pair_t, 0);
+    ecs_vec_init_t(NULL, &result->dist, float, 0);
+    ecs_map_init(&result->unique, NULL);
+    result->exclusive = exclusive;
+    result->dirty = true;
+
+    return result;
+}
+
+void ecs_broadphase_free(
+    ecs_broadphase_t *bp)
+{
+    ecs_assert(bp != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    /* Cached queries are cleaned up by the world when it is deleted */
+    bool fini = ecs_is_fini(bp->world);
+
+    int i;
+    for (i = 0; i < 2; i ++) {
+        if (bp->q[i] && !fini) {
+            ecs_query_fini(bp->q[i]);
+        }
+        ecs_vec_fini_t(NULL, &bp->active[i], int32_t);
+    }
+
+    ecs_vec_fini_t(NULL, &bp->items, bp_item_t);
+    ecs_vec_fini_t(NULL, &bp->order, uint64_t);
+    ecs_vec_fini_t(NULL, &bp->pairs, ecs_collision_pair_t);
+    ecs_vec_fini_t(NULL, &bp->dist, float);
+    ecs_map_fini(&bp->unique);
+    ecs_os_free(bp);
+}
+
+/* Map float to unsigned integer that has the same ordering */
+static
+uint32_t bp_sort_key(
+    float value)
+{
+    uint32_t bits;
+    ecs_os_memcpy(&bits, &value, ECS_SIZEOF(float));
+    return (bits & 0x80000000) ? ~bits : (bits | 0x80000000);
+}
+
+static
+int bp_compare_order(
+    const void *ptr1,
+    const void *ptr2)
+{
+    uint64_t v1 = *(const uint64_t*)ptr1, v2 = *(const uint64_t*)ptr2;
+    return (v1 > v2) - (v1 < v2);
+}
+
+/* Boxes are centered on the entity position */
+static
+void bp_collect(
+    ecs_broadphase_t *bp,
+    int32_t set)
+{
+    ecs_query_t *q = bp->q[set];
+    ecs_iter_t it = ecs_query_iter(ecs_get_world(q), q);
+    while (ecs_query_next(&it)) {
+        EcsPosition3 *p = ecs_field(&it, EcsPosition3, 0);
+        EcsBox *b = ecs_field(&it, EcsBox, 1);
+        bool is_self = ecs_field_is_self(&it, 1);
+
+        bp_item_t *items = ecs_vec_grow_t(NULL, &bp->items, bp_item_t, 
+            it.count);
+
+        int i;
+        for (i = 0; i < it.count; i ++) {
+            EcsBox *box = is_self ? &b[i] : b;
+            float hw = box->width / 2, hh = box->height / 2;
+            float hd = box->depth / 2;
+            items[i].min_x = p[i].x - hw;
+            items[i].max_x = p[i].x + hw;
+            items[i].min_y = p[i].y - hh;
+            items[i].max_y = p[i].y + hh;
+            items[i].min_z = p[i].z - hd;
+            items[i].max_z = p[i].z + hd;
+            items[i].e = it.entities[i];
+            items[i].set = set;
+        }
+    }
+}
+
+static
+void bp_add_pair(
+    ecs_broadphase_t *bp,
+    const bp_item_t *a,
+    const bp_item_t *b)
+{
+    float dx = (a->min_x + a->max_x) - (b->min_x + b->max_x);
+    float dy = (a->min_y + a->max_y) - (b->min_y + b->max_y);
+    float dz = (a->min_z + a->max_z) - (b->min_z + b->max_z);
+    float dist = (dx * dx + dy * dy + dz * dz) / 4;
+
+    if (bp->exclusive) {
+        /* Only keep the closest a for each b */
+        ecs_map_val_t *index = ecs_map_get(&bp->unique, b->e);
+        if (index) {
+            float *cur = ecs_vec_get_t(&bp->dist, float, (int32_t)index[0]);
+            if (dist < cur[0]) {
+                ecs_vec_get_t(&bp->pairs, ecs_collision_pair_t, 
+                    (int32_t)index[0])->a = a->e;
+                cur[0] = dist;
+            }
+            return;
+        }
+
+        ecs_map_insert(&bp->unique, b->e, 
+            (ecs_map_val_t)ecs_vec_count(&bp->pairs));
+    }
+
+    ecs_collision_pair_t *pair = ecs_vec_append_t(
+        NULL, &bp->pairs, ecs_collision_pair_t);
+    pair->a = a->e;
+    pair->b = b->e;
+    ecs_vec_append_t(NULL, &bp->dist, float)[0] = dist;
+}
+
+void ecs_broadphase_update(
+    ecs_broadphase_t *bp)
+{
+    ecs_assert(bp != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    bp->dirty = false;
+    ecs_vec_clear(&bp->items);
+    ecs_vec_clear(&bp->pairs);
+    ecs_vec_clear(&bp->dist);
+    ecs_map_clear(&bp->unique);
+
+    bp_collect(bp, 0);
+    bp_collect(bp, 1);
+
+    int32_t i, count = ecs_vec_count(&bp->items);
+    if (!count) {
+        return;
+    }
+
+    /* Sort intervals by their lower bound on the x axis */
+    bp_item_t *items = ecs_vec_first_t(&bp->items, bp_item_t);
+    ecs_vec_set_count_t(NULL, &bp->order, uint64_t, count);
+    uint64_t *order = ecs_vec_first_t(&bp->order, uint64_t);
+    for (i = 0; i < count; i ++) {
+        order[i] = ((uint64_t)bp_sort_key(items[i].min_x) << 32) | 
+            (uint32_t)i;
+    }
+    qsort(order, (size_t)count, sizeof(uint64_t), bp_compare_order);
+
+    /* Sweep over the x axis. Each set has a list of intervals that contain the
+     * current position, and a new interval is only tested against the active
+     * intervals of the other set. */
+    ecs_vec_clear(&bp->active[0]);
+    ecs_vec_clear(&bp->active[1]);
+
+    for (i = 0; i < count; i ++) {
+        int32_t cur_index = (int32_t)(order[i] & 0xFFFFFFFF);
+        bp_item_t *cur = &items[cur_index];
+        ecs_vec_t *active = &bp->active[!cur->set];
+        int32_t *other = ecs_vec_first_t(active, int32_t);
+        int32_t j = 0, active_count = ecs_vec_count(active);
+
+        while (j < active_count) {
+            bp_item_t *item = &items[other[j]];
+            if (item->max_x < cur->min_x) {
+                /* Interval ended before the sweep position, remove */
+                other[j] = other[-- active_count];
+                continue;
+            }
+
+            bool
+            overlaps =  item->min_y <= cur->max_y && item->max_y >= cur->min_y;
+            overlaps &= item->min_z <= cur->max_z && item->max_z >= cur->min_z;
+            if (overlaps) {
+                if (cur->set) {
+                    bp_add_pair(bp, item, cur);
+                } else {
+                    bp_add_pair(bp, cur, item);
+                }
+            }
+
+            j ++;
+        }
+
+        ecs_vec_set_count_t(NULL, active, int32_t, active_count);
+        ecs_vec_append_t(NULL, &bp->active[cur->set], int32_t)[0] = cur_index;
+    }
+}
+
+void ecs_broadphase_invalidate(
+    ecs_broadphase_t *bp)
+{
+    ecs_assert(bp != NULL, ECS_INVALID_PARAMETER, NULL);
+    bp->dirty = true;
+}
+
+const ecs_collision_pair_t* ecs_broadphase_pairs(
+    ecs_broadphase_t *bp,
+    int32_t *count)
+{
+    ecs_assert(bp != NULL, ECS_INVALID_PARAMETER, NULL);
+    ecs_assert(count != NULL, ECS_INVALID_PARAMETER, NULL);
+
+    /* Pairs are only computed when they're requested, which stages can't do
+     * as they would race on the pairs */
+    if (bp->dirty) {
+        ecs_assert(!(ecs_world_get_flags(bp->world) & EcsWorldMultiThreaded),
+            ECS_INVALID_OPERATION, 
+            "broadphase must be updated before it is used by stages");
+        ecs_broadphase_update(bp);
+    }
+
+    *count = ecs_vec_count(&bp->pairs);
+    return ecs_vec_first_t(&bp->pairs, ecs_collision_pair_t);
+}
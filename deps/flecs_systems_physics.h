@@ -65,6 +65,27 @@ typedef struct ecs_oct_entity_t {
     vec3 size;
 } ecs_oct_entity_t;
 
+/* Result of a nearest neighbour query. Distance is measured between the query
+ * position and the entity position. */
+typedef struct ecs_oct_nearest_t {
+    ecs_entity_t id;
+    float dist_sq;
+} ecs_oct_nearest_t;
+
+typedef struct ecs_octree_stats_t {
+    int32_t entity_count;
+    int32_t cube_count;      /* Cubes currently in use */
+    int32_t cube_high_water; /* Largest number of cubes in use at once */
+    int32_t chunk_count;     /* Number of arena chunks */
+    int32_t depth;           /* Number of levels in the tree */
+    int32_t leaf_count;      /* Cubes that store entities */
+    int32_t max_leaf_entities; /* Largest number of entities in one cube */
+    ecs_size_t memory;       /* Total memory used by octree in bytes */
+
+    /* Total since the octree was created */
+    int64_t dropped;         /* Entities rejected for being out of bounds */
+} ecs_octree_stats_t;
+
 FLECS_SYSTEMS_PHYSICS_API
 ecs_octree_t* ecs_octree_new(
     vec3 center,
@@ -78,6 +99,11 @@ FLECS_SYSTEMS_PHYSICS_API
 void ecs_octree_clear(
     ecs_octree_t *ot);    
 
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_octree_stats(
+    const ecs_octree_t *ot,
+    ecs_octree_stats_t *stats);
+
 FLECS_SYSTEMS_PHYSICS_API
 int32_t ecs_octree_insert(
     ecs_octree_t *ot,
@@ -86,12 +112,44 @@ int32_t ecs_octree_insert(
     vec3 size);
 
 FLECS_SYSTEMS_PHYSICS_API
+int32_t ecs_octree_update(
+    ecs_octree_t *ot,
+    ecs_entity_t e,
+    vec3 pos,
+    vec3 size);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_octree_remove(
+    ecs_octree_t *ot,
+    ecs_entity_t e);
+
+/* Finds don't modify the octree, so they can run at the same time as other
+ * finds, but not at the same time as inserts, updates or removes. */
+FLECS_SYSTEMS_PHYSICS_API
 void ecs_octree_findn(
     ecs_octree_t *ot,
     vec3 pos,
     float range,
     ecs_vec_t *result);
 
+/* Find entity closest to pos within max_range. Returns false if none found. */
+FLECS_SYSTEMS_PHYSICS_API
+bool ecs_octree_find_nearest(
+    ecs_octree_t *ot,
+    vec3 pos,
+    float max_range,
+    ecs_oct_nearest_t *result);
+
+/* Find up to k entities closest to pos within max_range. Results are sorted by
+ * distance. Returns the number of entities written to result. */
+FLECS_SYSTEMS_PHYSICS_API
+int32_t ecs_octree_find_knn(
+    ecs_octree_t *ot,
+    vec3 pos,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result);
+
 FLECS_SYSTEMS_PHYSICS_API
 int32_t ecs_octree_dump(
     ecs_octree_t *ot);
@@ -102,6 +160,96 @@ int32_t ecs_octree_dump(
 
 #endif
 
+#ifndef FLECS_SYSTEMS_PHYSICS_GRID_H
+#define FLECS_SYSTEMS_PHYSICS_GRID_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Uniform grid that indexes entities on the XZ plane. Each entity is stored in
+ * the cell that contains its center. Cheaper to maintain than an octree when
+ * entities are spread out over a plane of known dimensions. */
+typedef struct ecs_sgrid_t ecs_sgrid_t;
+
+typedef struct ecs_sgrid_stats_t {
+    int32_t entity_count;
+    int32_t cell_count;
+    int32_t used_cell_count;   /* Cells that store entities */
+    int32_t max_cell_entities; /* Largest number of entities in one cell since
+                                * the grid was created or cleared */
+    ecs_size_t memory;         /* Total memory used by grid in bytes */
+} ecs_sgrid_stats_t;
+
+FLECS_SYSTEMS_PHYSICS_API
+ecs_sgrid_t* ecs_sgrid_new(
+    vec3 center,
+    float size,
+    float cell_size);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_sgrid_free(
+    ecs_sgrid_t *g);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_sgrid_stats(
+    const ecs_sgrid_t *g,
+    ecs_sgrid_stats_t *stats);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_sgrid_clear(
+    ecs_sgrid_t *g);
+
+FLECS_SYSTEMS_PHYSICS_API
+int32_t ecs_sgrid_insert(
+    ecs_sgrid_t *g,
+    ecs_entity_t e,
+    vec3 pos,
+    vec3 size);
+
+FLECS_SYSTEMS_PHYSICS_API
+int32_t ecs_sgrid_update(
+    ecs_sgrid_t *g,
+    ecs_entity_t e,
+    vec3 pos,
+    vec3 size);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_sgrid_remove(
+    ecs_sgrid_t *g,
+    ecs_entity_t e);
+
+/* Finds don't modify the grid, so they can run at the same time as other
+ * finds, but not at the same time as inserts, updates or removes. */
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_sgrid_findn(
+    ecs_sgrid_t *g,
+    vec3 pos,
+    float range,
+    ecs_vec_t *result);
+
+FLECS_SYSTEMS_PHYSICS_API
+bool ecs_sgrid_find_nearest(
+    ecs_sgrid_t *g,
+    vec3 pos,
+    float max_range,
+    ecs_oct_nearest_t *result);
+
+FLECS_SYSTEMS_PHYSICS_API
+int32_t ecs_sgrid_find_knn(
+    ecs_sgrid_t *g,
+    vec3 pos,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
 #ifndef FLECS_SYSTEMS_PHYSICS_SQUERY_H
 #define FLECS_SYSTEMS_PHYSICS_SQUERY_H
 
@@ -112,6 +260,43 @@ extern "C" {
 
 typedef struct ecs_squery_t ecs_squery_t;
 
+/* Position and range of a single query in a batch */
+typedef struct ecs_squery_probe_t {
+    vec3 pos;
+    float range;
+} ecs_squery_probe_t;
+
+/* Results of a batched query in CSR form. The results for probe i are stored
+ * in results[offsets[i]] .. results[offsets[i + 1]]. */
+typedef struct ecs_squery_batch_t {
+    ecs_vec_t offsets;  /* int32_t, probe count + 1 */
+    ecs_vec_t results;  /* ecs_oct_entity_t */
+
+    /* Scratch storage, reused between batches */
+    ecs_vec_t order;       /* Probes in visiting order */
+    ecs_vec_t groups;      /* Probes that share a walk of the index */
+    ecs_vec_t candidates;  /* ecs_oct_entity_t, entities found per group */
+} ecs_squery_batch_t;
+
+/* Statistics of a spatial query. Update time and query counters are measured
+ * since the last call to ecs_squery_stats_reset. Finds count their work in
+ * counters of the stage they're called with, which are summed by
+ * ecs_squery_stats. */
+typedef struct ecs_squery_stats_t {
+    float update_time;       /* Time spent updating the index in seconds */
+    int32_t entity_count;
+    int32_t node_count;      /* Octree cubes or grid cells */
+    int32_t leaf_count;      /* Nodes that store entities */
+    int32_t depth;           /* Octree depth, 1 for grids */
+    int32_t max_leaf_entities;
+    float avg_leaf_entities;
+    int32_t dropped;         /* Entities rejected for being out of bounds */
+    int32_t query_count;
+    int32_t nodes_visited;
+    int32_t result_count;
+    ecs_size_t memory;
+} ecs_squery_stats_t;
+
 FLECS_SYSTEMS_PHYSICS_API
 ecs_squery_t* ecs_squery_new(
     ecs_world_t *world,
@@ -119,6 +304,14 @@ ecs_squery_t* ecs_squery_new(
     vec3 center,
     float size);
 
+FLECS_SYSTEMS_PHYSICS_API
+ecs_squery_t* ecs_squery_new_w_grid(
+    ecs_world_t *world,
+    ecs_id_t filter,
+    vec3 center,
+    float size,
+    float cell_size);
+
 FLECS_SYSTEMS_PHYSICS_API
 void ecs_squery_free(
     ecs_squery_t *sq);
@@ -128,12 +321,155 @@ void ecs_squery_update(
     ecs_squery_t *sq);    
 
 FLECS_SYSTEMS_PHYSICS_API
-void ecs_squery_findn(
+void ecs_squery_invalidate(
+    ecs_squery_t *sq);
+
+/* Must not be called while stages search the query */
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_squery_stats(
     const ecs_squery_t *sq,
+    ecs_squery_stats_t *stats);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_squery_stats_reset(
+    ecs_squery_t *sq);
+
+/* Finds don't modify the query, other than bringing an invalidated index up to
+ * date and updating statistics counters. Finds count into the counters of the
+ * main stage, use the _w_stage variants to search from a multi threaded 
+ * system. */
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_squery_findn(
+    ecs_squery_t *sq,
     vec3 position,
     float range,
     ecs_vec_t *result);
 
+/* Find entity closest to position within max_range. Returns false if none. */
+FLECS_SYSTEMS_PHYSICS_API
+bool ecs_squery_find_nearest(
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    ecs_oct_nearest_t *result);
+
+/* Find up to k entities closest to position, sorted by distance. Returns the
+ * number of entities written to result. */
+FLECS_SYSTEMS_PHYSICS_API
+int32_t ecs_squery_find_knn(
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result);
+
+/* Run multiple range queries at once. For an octree, probes are sorted so that
+ * neighbouring probes are consecutive, and are split in small groups. Each
+ * group walks the tree once with the union of its probe bounds, after which
+ * the entities found by the walk are tested against each probe of the group.
+ * For a grid, which only visits the cells that overlap with a probe, each
+ * probe is a separate lookup. Results are returned in the order of the
+ * provided probes. The order of results for a single probe may differ from
+ * ecs_squery_findn. */
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_squery_findn_batch(
+    ecs_squery_t *sq,
+    const ecs_squery_probe_t *probes,
+    int32_t count,
+    ecs_squery_batch_t *result);
+
+/* Same as the finds above, for the stage passed as world, which selects the
+ * statistics counters that are updated. Different stages can search the same
+ * query at the same time, as long as it was updated before the stages started.
+ * A find on an invalidated query from a multi threaded system asserts. */
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_squery_findn_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    vec3 position,
+    float range,
+    ecs_vec_t *result);
+
+FLECS_SYSTEMS_PHYSICS_API
+bool ecs_squery_find_nearest_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    ecs_oct_nearest_t *result);
+
+FLECS_SYSTEMS_PHYSICS_API
+int32_t ecs_squery_find_knn_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    vec3 position,
+    float max_range,
+    int32_t k,
+    ecs_oct_nearest_t *result);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_squery_findn_batch_w_stage(
+    const ecs_world_t *world,
+    ecs_squery_t *sq,
+    const ecs_squery_probe_t *probes,
+    int32_t count,
+    ecs_squery_batch_t *result);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_squery_batch_fini(
+    ecs_squery_batch_t *batch);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
+
+#ifndef FLECS_SYSTEMS_PHYSICS_BROADPHASE_H
+#define FLECS_SYSTEMS_PHYSICS_BROADPHASE_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Finds all overlapping boxes between two sets of entities with a single sort
+ * and sweep pass over the x axis. */
+typedef struct ecs_broadphase_t ecs_broadphase_t;
+
+typedef struct ecs_collision_pair_t {
+    ecs_entity_t a; /* Entity matching filter_a */
+    ecs_entity_t b; /* Entity matching filter_b */
+} ecs_collision_pair_t;
+
+/* When exclusive is true, each entity matching filter_b is only paired with
+ * the closest overlapping entity matching filter_a. */
+FLECS_SYSTEMS_PHYSICS_API
+ecs_broadphase_t* ecs_broadphase_new(
+    ecs_world_t *world,
+    ecs_id_t filter_a,
+    ecs_id_t filter_b,
+    bool exclusive);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_broadphase_free(
+    ecs_broadphase_t *bp);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_broadphase_update(
+    ecs_broadphase_t *bp);
+
+FLECS_SYSTEMS_PHYSICS_API
+void ecs_broadphase_invalidate(
+    ecs_broadphase_t *bp);
+
+/* Returns pairs of overlapping entities. Pairs are recomputed if the
+ * broadphase was invalidated since the last update, which asserts when called
+ * from a multi threaded system. */
+FLECS_SYSTEMS_PHYSICS_API
+const ecs_collision_pair_t* ecs_broadphase_pairs(
+    ecs_broadphase_t *bp,
+    int32_t *count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -152,10 +488,21 @@ void ecs_squery_findn(
 extern "C" {
 #endif
 
+/* Number of cells along one axis when no grid cell size is provided */
+#define ECS_SPATIAL_GRID_DEFAULT_CELLS (32)
+
+FLECS_SYSTEMS_PHYSICS_API
+ECS_ENUM(EcsSpatialQueryKind, {
+    EcsSpatialQueryOctree,
+    EcsSpatialQueryGrid
+});
+
 FLECS_SYSTEMS_PHYSICS_API
 ECS_STRUCT(EcsSpatialQuery, {
     vec3 center;
     float size;
+    EcsSpatialQueryKind kind;
+    float cell_size;  /* Grid only, 0 selects ECS_SPATIAL_GRID_DEFAULT_CELLS */
     ecs_squery_t *query;
 });
 
@@ -164,6 +511,34 @@ ECS_STRUCT(EcsSpatialQueryResult, {
     ecs_vec_t results;
 });
 
+/* Added as (SpatialQueryStats, filter) to entities that own a spatial query.
+ * Contains the values of ecs_squery_stats_t for the previous frame. */
+FLECS_SYSTEMS_PHYSICS_API
+ECS_STRUCT(EcsSpatialQueryStats, {
+    float update_time;
+    int32_t entity_count;
+    int32_t node_count;
+    int32_t leaf_count;
+    int32_t depth;
+    int32_t max_leaf_entities;
+    float avg_leaf_entities;
+    int32_t dropped;
+    int32_t query_count;
+    int32_t nodes_visited;
+    int32_t result_count;
+    int32_t memory;
+});
+
+/* Computes overlapping pairs between entities with filter a and b once per
+ * frame. Both sets need Position3 and Box. */
+FLECS_SYSTEMS_PHYSICS_API
+ECS_STRUCT(EcsBroadphase, {
+    ecs_entity_t a;
+    ecs_entity_t b;
+    bool exclusive;   /* Pair each entity in b with at most one entity in a */
+    ecs_broadphase_t *broadphase;
+});
+
 FLECS_SYSTEMS_PHYSICS_API
 void FlecsSystemsPhysicsImport(
     ecs_world_t *world);
@@ -181,33 +556,145 @@ namespace systems {
 class physics {
 public:
     using oct_entity_t = ecs_oct_entity_t;
+    using oct_nearest_t = ecs_oct_nearest_t;
+
+    struct SpatialQueryBatch;
 
     struct SpatialQuery : EcsSpatialQuery {
         SpatialQuery() {
             ecs_os_zeromem(center);
             size = 0;
+            kind = EcsSpatialQueryOctree;
+            cell_size = 0;
             query = nullptr;
         }
 
         SpatialQuery(ecs_squery_t *q) {
+            kind = EcsSpatialQueryOctree;
+            cell_size = 0;
             query = q;
         }
 
         SpatialQuery(vec3 c, float s, ecs_squery_t *q = nullptr) {
             ecs_os_memcpy_t(center, c, vec3);
             size = s;
+            kind = EcsSpatialQueryOctree;
+            cell_size = 0;
             query = q;
         }
 
+        SpatialQuery(vec3 c, float s, EcsSpatialQueryKind k, float cs) {
+            ecs_os_memcpy_t(center, c, vec3);
+            size = s;
+            kind = k;
+            cell_size = cs;
+            query = nullptr;
+        }
+
         void update() {
             ecs_squery_update(query);
         }
 
+        void invalidate() {
+            ecs_squery_invalidate(query);
+        }
+
         void findn(vec3 pos, float range, EcsSpatialQueryResult& qr) const {
             ecs_squery_findn(query, pos, range, &qr.results);
         }
+
+        void findn(SpatialQueryBatch& batch) const;
+
+        bool find_nearest(vec3 pos, float range, oct_nearest_t& result) const {
+            return ecs_squery_find_nearest(query, pos, range, &result);
+        }
+
+        int32_t find_knn(vec3 pos, float range, int32_t k, 
+            oct_nearest_t *result) const 
+        {
+            return ecs_squery_find_knn(query, pos, range, k, result);
+        }
+
+        // Finds from the stage of a multi threaded system
+        void findn(const flecs::world& stage, vec3 pos, float range, 
+            EcsSpatialQueryResult& qr) const 
+        {
+            ecs_squery_findn_w_stage(stage, query, pos, range, &qr.results);
+        }
+
+        void findn(const flecs::world& stage, SpatialQueryBatch& batch) const;
+
+        bool find_nearest(const flecs::world& stage, vec3 pos, float range, 
+            oct_nearest_t& result) const 
+        {
+            return ecs_squery_find_nearest_w_stage(
+                stage, query, pos, range, &result);
+        }
+
+        int32_t find_knn(const flecs::world& stage, vec3 pos, float range, 
+            int32_t k, oct_nearest_t *result) const 
+        {
+            return ecs_squery_find_knn_w_stage(
+                stage, query, pos, range, k, result);
+        }
+    };
+
+    struct SpatialQueryBatch {
+        SpatialQueryBatch() {
+            ecs_vec_init_t(NULL, &probes, ecs_squery_probe_t, 0);
+            ecs_os_zeromem(&result);
+        }
+
+        ~SpatialQueryBatch() {
+            ecs_vec_fini_t(NULL, &probes, ecs_squery_probe_t);
+            ecs_squery_batch_fini(&result);
+        }
+
+        SpatialQueryBatch(const SpatialQueryBatch&) = delete;
+        SpatialQueryBatch& operator=(const SpatialQueryBatch&) = delete;
+
+        void clear() {
+            ecs_vec_clear(&probes);
+        }
+
+        // Add probe, returns index of the probe in the batch
+        int32_t add(const vec3 pos, float range) {
+            int32_t index = ecs_vec_count(&probes);
+            ecs_squery_probe_t *p = ecs_vec_append_t(
+                NULL, &probes, ecs_squery_probe_t);
+            ecs_os_memcpy_t(p->pos, pos, vec3);
+            p->range = range;
+            return index;
+        }
+
+        int32_t count() const {
+            return ecs_vec_count(&probes);
+        }
+
+        struct view {
+            oct_entity_t *first;
+            oct_entity_t *last;
+
+            oct_entity_t* begin() const { return first; }
+            oct_entity_t* end() const { return last; }
+            bool empty() const { return first == last; }
+        };
+
+        // Results for probe i
+        view results(int32_t i) const {
+            const int32_t *offsets =
+                static_cast<const int32_t*>(result.offsets.array);
+            oct_entity_t *array =
+                static_cast<oct_entity_t*>(result.results.array);
+            return { &array[offsets[i]], &array[offsets[i + 1]] };
+        }
+
+        ecs_vec_t probes;
+        ecs_squery_batch_t result;
     };
 
+    using SpatialQueryStats = EcsSpatialQueryStats;
+
     struct SpatialQueryResult : EcsSpatialQueryResult {        
         oct_entity_t* begin() {
             return static_cast<oct_entity_t*>(results.array);
@@ -218,6 +705,46 @@ public:
         }
     };
 
+    using collision_pair_t = ecs_collision_pair_t;
+
+    struct Broadphase : EcsBroadphase {
+        Broadphase() {
+            a = 0;
+            b = 0;
+            exclusive = false;
+            broadphase = nullptr;
+        }
+
+        Broadphase(flecs::entity_t filter_a, flecs::entity_t filter_b, 
+            bool excl = false) 
+        {
+            a = filter_a;
+            b = filter_b;
+            exclusive = excl;
+            broadphase = nullptr;
+        }
+
+        struct view {
+            const collision_pair_t *first;
+            const collision_pair_t *last;
+
+            const collision_pair_t* begin() const { return first; }
+            const collision_pair_t* end() const { return last; }
+            bool empty() const { return first == last; }
+        };
+
+        void update() {
+            ecs_broadphase_update(broadphase);
+        }
+
+        view pairs() const {
+            int32_t count = 0;
+            const collision_pair_t *first = 
+                ecs_broadphase_pairs(broadphase, &count);
+            return view{first, first + count};
+        }
+    };
+
     physics(flecs::world& ecs) {
         // Load module contents
         FlecsSystemsPhysicsImport(ecs);
@@ -226,9 +753,27 @@ public:
         ecs.module<flecs::systems::physics>();
         ecs.component<SpatialQuery>();
         ecs.component<SpatialQueryResult>();
+        ecs.component<SpatialQueryStats>();
+        ecs.component<Broadphase>();
     }
 };
 
+inline void physics::SpatialQuery::findn(
+    physics::SpatialQueryBatch& batch) const
+{
+    ecs_squery_findn_batch(query,
+        ecs_vec_first_t(&batch.probes, ecs_squery_probe_t), batch.count(),
+        &batch.result);
+}
+
+inline void physics::SpatialQuery::findn(
+    const flecs::world& stage, physics::SpatialQueryBatch& batch) const
+{
+    ecs_squery_findn_batch_w_stage(stage, query,
+        ecs_vec_first_t(&batch.probes, ecs_squery_probe_t), batch.count(),
+        &batch.result);
+}
+
 }
 }
 
@@ -29675,6 +29675,8 @@ typedef struct SokolGeometryQuery {
     ecs_entity_t component;
     ecs_query_t *parent_query;
     ecs_query_t *solid;
+    ecs_query_t *particles; /* Particle buffers, only set for boxes */
+    ecs_query_t *tilemaps;  /* Tilemaps, only set for tilemap geometry */
 } SokolGeometryQuery;
 
 /* Element with material parameters */
@@ -32268,6 +32270,7 @@ ECS_COMPONENT_DECLARE(SokolGeometryQuery);
 
 ECS_DECLARE(SokolRectangleGeometry);
 ECS_DECLARE(SokolBoxGeometry);
+ECS_DECLARE(SokolTilemapGeometry);
 
 static
 void sokol_geometry_buffers_init(ecs_allocator_t *a, sokol_geometry_buffers_t *result) {
@@ -32408,16 +32411,37 @@ void sokol_init_box(
     }
 }
 
+// Init static tilemap geometry data. Tiles are rendered as boxes.
+static
+void sokol_init_tilemap(
+    ecs_world_t *world,
+    sokol_resources_t *resources) 
+{
+    if (SokolTilemapGeometry) {
+        SokolGeometry *g = ecs_get_mut(
+            world, ecs_id(SokolTilemapGeometry), SokolGeometry);
+        ecs_assert(g != NULL, ECS_INTERNAL_ERROR, NULL);
+
+        g->vertices = resources->box;
+        g->normals = resources->box_normals;
+        g->indices = resources->box_indices;
+        g->index_count = sokol_box_index_count();
+    }
+}
+
 void sokol_init_geometry(
     ecs_world_t *world,
     sokol_resources_t *resources) 
 {
     sokol_init_rectangle(world, resources);
     sokol_init_box(world, resources);
+    sokol_init_tilemap(world, resources);
 }
 
+// Append particles as box instances. Transforms are computed directly from
+// the particle attributes, so particles don't need a transform component.
 static
-void sokol_populate_buffers(
+void sokol_populate_particles(
     SokolGeometry *geometry,
     sokol_geometry_buffers_t *buffers,
     ecs_query_t *query)
@@ -32425,6 +32449,115 @@ void sokol_populate_buffers(
     const ecs_world_t *world = ecs_get_world(query);
     ecs_allocator_t *a = geometry->allocator;
 
+    ecs_iter_t qit = ecs_query_iter(world, query);
+    while (ecs_query_next(&qit)) {
+        EcsParticleBuffer *pb = ecs_field(&qit, EcsParticleBuffer, 0);
+        EcsEmissive *emissive = ecs_field(&qit, EcsEmissive, 1);
+        EcsSpecular *specular = ecs_field(&qit, EcsSpecular, 2);
+
+        int32_t i, j;
+        for (i = 0; i < qit.count; i ++) {
+            EcsParticleBuffer *b = &pb[i];
+            int32_t cur = ecs_vec_count(&buffers->colors_data);
+            int32_t count = b->count;
+            if (!count) {
+                continue;
+            }
+
+            ecs_vec_grow_t(a, &buffers->transforms_data, mat4, count);
+            ecs_vec_grow_t(a, &buffers->colors_data, ecs_rgb_t, count);
+            ecs_vec_grow_t(a, &buffers->materials_data, SokolMaterial, count);
+
+            mat4 *t = ecs_vec_get_t(&buffers->transforms_data, mat4, cur);
+            ecs_rgb_t *c = ecs_vec_get_t(&buffers->colors_data, ecs_rgb_t, cur);
+            SokolMaterial *m = ecs_vec_get_t(
+                &buffers->materials_data, SokolMaterial, cur);
+
+            // Same as translate * rotate_y * scale
+            for (j = 0; j < count; j ++) {
+                float size = b->size[j];
+                float cos_r = cosf(b->rotation[j]) * size;
+                float sin_r = sinf(b->rotation[j]) * size;
+                glm_vec4_copy((vec4){cos_r, 0, -sin_r, 0}, t[j][0]);
+                glm_vec4_copy((vec4){0, size, 0, 0}, t[j][1]);
+                glm_vec4_copy((vec4){sin_r, 0, cos_r, 0}, t[j][2]);
+                glm_vec4_copy((vec4){b->x[j], b->y[j], b->z[j], 1}, t[j][3]);
+            }
+
+            for (j = 0; j < count; j ++) {
+                c[j].r = b->r[j];
+                c[j].g = b->g[j];
+                c[j].b = b->b[j];
+            }
+
+            // Material is shared by all particles in a buffer
+            SokolMaterial mat = {0};
+            if (emissive) {
+                mat.emissive = ecs_field_is_self(&qit, 1) ? 
+                    emissive[i].value : emissive->value;
+            }
+            if (specular) {
+                const EcsSpecular *sp = ecs_field_is_self(&qit, 2) ? 
+                    &specular[i] : specular;
+                mat.specular_power = sp->specular_power;
+                mat.shininess = sp->shininess;
+            }
+            for (j = 0; j < count; j ++) {
+                m[j] = mat;
+            }
+        }
+    }
+}
+
+// Copy instance data to sokol buffers. Buffers are recreated when the capacity
+// of the instance data changed.
+static
+void sokol_upload_buffers(
+    sokol_geometry_buffers_t *buffers,
+    ecs_size_t old_size,
+    sg_usage usage)
+{
+    ecs_size_t new_size = ecs_vec_size(&buffers->colors_data);
+    if (new_size != old_size) {
+        if (old_size) {
+            sg_destroy_buffer(buffers->colors);
+            sg_destroy_buffer(buffers->transforms);
+            sg_destroy_buffer(buffers->materials);
+        }
+
+        buffers->colors = sg_make_buffer(&(sg_buffer_desc){
+            .size = new_size * sizeof(ecs_rgb_t), .usage = usage });
+        buffers->transforms = sg_make_buffer(&(sg_buffer_desc){
+            .size = new_size * sizeof(EcsTransform3), .usage = usage });
+        buffers->materials = sg_make_buffer(&(sg_buffer_desc){
+            .size = new_size * sizeof(SokolMaterial), .usage = usage });
+    }
+
+    buffers->instance_count = ecs_vec_count(&buffers->colors_data);
+
+    if (buffers->instance_count > 0) {
+        sg_update_buffer(buffers->colors, &(sg_range) {
+            ecs_vec_first_t(&buffers->colors_data, ecs_rgb_t), 
+                buffers->instance_count * sizeof(ecs_rgb_t) } );
+        sg_update_buffer(buffers->transforms, &(sg_range) {
+            ecs_vec_first_t(&buffers->transforms_data, mat4), 
+                buffers->instance_count * sizeof(mat4) } );
+        sg_update_buffer(buffers->materials, &(sg_range) {
+            ecs_vec_first_t(&buffers->materials_data, SokolMaterial), 
+                buffers->instance_count * sizeof(SokolMaterial) } );
+    }
+}
+
+static
+void sokol_populate_buffers(
+    SokolGeometry *geometry,
+    sokol_geometry_buffers_t *buffers,
+    ecs_query_t *query,
+    ecs_query_t *particles)
+{
+    const ecs_world_t *world = ecs_get_world(query);
+    ecs_allocator_t *a = geometry->allocator;
+
     int32_t i, old_size = ecs_vec_size(&buffers->colors_data);
 
     ecs_vec_clear(&buffers->transforms_data);
@@ -32509,38 +32642,88 @@ void sokol_populate_buffers(
             geometry_data, count, geometry_self);
     }
 
-    // Populate sokol buffers
-    {
-        ecs_size_t new_size = ecs_vec_size(&buffers->colors_data);
-        if (new_size != old_size) {
-            if (old_size) {
-                sg_destroy_buffer(buffers->colors);
-                sg_destroy_buffer(buffers->transforms);
-                sg_destroy_buffer(buffers->materials);
+    if (particles) {
+        sokol_populate_particles(geometry, buffers, particles);
+    }
+
+    sokol_upload_buffers(buffers, old_size, SG_USAGE_STREAM);
+}
+
+// Append tiles of tilemaps as box instances. Instance data only depends on the
+// tilemap and its transform, so buffers are only rebuilt when one of these
+// changed, which means static tilemaps cost nothing per frame.
+static
+void sokol_populate_tilemaps(
+    SokolGeometry *geometry,
+    sokol_geometry_buffers_t *buffers,
+    ecs_query_t *query)
+{
+    if (!ecs_query_changed(query)) {
+        return;
+    }
+
+    const ecs_world_t *world = ecs_get_world(query);
+    ecs_allocator_t *a = geometry->allocator;
+
+    int32_t old_size = ecs_vec_size(&buffers->colors_data);
+
+    ecs_vec_clear(&buffers->transforms_data);
+    ecs_vec_clear(&buffers->colors_data);
+    ecs_vec_clear(&buffers->materials_data);
+
+    ecs_iter_t qit = ecs_query_iter(world, query);
+    while (ecs_query_next(&qit)) {
+        EcsTransform3 *transforms = ecs_field(&qit, EcsTransform3, 0);
+        EcsTilemap *tilemaps = ecs_field(&qit, EcsTilemap, 1);
+        EcsEmissive *emissive = ecs_field(&qit, EcsEmissive, 2);
+        EcsSpecular *specular = ecs_field(&qit, EcsSpecular, 3);
+
+        int32_t i, x, y;
+        for (i = 0; i < qit.count; i ++) {
+            EcsTilemap *tm = &tilemaps[i];
+            if (!tm->tiles) {
+                continue;
             }
 
-            buffers->colors = sg_make_buffer(&(sg_buffer_desc){
-                .size = new_size * sizeof(ecs_rgb_t), .usage = SG_USAGE_STREAM });
-            buffers->transforms = sg_make_buffer(&(sg_buffer_desc){
-                .size = new_size * sizeof(EcsTransform3), .usage = SG_USAGE_STREAM });
-            buffers->materials = sg_make_buffer(&(sg_buffer_desc){
-                .size = new_size * sizeof(SokolMaterial), .usage = SG_USAGE_STREAM });
-        }
+            SokolMaterial mat = {0};
+            if (emissive) {
+                mat.emissive = ecs_field_is_self(&qit, 2) ? 
+                    emissive[i].value : emissive->value;
+            }
+            if (specular) {
+                const EcsSpecular *sp = ecs_field_is_self(&qit, 3) ? 
+                    &specular[i] : specular;
+                mat.specular_power = sp->specular_power;
+                mat.shininess = sp->shininess;
+            }
+
+            for (y = 0; y < tm->height; y ++) {
+                for (x = 0; x < tm->width; x ++) {
+                    uint8_t kind = tm->tiles[y * tm->width + x];
+                    ecs_assert(kind < ECS_TILEMAP_MAX_KINDS, 
+                        ECS_INVALID_PARAMETER, NULL);
+                    const EcsTileKind *k = &tm->kinds[kind];
+                    if (k->height <= 0) {
+                        continue;
+                    }
 
-        buffers->instance_count = ecs_vec_count(&buffers->colors_data);
+                    mat4 *t = ecs_vec_append_t(a, &buffers->transforms_data, mat4);
+                    vec3 pos = {x * tm->tile_size, 0, y * tm->tile_size};
+                    vec3 scale = {tm->tile_size, k->height, tm->tile_size};
+                    glm_translate_to(transforms[i].value, pos, *t);
+                    glm_scale(*t, scale);
 
-        if (buffers->instance_count > 0) {
-            sg_update_buffer(buffers->colors, &(sg_range) {
-                ecs_vec_first_t(&buffers->colors_data, ecs_rgb_t), 
-                    buffers->instance_count * sizeof(ecs_rgb_t) } );
-            sg_update_buffer(buffers->transforms, &(sg_range) {
-                ecs_vec_first_t(&buffers->transforms_data, mat4), 
-                    buffers->instance_count * sizeof(mat4) } );
-            sg_update_buffer(buffers->materials, &(sg_range) {
-                ecs_vec_first_t(&buffers->materials_data, SokolMaterial), 
-                    buffers->instance_count * sizeof(SokolMaterial) } );
+                    *ecs_vec_append_t(a, &buffers->colors_data, ecs_rgb_t) = 
+                        k->color;
+                    *ecs_vec_append_t(a, &buffers->materials_data, 
+                        SokolMaterial) = mat;
+                }
+            }
         }
     }
+
+    // Tilemaps change infrequently, so use dynamic instead of stream buffers
+    sokol_upload_buffers(buffers, old_size, SG_USAGE_DYNAMIC);
 }
 
 // System that matches all geometry kinds & calls the function to update GPU
@@ -32554,7 +32737,12 @@ void SokolPopulateGeometry(
 
     int i;
     for (i = 0; i < it->count; i ++) {
-        sokol_populate_buffers(&g[i], &g[i].solid, q[i].solid);    
+        if (q[i].tilemaps) {
+            sokol_populate_tilemaps(&g[i], &g[i].solid, q[i].tilemaps);
+        } else {
+            sokol_populate_buffers(&g[i], &g[i].solid, q[i].solid, 
+                q[i].particles);
+        }
     }
 }
 
@@ -32565,6 +32753,32 @@ void CreateGeometryQueries(ecs_iter_t *it) {
 
     int i;
     for (i = 0; i < it->count; i ++) {
+        // Tilemaps store their own instance data, and are only populated
+        // when a tilemap changed.
+        if (gq[i].component == ecs_id(EcsTilemap)) {
+            gq[i].tilemaps = ecs_query(world, {
+                .terms = {{
+                    .id        = ecs_id(EcsTransform3), 
+                    .src.id    = EcsSelf,
+                    .inout     = EcsIn
+                }, {
+                    .id        = ecs_id(EcsTilemap),
+                    .inout     = EcsIn
+                }, {
+                    .id        = ecs_id(EcsEmissive),
+                    .inout     = EcsIn,
+                    .oper      = EcsOptional
+                }, {
+                    .id        = ecs_id(EcsSpecular),
+                    .inout     = EcsIn,
+                    .oper      = EcsOptional
+                }},
+                .cache_kind = EcsQueryCacheAuto,
+                .flags = EcsQueryDetectChanges
+            });
+            continue;
+        }
+
         // Geometry query that includes all components that are copied (or used
         // to find data to copy) to GPU buffers.
         ecs_query_desc_t desc = {
@@ -32605,6 +32819,25 @@ void CreateGeometryQueries(ecs_iter_t *it) {
                 component_str);
             ecs_os_free(component_str);
         }
+
+        /* Particles are rendered as boxes */
+        if (gq[i].component == ecs_id(EcsBox)) {
+            gq[i].particles = ecs_query(world, {
+                .terms = {{
+                    .id        = ecs_id(EcsParticleBuffer),
+                    .inout     = EcsIn
+                }, {
+                    .id        = ecs_id(EcsEmissive),
+                    .inout     = EcsIn,
+                    .oper      = EcsOptional
+                }, {
+                    .id        = ecs_id(EcsSpecular),
+                    .inout     = EcsIn,
+                    .oper      = EcsOptional
+                }},
+                .cache_kind = EcsQueryCacheAuto
+            });
+        }
     }
 }
 
@@ -32649,6 +32882,12 @@ void FlecsSystemsSokolGeometryImport(
             .component = ecs_id(EcsBox)
         });
 
+    /* Support for tilemaps */
+    ECS_ENTITY_DEFINE(world, SokolTilemapGeometry, Geometry);
+        ecs_set(world, SokolTilemapGeometry, SokolGeometryQuery, {
+            .component = ecs_id(EcsTilemap)
+        });
+
     /* Create system that manages buffers */
     ECS_SYSTEM(world, SokolPopulateGeometry, EcsPreStore, 
         Geometry, [in] GeometryQuery);
@@ -0,0 +1,16 @@
+#ifndef TOWER_DEFENSE_HEADLESS_H
+#define TOWER_DEFENSE_HEADLESS_H
+
+/* This generated file contains includes for project dependencies */
+#include "tower_defense_headless/bake_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,4 @@
+// Builds the tower defense simulation without the renderer, so that it can run
+// on machines without a display. Run from the root of the repository, so that
+// assets can be found.
+#include "../../src/main.cpp"
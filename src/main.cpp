@@ -1,7 +1,22 @@
 #include <iostream>
 #include <initializer_list>
+#ifdef TOWER_DEFENSE_HEADLESS
+#include <tower_defense_headless.h>
+#else
 #include <tower_defense.h>
+#endif
 #include <vector>
+#include <queue>
+#include <algorithm>
+#include <unordered_set>
+#include <bitset>
+#include <cstring>
+#include <cstdlib>
+#include <string>
+#include <memory>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 using namespace std;
 using namespace flecs::components;
@@ -13,6 +28,10 @@ using Velocity = physics::Velocity3;
 using Input = input::Input;
 using SpatialQuery = flecs::systems::physics::SpatialQuery;
 using SpatialQueryResult = flecs::systems::physics::SpatialQueryResult;
+using SpatialQueryStats = flecs::systems::physics::SpatialQueryStats;
+using Broadphase = flecs::systems::physics::Broadphase;
+using ParticleBuffer = graphics::ParticleBuffer;
+using Tilemap = graphics::Tilemap;
 using Color = graphics::Color;
 using Specular = graphics::Specular;
 using Emissive = graphics::Emissive;
@@ -22,7 +41,6 @@ using PointLight = graphics::PointLight;
 #define ECS_PI_2 ((float)(GLM_PI * 2))
 
 // Game constants
-static const int LevelScale = 1;
 static const float EnemySpeed = 5.0;
 static const float EnemySpawnInterval = 0.15;
 
@@ -53,11 +71,42 @@ static const float SparkSize = 0.15;
 static const float TileSize = 3.0;
 static const float TileHeight = 0.6;
 static const float TileSpacing = 0.00;
-static const int TileCountX = 20;
+static const int TileCountX = 20; // Size of the default map
 static const int TileCountZ = 20;
 
-// Direction vector. During pathfinding enemies will cycle through this vector
-// to find the next direction to turn to.
+static const int ChunkSize = 32; // Number of tiles in a chunk in each direction
+static const float ChunkRadius = 120.0;
+static const float ChunkUpdateInterval = 0.25;
+static const int ChunkMaterializeBudget = 2;
+
+// Tile coordinate conversion
+float to_coord(float x) {
+    return x * (TileSpacing + TileSize) - (TileSize / 2.0);
+}
+
+float from_coord(float x) {
+    return (x + (TileSize / 2.0)) / (TileSpacing + TileSize);
+}
+
+// Maps are centered on x = 0, so x coordinates depend on the map width
+float toX(float x, int width) {
+    return to_coord(x + 0.5) - to_coord((width / 2.0));
+}
+
+float toZ(float z) {
+    return to_coord(z);
+}
+
+float from_x(float x, int width) {
+    return from_coord(x + to_coord((width / 2.0))) - 0.5;
+}
+
+float from_z(float z) {
+    return from_coord(z);
+}
+
+// Direction vector. The flow field stores for each tile an index into this
+// vector, which is the direction of the next tile on the route to an exit.
 static const transform::Position2 dir[] = {
     {-1, 0},
     {0, -1},
@@ -84,10 +133,18 @@ public:
         m_values[y * m_width + x] = value;
     }
 
-    const T operator()(int32_t x, int32_t y) {
+    T operator()(int32_t x, int32_t y) const {
         return m_values[y * m_width + x];
     }
 
+    int width() const {
+        return m_width;
+    }
+
+    int height() const {
+        return m_height;
+    }
+
 private:
     int m_width;
     int m_height;
@@ -98,20 +155,368 @@ struct Waypoint {
     float x, y;
 };
 
-enum class TileKind {
+enum class TileKind : uint8_t {
     Turret = 0, // Default
     Path,
     Other
 };
 
+// Stores for each path tile the direction to the next tile on the shortest
+// path to an exit, so enemies don't have to search for a path themselves.
+class flow_field {
+public:
+    enum { None = -1 };
+
+    // Path tiles are copied from the map, as the level stores tile kinds in
+    // chunks which are too slow to look up while searching the field.
+    flow_field(const grid<TileKind>& tiles)
+        : m_width(tiles.width())
+        , m_height(tiles.height())
+        , m_dist(m_width * m_height, Unreachable)
+        , m_dir(m_width * m_height, None)
+        , m_path(m_width * m_height, false)
+        , m_exit(m_width * m_height, false) 
+    { 
+        for (int t = 0; t < m_width * m_height; t ++) {
+            m_path[t] = tiles(t % m_width, t / m_width) == TileKind::Path;
+        }
+    }
+
+    int width() const {
+        return m_width;
+    }
+
+    int height() const {
+        return m_height;
+    }
+
+    void add_exit(int x, int y) {
+        m_exit[x + y * m_width] = true;
+    }
+
+    // Compute directions for all tiles
+    void build() {
+        std::fill(m_dist.begin(), m_dist.end(), Unreachable);
+        std::fill(m_dir.begin(), m_dir.end(), None);
+
+        queue q;
+        for (int t = 0; t < m_width * m_height; t ++) {
+            if (m_exit[t] && is_path(t)) {
+                m_dist[t] = 0;
+                q.push({0, t});
+            }
+        }
+
+        propagate(q);
+    }
+
+    // Update directions after a tile became a path tile, or stopped being one
+    void update(int x, int y, bool path) {
+        int t = x + y * m_width;
+        m_path[t] = path;
+        queue q;
+
+        if (is_path(t)) {
+            // Tile opened up, which can only make paths shorter
+            if (m_exit[t]) {
+                m_dist[t] = 0;
+                m_dir[t] = None;
+            } else {
+                relax(t);
+            }
+
+            if (m_dist[t] != Unreachable) {
+                q.push({m_dist[t], t});
+            }
+        } else {
+            // Tile got blocked. Reset all tiles that routed through it, and
+            // recompute them from the tiles around them that still have a path.
+            std::vector<int> reset = { t };
+            m_dist[t] = Unreachable;
+            m_dir[t] = None;
+
+            for (size_t r = 0; r < reset.size(); r ++) {
+                for (int i = 0; i < 4; i ++) {
+                    int n = neighbour(reset[r], i);
+                    if (n != None && m_dir[n] == opposite(i)) {
+                        m_dist[n] = Unreachable;
+                        m_dir[n] = None;
+                        reset.push_back(n);
+                    }
+                }
+            }
+
+            for (int r : reset) {
+                if (is_path(r)) {
+                    relax(r);
+                    if (m_dist[r] != Unreachable) {
+                        q.push({m_dist[r], r});
+                    }
+                }
+            }
+        }
+
+        propagate(q);
+    }
+
+    // Index into dir, or None if there is no path to an exit
+    int direction(int x, int y) const {
+        if (x < 0 || x >= m_width || y < 0 || y >= m_height) {
+            return None;
+        }
+        return m_dir[x + y * m_width];
+    }
+
+    // Number of tiles to the closest exit, or None if there is no path
+    int distance(int x, int y) const {
+        if (x < 0 || x >= m_width || y < 0 || y >= m_height) {
+            return None;
+        }
+        int d = m_dist[x + y * m_width];
+        return d == Unreachable ? None : d;
+    }
+
+    bool is_exit(int x, int y) const {
+        if (x < 0 || x >= m_width || y < 0 || y >= m_height) {
+            return false;
+        }
+        return m_exit[x + y * m_width] && !m_dist[x + y * m_width];
+    }
+
+private:
+    enum { Unreachable = INT32_MAX };
+
+    // Open tiles ordered by distance to exit
+    using queue = std::priority_queue<std::pair<int, int>, 
+        std::vector<std::pair<int, int>>, std::greater<std::pair<int, int>>>;
+
+    static int opposite(int d) {
+        return (d + 2) % 4;
+    }
+
+    bool is_path(int t) const {
+        return m_path[t];
+    }
+
+    // Returns tile in direction d of tile t, or None if not on the grid
+    int neighbour(int t, int d) const {
+        int x = t % m_width + dir[d].x;
+        int y = t / m_width + dir[d].y;
+        if (x < 0 || x >= m_width || y < 0 || y >= m_height) {
+            return None;
+        }
+        return x + y * m_width;
+    }
+
+    // Route tile through its closest neighbour
+    void relax(int t) {
+        for (int i = 0; i < 4; i ++) {
+            int n = neighbour(t, i);
+            if (n != None && m_dist[n] != Unreachable && 
+                m_dist[n] + 1 < m_dist[t]) 
+            {
+                m_dist[t] = m_dist[n] + 1;
+                m_dir[t] = i;
+            }
+        }
+    }
+
+    void propagate(queue& q) {
+        while (!q.empty()) {
+            auto cur = q.top();
+            q.pop();
+
+            int t = cur.second;
+            if (cur.first != m_dist[t]) {
+                continue; // Tile was already reached through a shorter path
+            }
+
+            for (int i = 0; i < 4; i ++) {
+                int n = neighbour(t, i);
+                if (n == None || !is_path(n)) {
+                    continue;
+                }
+
+                if (m_dist[t] + 1 < m_dist[n]) {
+                    m_dist[n] = m_dist[t] + 1;
+                    m_dir[n] = opposite(i);
+                    q.push({m_dist[n], n});
+                }
+            }
+        }
+    }
+
+    int m_width;
+    int m_height;
+    std::vector<int> m_dist;
+    std::vector<int> m_dir;
+    std::vector<bool> m_path;
+    std::vector<bool> m_exit;
+};
+
+// Section of a path between two distances along the path
+struct path_range {
+    float from;
+    float to;
+};
+
+// Route from a tile to an exit as a polyline in world coordinates. Positions
+// on the path are looked up by arc length, so enemies only have to store how
+// far along the path they are.
+class level_path {
+public:
+    level_path() : m_complete(false) { }
+
+    // Compile path by following the flow field from a tile. Only the corners
+    // of the route are stored, so straight sections are a single segment.
+    level_path(const flow_field& flow, int x, int y) 
+        : m_width(flow.width())
+        , m_complete(false) 
+    {
+        int prev = flow_field::None;
+        add(x, y);
+
+        while (!flow.is_exit(x, y)) {
+            int d = flow.direction(x, y);
+            if (d == flow_field::None) {
+                break; // No route to an exit, path ends here
+            }
+
+            if (prev != flow_field::None && d != prev) {
+                add(x, y);
+            }
+
+            x += dir[d].x;
+            y += dir[d].y;
+            prev = d;
+        }
+
+        if (x != m_last_x || y != m_last_y) {
+            add(x, y);
+        }
+
+        m_complete = flow.is_exit(x, y);
+    }
+
+    float length() const {
+        return m_length.empty() ? 0 : m_length.back();
+    }
+
+    // Whether the end of the path is an exit
+    bool complete() const {
+        return m_complete;
+    }
+
+    // Position at distance s from the start of the path
+    transform::Position2 eval(float s) const {
+        if (m_points.size() < 2 || s <= 0) {
+            return m_points.empty() ? transform::Position2{0, 0} : m_points[0];
+        }
+
+        if (s >= length()) {
+            return m_points.back();
+        }
+
+        // Segment that contains s
+        size_t i = std::upper_bound(m_length.begin(), m_length.end(), s) -
+            m_length.begin() - 1;
+        const transform::Position2& a = m_points[i];
+        const transform::Position2& b = m_points[i + 1];
+        float t = (s - m_length[i]) / (m_length[i + 1] - m_length[i]);
+
+        return {a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t};
+    }
+
+    // Distance along the path of the point on the path closest to (x, z)
+    float project(float x, float z) const {
+        float result = 0, closest = FLT_MAX;
+        for (size_t i = 1; i < m_points.size(); i ++) {
+            const transform::Position2& a = m_points[i - 1];
+            const transform::Position2& b = m_points[i];
+            float seg = m_length[i] - m_length[i - 1];
+            float t = ((x - a.x) * (b.x - a.x) + (z - a.y) * (b.y - a.y)) /
+                (seg * seg);
+            t = glm_clamp(t, 0, 1);
+
+            float dx = a.x + (b.x - a.x) * t - x;
+            float dz = a.y + (b.y - a.y) * t - z;
+            float dist = dx * dx + dz * dz;
+            if (dist < closest) {
+                closest = dist;
+                result = m_length[i - 1] + seg * t;
+            }
+        }
+        return result;
+    }
+
+    // Sections of the path that are within radius of (x, z), ordered by 
+    // distance along the path. Sections of consecutive segments are merged.
+    void ranges(float x, float z, float radius, 
+        std::vector<path_range>& result) const 
+    {
+        result.clear();
+        for (size_t i = 1; i < m_points.size(); i ++) {
+            const transform::Position2& a = m_points[i - 1];
+            const transform::Position2& b = m_points[i];
+            float seg = m_length[i] - m_length[i - 1];
+
+            // Solve |a + dir * s - (x, z)| = radius for s along the segment
+            float dx = (b.x - a.x) / seg, dz = (b.y - a.y) / seg;
+            float fx = a.x - x, fz = a.y - z;
+            float half_b = fx * dx + fz * dz;
+            float c = fx * fx + fz * fz - radius * radius;
+            float disc = half_b * half_b - c;
+            if (disc < 0) {
+                continue;
+            }
+
+            float root = sqrtf(disc);
+            float s0 = glm_max(-half_b - root, 0);
+            float s1 = glm_min(-half_b + root, seg);
+            if (s0 > s1) {
+                continue;
+            }
+
+            path_range r = {m_length[i - 1] + s0, m_length[i - 1] + s1};
+            if (!result.empty() && r.from <= result.back().to) {
+                result.back().to = r.to;
+            } else {
+                result.push_back(r);
+            }
+        }
+    }
+
+private:
+    void add(int x, int y) {
+        transform::Position2 p = {toX(x, m_width), toZ(y)};
+        if (m_points.empty()) {
+            m_length.push_back(0);
+        } else {
+            const transform::Position2& last = m_points.back();
+            m_length.push_back(m_length.back() +
+                sqrtf((p.x - last.x) * (p.x - last.x) +
+                      (p.y - last.y) * (p.y - last.y)));
+        }
+        m_points.push_back(p);
+        m_last_x = x;
+        m_last_y = y;
+    }
+
+    std::vector<transform::Position2> m_points;
+    std::vector<float> m_length; // Cumulative length at each point
+    int m_last_x = 0;
+    int m_last_y = 0;
+    int m_width = 0; // Width of the map, for tile coordinates
+    bool m_complete;
+};
+
 struct Waypoints {
-    Waypoints(grid<TileKind> *g, initializer_list<Waypoint> pts) : tiles(g) {
+    Waypoints(grid<TileKind> *g, const std::vector<Waypoint>& pts) : tiles(g) {
         for (const auto& p : pts)
             add(p, TileKind::Path);
     }
 
     void add(Waypoint next, TileKind kind) {
-        next.x *= LevelScale; next.y *= LevelScale;
         if (next.x == last.x) {
             do {
                 last.y += (last.y < next.y) - (last.y > next.y);
@@ -147,20 +552,125 @@ struct Game {
     
     Position center;
     float size;
+    float tile_size;
+};
+
+// Load of the simulation. The default values are the ones used by the game,
+// the headless runner uses other values for its benchmark scenarios.
+struct Scenario {
+    Scenario(const char *name_arg = "default") {
+        name = name_arg;
+        cannons = -1;
+        lasers = -1;
+        enemies = 0;
+        spawn_interval = EnemySpawnInterval;
+        map_width = TileCountX;
+        map_height = TileCountZ;
+        chunk_radius = ChunkRadius;
+        frames = 3600;
+        fps = 60;
+        threads = 1;
+        seed = 1;
+        analytic_projectiles = false;
+        targeting = -1;
+        reroute_interval = 0;
+    }
+
+    const char *name;
+    int cannons;          // Number of cannons, -1 for randomly placed turrets
+    int lasers;           // Number of lasers, -1 for randomly placed turrets
+    int enemies;          // Number of enemies spread out over the path at start
+    float spawn_interval; // Time between enemy spawns, 0 to not spawn enemies
+    int map_width;        // Number of tiles, at least 3 in each direction
+    int map_height;
+    float chunk_radius;   // Distance to camera or enemies of visible chunks
+    int frames;           // Number of frames to simulate
+    float fps;            // Simulated frames per second
+    int threads;          // Number of threads that run per entity systems
+    uint64_t seed;        // Seed of the random streams
+    bool analytic_projectiles; // Resolve cannon hits without bullet entities
+    int targeting;        // TargetPolicy of turrets, -1 for policy of prefabs
+    float reroute_interval; // Time between opening and closing a shortcut in
+                            // the path, 0 to keep the path the same
+};
+
+// Square of ChunkSize x ChunkSize tiles. Entities for the tiles and trees of
+// a chunk are only created while the chunk is close to the camera or enemies.
+struct TileChunk {
+    // Index of tile in chunk
+    static int index(int x, int y) {
+        return (y % ChunkSize) * ChunkSize + (x % ChunkSize);
+    }
+
+    int32_t x, y;      // Chunk coordinates
+    bool materialized; // Whether entities for the chunk exist
+    bool dirty;        // Whether tiles changed since chunk was materialized
+    TileKind kinds[ChunkSize * ChunkSize];    // Kind of each tile
+    std::bitset<ChunkSize * ChunkSize> trees; // Tiles with a tree
 };
 
 struct Level {
     Level() {
-        map = nullptr;
+        width = 0;
+        height = 0;
+        spawn_x = 0;
+        spawn_y = 0;
+        version = 0;
+        chunks_x = 0;
+        chunks_y = 0;
+        chunk_radius = ChunkRadius;
+        shortcut_x = -1;
+        shortcut_y = -1;
+    }
+
+    Level(std::unique_ptr<flow_field> arg_flow, int arg_spawn_x, int arg_spawn_y) 
+    {
+        flow = std::move(arg_flow);
+        width = flow->width();
+        height = flow->height();
+        spawn_x = arg_spawn_x;
+        spawn_y = arg_spawn_y;
+        path = level_path(*flow, spawn_x, spawn_y);
+        version = 0;
+        chunks_x = (width + ChunkSize - 1) / ChunkSize;
+        chunks_y = (height + ChunkSize - 1) / ChunkSize;
+        chunk_radius = ChunkRadius;
+        shortcut_x = -1;
+        shortcut_y = -1;
+    }
+
+    // Chunk that contains tile
+    flecs::entity chunk(int x, int y) const {
+        return chunks[(y / ChunkSize) * chunks_x + (x / ChunkSize)];
+    }
+
+    TileKind tile(int x, int y) const {
+        return chunk(x, y).get<TileChunk>().kinds[TileChunk::index(x, y)];
     }
 
-    Level(grid<TileKind> *arg_map, transform::Position2 arg_spawn) {
-        map = arg_map;
-        spawn_point = arg_spawn;
+    // Change kind of tile, and update paths of enemies
+    void set_tile(int x, int y, TileKind kind) {
+        // Recreate tile entities on the next chunk update
+        TileChunk& tc = chunk(x, y).get_mut<TileChunk>();
+        tc.kinds[TileChunk::index(x, y)] = kind;
+        tc.trees.reset(TileChunk::index(x, y));
+        tc.dirty = true;
+
+        flow->update(x, y, kind == TileKind::Path);
+        path = level_path(*flow, spawn_x, spawn_y);
+        version ++;
     }
 
-    grid<TileKind> *map;
-    transform::Position2 spawn_point;  
+    int width, height; // Number of tiles
+    std::unique_ptr<flow_field> flow;
+    level_path path;
+    int spawn_x, spawn_y;
+    int version; // Increases each time the path changes
+    int shortcut_x, shortcut_y; // Tile that is opened and closed, -1 if none
+
+    std::vector<flecs::entity> chunks; // Tile chunks, row by row
+    int chunks_x, chunks_y;
+    float chunk_radius; // Chunks within this distance are materialized
 };
 
 struct Particle {
@@ -177,15 +687,174 @@ struct ParticleLifespan {
     float t;
 };
 
+// Effect that stores its particles in a ParticleBuffer instead of as entities.
+// Properties are copied from the prefab of the effect.
+struct ParticleEffect {
+    Particle properties;
+    float size;
+    Color color;
+    Velocity velocity;
+};
+
+// Entities with the particle buffers of effects
+struct Effects {
+    flecs::entity smoke;
+    flecs::entity spark;
+    flecs::entity ion;
+    flecs::entity bolt;
+    flecs::entity nozzle_flash;
+    flecs::entity tracer;
+};
+
 struct ExplosionLight {
     float intensity;
     float decay;
 };
 
+// Component of pooled instances that is reset when an instance is reused
+struct PoolReset {
+    flecs::id_t id;
+    const ecs_type_info_t *ti;
+};
+
+// Recycles instances of the prefab it is added to. Instances that expire are
+// disabled instead of deleted, and reactivated the next time the prefab is
+// spawned, which saves creating and deleting short lived entities.
+struct EntityPool {
+    EntityPool(int32_t capacity_arg = 256) {
+        capacity = capacity_arg;
+        hits = 0;
+        misses = 0;
+        has_reset = false;
+    }
+
+    int32_t capacity;   // Max number of disabled instances kept around
+    int64_t hits;       // Spawns that reused a disabled instance
+    int64_t misses;     // Spawns that created a new instance
+    std::vector<flecs::entity_t> free;
+    std::unordered_set<flecs::entity_t> is_free;
+    std::vector<PoolReset> reset; // Components copied from the prefab
+    std::vector<char> init;       // Default value of a reset component
+    bool has_reset;
+};
+
+// Explosion that is created after a system running on worker threads is done
+struct Explosion {
+    Position p;
+    float pC, rC;
+    Color rgb_rnd, rgb_c;
+};
+
+// Enemy selected as target by a turret
+struct TargetLink {
+    flecs::entity_t turret;
+    flecs::entity_t enemy;
+};
+
+// Damage dealt to an enemy, which is applied once per frame
+struct Damage {
+    flecs::entity_t enemy;
+    float amount;
+};
+
+// Result of a spatial query search. Copies start out empty, as a result is
+// only used until the next search.
+struct SearchResult : SpatialQueryResult {
+    SearchResult() {
+        ecs_vec_init_t(NULL, &results, ecs_oct_entity_t, 0);
+    }
+
+    SearchResult(const SearchResult&) : SearchResult() { }
+
+    SearchResult& operator=(const SearchResult&) {
+        return *this;
+    }
+
+    ~SearchResult() {
+        ecs_vec_fini_t(NULL, &results, ecs_oct_entity_t);
+    }
+};
+
+// Work of systems that run on worker threads, which can't be done on the
+// thread itself because it creates entities or modifies data shared by all
+// threads, like entity pools and particle buffers. Each stage has its own
+// queue, and queues are flushed on the main thread.
+struct StageQueue {
+    std::vector<flecs::entity_t> release; // Entities to return to their pool
+    std::vector<Explosion> explosions;
+    std::vector<Damage> damage;
+    std::vector<TargetLink> targets; // Targets selected by turrets
+    SearchResult nearby; // Enemies near a turret
+};
+
+struct StageQueues {
+    std::vector<StageQueue> stages;
+    std::vector<flecs::entity_t> release; // Work of all stages, sorted
+    std::vector<Explosion> explosions;
+    std::vector<Damage> damage; // Applied in the last frame, sorted by enemy
+};
+
+// Cannon round that is resolved when it is fired, instead of being simulated
+// as a bullet entity.
+struct Impact {
+    float time;              // Game time at which the round hits its target
+    flecs::entity_t target;
+
+    bool operator>(const Impact& other) const {
+        return time > other.time;
+    }
+};
+
+// Impacts of analytic cannon rounds, ordered by time. Only exists when the
+// scenario enables analytic projectiles, in which case there is no bullet
+// broadphase.
+struct ImpactQueue {
+    ImpactQueue() {
+        time = 0;
+    }
+
+    // Add impact of a round that hits its target after travel seconds
+    void push(flecs::entity_t target, float travel) {
+        impacts.push_back({time + travel, target});
+        std::push_heap(impacts.begin(), impacts.end(), std::greater<Impact>());
+    }
+
+    std::vector<Impact> impacts; // Min heap on time
+    float time;                  // Game time of the queue
+};
+
+// Session that is written to or read from a binary recording. A recording
+// starts with the seed, time step and parameters of the scenario, followed by
+// the external commands of each frame. The only external input is the camera,
+// which decides which chunks are materialized. Each frame ends with a checksum
+// of the simulation state, so a replay can detect the first frame at which it
+// no longer matches the recording.
+struct Recording {
+    Recording() {
+        file = nullptr;
+        replay = false;
+        frames = 0;
+        frame = 0;
+        diverged = -1;
+        camera = {};
+        camera_rotation = {};
+    }
+
+    FILE *file;
+    bool replay;
+    int32_t frames;    // Number of frames in the recording
+    int32_t frame;     // Current frame
+    int32_t diverged;  // First frame that doesn't match the recording, or -1
+    Position camera;   // Last recorded camera transform
+    Rotation camera_rotation;
+};
+
 struct Enemy { };
 
-struct Direction {
-    int value;
+// Distance an enemy has travelled along the level path
+struct PathProgress {
+    float value;
+    int version; // Level path version the distance was computed for
 };
 
 struct Health {
@@ -217,24 +886,148 @@ struct HitCooldown {
     float value;
 };
 
+// Health below which an enemy changes color and emits an explosion
+struct HealthTier {
+    float threshold;
+    float pC, rC;  // Size of explosion
+    Color rgb_rnd; // Color of explosion
+    Color rgb_c;
+    Color color;   // Color of enemy
+};
+
+static const HealthTier HealthTiers[] = {
+    {0.9, 0.2, 0.3, {0.01, 0.3, 0.3}, {0.05, 0.7, 0.2}, {0.05, 0.2, 0.6}},
+    {0.7, 0.4, 0.5, {0.01, 0.3, 0.3}, {0.01, 0.2, 0.8}, {0.2, 0.05, 0.4}},
+    {0.5, 0.5, 0.5, {0.3, 0.01, 0.3}, {0.01, 0.01, 0.7}, {0.2, 0.05, 0.2}},
+    {0.3, 0.6, 0.7, {0.5, 0.2, 0.5}, {0.8, 0.01, 0.8}, {0.1, 0.03, 0.0}}
+};
+
+static const int HealthTierCount = 
+    sizeof(HealthTiers) / sizeof(HealthTiers[0]);
+
+// Number of tiers an enemy with health has dropped below
+int health_tier(float health) {
+    int result = 0;
+    while (result < HealthTierCount && 
+        health < HealthTiers[result].threshold) 
+    {
+        result ++;
+    }
+    return result;
+}
+
+// Event emitted for an enemy when its health drops below a tier
+struct HealthTierCrossed {
+    int tier; // Index in HealthTiers
+};
+
+// Event emitted for an enemy when its health drops to 0
+struct EnemyDied { };
+
 struct Laser { };
 
 struct Target {
     Target() {
-        prev_position[0] = 0;
-        prev_position[1] = 0;
-        prev_position[2] = 0;
         lock = false;
     }
 
     flecs::entity target;
-    vec3 prev_position;
     vec3 aim_position;
     float angle;
     float distance;
     bool lock;
 };
 
+// Turrets that selected an enemy as target. Used to clear the target of those
+// turrets when the enemy is deleted, so turrets don't have to test whether 
+// their target is still alive. Turrets aren't removed when they drop a target,
+// so the target of a turret is checked before it is cleared.
+struct Targeters {
+    std::vector<flecs::entity_t> turrets;
+};
+
+// Which enemy in range a turret selects as target
+enum class TargetPolicy : int32_t {
+    Closest,   // Closest to the turret
+    First,     // Furthest along the path
+    Last,      // Least far along the path
+    Strongest, // Most health
+    Weakest    // Least health
+};
+
+// Targeting policy of a turret, inherited from its prefab
+struct TargetingPolicy {
+    TargetPolicy value;
+};
+
+// Sections of the level path within range of a turret, as distances along the
+// path. Computed when the path changes.
+struct TurretCoverage {
+    TurretCoverage() {
+        version = -1;
+    }
+
+    int version; // Level path version the sections were computed for
+    std::vector<path_range> ranges;
+};
+
+// Enemy in the ordered enemy index
+struct OrderedEnemy {
+    flecs::entity_t id;
+    float progress;
+    float health;
+    Position position;
+};
+
+// Location of an enemy in EnemyOrder::enemies
+struct EnemySlot {
+    uint32_t frame; // Frame in which the enemy was collected
+    uint32_t index;
+};
+
+// Enemies ordered by distance along the path and by health. Turrets find the
+// target for their policy by walking an index, and stop at the first enemy in
+// range instead of comparing all candidates. The indices are kept between
+// frames and repaired after enemies moved, which is done once instead of 
+// sorting candidates for each turret. An index is only kept when a turret has
+// a policy that uses it.
+struct EnemyOrder {
+    EnemyOrder() {
+        frame = 0;
+    }
+
+    // Enemy as collected this frame, or nullptr if the entity isn't an enemy
+    const OrderedEnemy* find(flecs::entity_t id) const {
+        uint32_t key = (uint32_t)id;
+        if (key >= slots.size() || slots[key].frame != frame) {
+            return nullptr;
+        }
+        return &enemies[slots[key].index];
+    }
+
+    flecs::query<const TargetingPolicy> policies; // Policies of turrets
+    uint32_t frame;
+    std::vector<OrderedEnemy> enemies; // In the order they were collected
+    std::vector<EnemySlot> slots; // By low 32 bits of entity id
+    std::vector<uint8_t> state;   // Of enemies, while an index is updated
+    std::vector<OrderedEnemy> moved, merged;
+    std::vector<OrderedEnemy> by_progress; // Ascending, ties by id
+    std::vector<OrderedEnemy> by_health;   // Ascending, ties by progress
+};
+
+// Slot entities of a turret, and refs to the slot components that turret
+// systems write each frame. Filled once when a turret is instantiated, so
+// systems don't look up slots for each turret each frame.
+struct TurretRig {
+    flecs::entity head;
+    flecs::entity barrel_left;  // Cannons only
+    flecs::entity barrel_right;
+    flecs::entity beam;         // Lasers only
+    flecs::ref<Rotation> head_rotation;
+    flecs::ref<Position> beam_position;
+    flecs::ref<Box> beam_box;
+};
+
 // Prefab types
 namespace prefabs {
     struct Tree {
@@ -254,7 +1047,9 @@ namespace prefabs {
     };
 
     struct Particle { };
+    struct Light { };
     struct Bullet { };
+    struct Tracer { };
     struct NozzleFlash { };
     struct Smoke { };
     struct Spark { };
@@ -284,7 +1079,7 @@ namespace prefabs {
 
 using namespace tower_defense;
 
-// Scope for level entities (tile, path)
+// Scope for level entities (tile chunks, trees)
 struct level { };
 
 // Scope for turrets
@@ -297,236 +1092,721 @@ struct enemies { };
 struct particles { };
 
 // Utility functions
-float randf(float scale) {
-    return ((float)rand() / (float)RAND_MAX) * scale;
-}
 
-float to_coord(float x) {
-    return x * (TileSpacing + TileSize) - (TileSize / 2.0);
+// Finalizer of the SplitMix64 generator, which scrambles the bits of a value
+uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
 }
 
-float from_coord(float x) {
-    return (x + (TileSize / 2.0)) / (TileSpacing + TileSize);
-}
+// Counter based random number generator. The n-th number of a stream is a hash
+// of the seed, the stream and n, so a stream produces the same numbers for the
+// same seed regardless of how other streams are used.
+struct RandomStream {
+    RandomStream(uint64_t seed = 0, uint64_t stream = 0) {
+        key = mix64(seed ^ mix64(stream + 1));
+        counter = 0;
+    }
 
-float toX(float x) {
-    return to_coord(x + 0.5) - to_coord((TileCountX / 2.0));
-}
+    // Value between 0 and scale
+    float randf(float scale) {
+        uint64_t r = mix64(key + (++ counter) * 0x9e3779b97f4a7c15ull);
+        return ((float)(r >> 40) / (float)(1 << 24)) * scale;
+    }
 
-float toZ(float z) {
-    return to_coord(z);
-}
+    // Value between 0 and n - 1
+    uint32_t randi(uint32_t n) {
+        return (uint32_t)((mix64(key + (++ counter) * 0x9e3779b97f4a7c15ull) 
+            >> 32) % n);
+    }
 
-float from_x(float x) {
-    return from_coord(x + to_coord((TileCountX / 2.0))) - 0.5;
-}
+    uint64_t key;
+    uint64_t counter;
+};
 
-float from_z(float z) {
-    return from_coord(z);
+// Random streams of the game. Streams aren't thread safe, so systems that run
+// on worker threads queue work that needs random numbers for the main thread.
+struct Random {
+    Random(uint64_t seed = 0)
+        : level(seed, 0)
+        , turrets(seed, 1)
+        , explosions(seed, 2)
+        , sparks(seed, 3) { }
+
+    RandomStream level;      // Trees
+    RandomStream turrets;    // Turret placement and type
+    RandomStream explosions; // Smoke and spark particles of explosions
+    RandomStream sparks;     // Ion particles of laser beams
+};
+
+// Turrets are aimed in batches of this size, so the kernel buffers fit on the
+// stack of a worker thread.
+static const int32_t AimBatchSize = 64;
+
+// Inputs and outputs of the aiming kernel for a batch of turrets
+struct AimBatch {
+    float dx[AimBatchSize];       // Aim position relative to turret
+    float dz[AimBatchSize];
+    float rotation[AimBatchSize]; // Rotation of turret head, updated in place
+    float angle[AimBatchSize];    // Angle towards aim position
+};
+
+// Approximation of atan2 that doesn't branch, so it can be used in vectorized
+// loops. The polynomial approximates atan on [0, 1], the max error is 2e-6
+// radians which is well below what is visible on screen. Octant fixups use 
+// copysign, because selects between expressions are compiled to branches.
+inline float atan2_approx(float y, float x) {
+    float ax = fabsf(x), az = fabsf(y);
+    float hi = ax > az ? ax : az;
+    float lo = ax > az ? az : ax;
+    float a = lo / (hi + FLT_MIN);
+    float s = a * a;
+    float r = a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f + 
+        s * (-0.11643287f + s * (0.05265332f + s * -0.01172120f)))));
+    r = GLM_PI_4f - copysignf(GLM_PI_4f - r, ax - az); // r = PI/2 - r if az > ax
+    r = GLM_PI_2f - copysignf(GLM_PI_2f - r, x);       // r = PI - r if x < 0
+    return copysignf(r, y);
 }
 
-float angle_normalize(float angle) {
-    return angle - floor(angle / ECS_PI_2) * ECS_PI_2;
+// Round to the nearest integer without branches. Adding and subtracting
+// 1.5 * 2^23 pushes the fraction out of the mantissa.
+inline float round_approx(float v) {
+    return (v + 12582912.0f) - 12582912.0f;
 }
 
-float look_at(vec3 eye, vec3 dest) {
-    vec3 diff;
-    
-    glm_vec3_sub(dest, eye, diff);
-    float x = fabs(diff[0]), z = fabs(diff[2]);
-    bool x_sign = diff[0] < 0, z_sign = diff[2] < 0;
-    float r = atan(z / x);
+// Wrap an angle to [-PI, PI]
+inline float angle_wrap(float angle) {
+    return angle - round_approx(angle * (1.0f / ECS_PI_2)) * ECS_PI_2;
+}
 
-    if (z_sign) {
-        r += GLM_PI;
+// Compute the angle towards the aim position and rotate the heads towards it
+// in the direction of the shortest arc, for a batch of turrets. A head that
+// reaches its angle is snapped to it, so the turret can test for a lock by
+// comparing the two. The loop has no branches and no dependencies between 
+// elements, so it is vectorized.
+void aim_batch(AimBatch& b, int32_t count, float increment) {
+    for (int32_t i = 0; i < count; i ++) {
+        float angle = -atan2_approx(b.dz[i], b.dx[i]);
+        float cur = b.rotation[i];
+        float diff = angle_wrap(angle - cur);
+        float step = diff > increment ? increment : diff;
+        step = step < -increment ? -increment : step;
+        float next = angle_wrap(cur + step);
+        bool reached = diff <= increment && diff >= -increment;
+        b.rotation[i] = reached ? angle : next;
+        b.angle[i] = angle;
     }
+}
 
-    if (z_sign == x_sign) {
-        r = -r + GLM_PI;
-    }
+// Add components that a prefab and its bases copy to instances to the list of
+// components that are reset when an instance is reused.
+void pool_add_reset(flecs::world& ecs, flecs::entity prefab, EntityPool& pool) {
+    prefab.each(flecs::IsA, [&](flecs::entity base) {
+        pool_add_reset(ecs, base, pool);
+    });
+
+    prefab.each([&](flecs::id id) {
+        flecs::id_t comp = id.raw_id() & ~ECS_AUTO_OVERRIDE;
+        if (ECS_IS_PAIR(comp)) {
+            return;
+        }
+
+        bool auto_override = comp != id.raw_id();
+        if (!auto_override && ecs_get_target(ecs, comp, EcsOnInstantiate, 0)) {
+            return; // Inherited, or not added to instances
+        }
 
-    return angle_normalize(r + GLM_PI);
+        const ecs_type_info_t *ti = ecs_get_type_info(ecs, comp);
+        if (!ti) {
+            return;
+        }
+
+        for (const PoolReset& r : pool.reset) {
+            if (r.id == comp) {
+                return;
+            }
+        }
+        pool.reset.push_back({comp, ti});
+    });
 }
 
-float rotate_to(float cur, float target, float increment) {
-    cur = angle_normalize(cur);
-    target = angle_normalize(target);
+// Create an instance of a prefab, or reuse one from the prefab's pool
+flecs::entity pool_spawn(flecs::world& ecs, flecs::entity prefab) {
+    EntityPool *pool = prefab.try_get_mut<EntityPool>();
+    if (!pool || pool->free.empty()) {
+        if (pool) {
+            pool->misses ++;
+        }
+        return ecs.entity().is_a(prefab).child_of<particles>();
+    }
 
-    if (cur - target > GLM_PI) {
-        cur -= ECS_PI_2;
-    } else if (cur - target < -GLM_PI) {
-        cur += ECS_PI_2;
+    flecs::entity e = ecs.entity(pool->free.back());
+    pool->free.pop_back();
+    pool->is_free.erase(e);
+    pool->hits ++;
+
+    // Components that aren't copied from the prefab are added by the code that
+    // spawns the instance, and are set again by it. Only reset the components
+    // that a new instance gets from the prefab. The list is built when the pool
+    // first reuses an instance, when the prefab is fully loaded.
+    if (!pool->has_reset) {
+        pool_add_reset(ecs, prefab, *pool);
+        pool->has_reset = true;
     }
-    
-    if (cur > target) {
-        cur -= increment;
-        if (cur < target) {
-            cur = target;
+
+    // Components that the prefab doesn't have a value for are default 
+    // constructed.
+    for (const PoolReset& r : pool->reset) {
+        const void *value = ecs_get_id(ecs, prefab, r.id);
+        if (value) {
+            ecs_set_id(ecs, e, r.id, r.ti->size, value);
+            continue;
         }
-    } else {
-        cur += increment;
-        if (cur > target) {
-            cur = target;
+
+        std::vector<char>& init = pool->init;
+        init.assign(r.ti->size, 0);
+        if (r.ti->hooks.ctor) {
+            r.ti->hooks.ctor(init.data(), 1, r.ti);
+        }
+        ecs_set_id(ecs, e, r.id, r.ti->size, init.data());
+        if (r.ti->hooks.dtor) {
+            r.ti->hooks.dtor(init.data(), 1, r.ti);
         }
     }
 
-    return cur;
+    return e.enable();
 }
 
-// Check if enemy needs to change direction
-bool find_path(Position& p, Direction& d, const Level& lvl) {
-    // Check if enemy is in center of tile
-    float t_x = from_x(p.x);
-    float t_y = from_z(p.z);
-    int ti_x = (int)t_x;
-    int ti_y = (int)t_y;
-    float td_x = t_x - ti_x;
-    float td_y = t_y - ti_y;
-
-    // If enemy is in center of tile, decide where to go next
-    if (td_x < 0.1 && td_y < 0.1) {
-        grid<TileKind> *tiles = lvl.map;
+// Return an instance to the pool of its prefab, or delete it if the prefab
+// has no pool or the pool is full.
+void pool_release(flecs::entity e) {
+    flecs::entity prefab = e.target(flecs::IsA);
+    EntityPool *pool = prefab ? prefab.try_get_mut<EntityPool>() : nullptr;
+    if (!pool || static_cast<int32_t>(pool->free.size()) >= pool->capacity) {
+        e.destruct();
+        return;
+    }
 
-        // Compute backwards direction so we won't try to go there
-        int backwards = (d.value + 2) % 4;
+    // Entities can expire more than once per frame (bullet hits an enemy at
+    // the end of its lifespan), make sure they only end up in the pool once.
+    if (pool->is_free.insert(e).second) {
+        pool->free.push_back(e);
+        e.disable();
+    }
+}
 
-        // Find a direction that the enemy can move to
-        for (int i = 0; i < 3; i ++) {
-            int n_x = ti_x + dir[d.value].x;
-            int n_y = ti_y + dir[d.value].y;
+// Queue of the stage (thread) a system is running on
+StageQueue& stage_queue(flecs::world& stage) {
+    StageQueues& q = stage.get_mut<StageQueues>();
+    ecs_assert(stage.get_stage_id() < (int32_t)q.stages.size(), 
+        ECS_INTERNAL_ERROR, NULL);
+    return q.stages[stage.get_stage_id()];
+}
 
-            if (n_x >= 0 && n_x <= TileCountX) {
-                if (n_y >= 0 && n_y <= TileCountZ) {
-                    // Next tile is still on the grid, test if it's a path
-                    if (tiles[0](n_x, n_y) == TileKind::Path) {
-                        // Next tile is a path, so continue along current direction
-                        return false;
-                    }
-                }
-            }
+// Return entity to pool after the current system is done. Used by systems that
+// run on worker threads, as the pool is shared by all threads.
+void defer_release(flecs::entity e) {
+    flecs::world stage = e.world();
+    stage_queue(stage).release.push_back(e);
+}
 
-            // Try next direction. Make sure not to move backwards
-            do {
-                d.value = (d.value + 1) % 4;
-            } while (d.value == backwards);
-        }
+// Deal damage to enemy, which is applied by the ApplyDamage system. Systems on
+// any thread can deal damage, as each stage appends to its own queue.
+void defer_damage(flecs::world& stage, flecs::entity_t enemy, float amount) {
+    stage_queue(stage).damage.push_back({enemy, amount});
+}
 
-        // If enemy was not able to find a next direction, it reached the end
-        return true;        
+// Particle buffer and properties of an effect
+struct effect {
+    effect(flecs::entity e)
+        : buffer(*e.try_get_mut<ParticleBuffer>())
+        , props(e.get<ParticleEffect>()) { }
+
+    // Add particle with the defaults of the effect. Returns the index of the
+    // particle, which can be used to change its attributes.
+    int32_t emit(const Position& p, float rotation = 0) {
+        int32_t i = buffer.add();
+        buffer.x[i] = p.x;
+        buffer.y[i] = p.y;
+        buffer.z[i] = p.z;
+        buffer.vx[i] = props.velocity.x;
+        buffer.vy[i] = props.velocity.y;
+        buffer.vz[i] = props.velocity.z;
+        buffer.size[i] = props.size;
+        buffer.rotation[i] = rotation;
+        buffer.r[i] = props.color.r;
+        buffer.g[i] = props.color.g;
+        buffer.b[i] = props.color.b;
+        buffer.age[i] = 0;
+        return i;
     }
 
-    return false;
+    ParticleBuffer& buffer;
+    const ParticleEffect& props;
+};
+
+// Create enemy at a distance along the level path
+void spawn_enemy(flecs::world& ecs, const Level& lvl, float progress) {
+    transform::Position2 p = lvl.path.eval(progress);
+
+    ecs.entity().child_of<enemies>().is_a<prefabs::Enemy>()
+        .add<Targeters>()
+        .set<PathProgress>({progress, lvl.version})
+        .set<Position>({p.x, 1.2, p.y});
 }
 
 void SpawnEnemy(flecs::iter& it, size_t, const Game& g) {
-    const Level& lvl = g.level.get<Level>();
+    flecs::world ecs = it.world();
+    spawn_enemy(ecs, g.level.get<Level>(), 0);
+}
 
-    it.world().entity().child_of<enemies>().is_a<prefabs::Enemy>()
-        .set<Direction>({0})
-        .set<Position>({
-            lvl.spawn_point.x, 1.2, lvl.spawn_point.y
-        });
+void ToggleShortcut(Level& lvl) {
+    int x = lvl.shortcut_x, y = lvl.shortcut_y;
+    if (x != -1) {
+        lvl.set_tile(x, y, lvl.tile(x, y) == TileKind::Path ? 
+            TileKind::Other : TileKind::Path);
+    }
 }
 
 void MoveEnemy(flecs::iter& it, size_t i,
-    Position& p, Direction& d, const Game& g)
+    PathProgress& pp, Position& p, const Level& lvl)
 {
-    const Level& lvl = g.level.get<Level>();
+    // If there is no route to an exit, wait until one opens up
+    if (!lvl.path.complete()) {
+        return;
+    }
 
-    if (find_path(p, d, lvl)) {
-        it.entity(i).destruct(); // Enemy made it to the end
-    } else {
-        p.x += dir[d.value].x * EnemySpeed * it.delta_time();
-        p.z += dir[d.value].y * EnemySpeed * it.delta_time();
+    // Path changed since enemy last moved, continue from the closest point
+    if (pp.version != lvl.version) {
+        pp.value = lvl.path.project(p.x, p.z);
+        pp.version = lvl.version;
+    }
+
+    pp.value += EnemySpeed * it.delta_time();
+    if (pp.value >= lvl.path.length()) {
+        defer_release(it.entity(i)); // Enemy made it to the end
+        return;
     }
+
+    transform::Position2 pos = lvl.path.eval(pp.value);
+    p.x = pos.x;
+    p.z = pos.y;
 }
 
-void ClearTarget(Target& target, Position& p) {
-    flecs::entity t = target.target;
-    if (t) {
-        if (!t.is_alive()) {
-            // Target was destroyed or made it to the end
-            target.target = flecs::entity::null();
-            target.lock = false;
-        } else {
-            Position target_pos = t.get<Position>();
-            float distance = glm_vec3_distance(p, target_pos);
-            if (distance > TurretRange) {
-                // Target is out of range
-                target.target = flecs::entity::null();
-                target.lock = false;
+// Map float to an integer with the same order, so sort keys can be compared as
+// integers.
+uint32_t float_key(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits ^ ((uint32_t)((int32_t)bits >> 31) | 0x80000000u);
+}
+
+// Keys are unique, which keeps the order the same independent of the order in
+// which enemies were collected. The low 32 bits of entity ids are unique for
+// alive entities.
+uint64_t progress_key(const OrderedEnemy& e) {
+    return ((uint64_t)float_key(e.progress) << 32) | (uint32_t)e.id;
+}
+
+bool progress_less(const OrderedEnemy& a, const OrderedEnemy& b) {
+    return progress_key(a) < progress_key(b);
+}
+
+// Progress order is also used to break ties in the health order
+bool health_less(const OrderedEnemy& a, const OrderedEnemy& b) {
+    uint32_t ha = float_key(a.health), hb = float_key(b.health);
+    if (ha != hb) {
+        return ha < hb;
+    }
+    return progress_less(a, b);
+}
+
+// Restore the order of an index that was sorted in the previous frame. Enemies
+// move at the same speed, so they only change places when they are projected
+// on a new path or reused from their pool, and an insertion sort does close to
+// a single pass. Falls back to a full sort when many enemies changed places.
+template <typename Less>
+void repair_order(std::vector<OrderedEnemy>& index, Less less) {
+    size_t shifts = 0, max_shifts = 4 * index.size();
+    for (size_t i = 1; i < index.size(); i ++) {
+        if (!less(index[i], index[i - 1])) {
+            continue;
+        }
+
+        OrderedEnemy e = index[i];
+        size_t j = i;
+        do {
+            index[j] = index[j - 1];
+            j --;
+        } while (j > 0 && less(e, index[j - 1]));
+        index[j] = e;
+
+        shifts += i - j;
+        if (shifts > max_shifts) {
+            std::sort(index.begin(), index.end(), less);
+            return;
+        }
+    }
+}
+
+enum EnemyState : uint8_t {
+    EnemyNew = 0, // Not yet in the index
+    EnemyPlaced,  // Kept at its place in the index
+    EnemyHit      // Health changed, so its place in the index is stale
+};
+
+// Update an index with the enemies collected this frame. Enemies that are
+// still alive keep their place, and the index is repaired after their values
+// are updated. Enemies that are new or that were hit last frame are sorted
+// separately and merged in, so they don't have to be moved one place at a time.
+template <typename Less>
+void update_index(EnemyOrder& order, std::vector<OrderedEnemy>& index, 
+    const std::vector<Damage>& hits, Less less) 
+{
+    std::vector<uint8_t>& state = order.state;
+    state.assign(order.enemies.size(), EnemyNew);
+    for (const Damage& d : hits) {
+        if (const OrderedEnemy *e = order.find(d.enemy)) {
+            state[e - order.enemies.data()] = EnemyHit;
+        }
+    }
+
+    size_t count = 0;
+    for (const OrderedEnemy& prev : index) {
+        const OrderedEnemy *e = order.find(prev.id);
+        if (!e) {
+            continue; // Enemy was destroyed or returned to its pool
+        }
+
+        uint8_t& s = state[e - order.enemies.data()];
+        if (s == EnemyNew) {
+            index[count ++] = *e;
+            s = EnemyPlaced;
+        }
+    }
+    index.resize(count);
+    repair_order(index, less);
+
+    std::vector<OrderedEnemy>& moved = order.moved;
+    moved.clear();
+    for (size_t i = 0; i < order.enemies.size(); i ++) {
+        if (state[i] != EnemyPlaced) {
+            moved.push_back(order.enemies[i]);
+        }
+    }
+
+    if (!moved.empty()) {
+        std::sort(moved.begin(), moved.end(), less);
+        std::vector<OrderedEnemy>& merged = order.merged;
+        merged.resize(index.size() + moved.size());
+        std::merge(index.begin(), index.end(), moved.begin(), moved.end(),
+            merged.begin(), less);
+        index.swap(merged);
+    }
+}
+
+// Update the ordered enemy index after enemies moved
+void UpdateEnemyOrder(flecs::iter& it) {
+    flecs::world ecs = it.world();
+    EnemyOrder& order = ecs.get_mut<EnemyOrder>();
+
+    bool progress = false, health = false;
+    order.policies.each([&](const TargetingPolicy& tp) {
+        progress |= tp.value == TargetPolicy::First || 
+            tp.value == TargetPolicy::Last;
+        health |= tp.value == TargetPolicy::Strongest || 
+            tp.value == TargetPolicy::Weakest;
+    });
+
+    if (!progress) {
+        order.by_progress.clear();
+    }
+    if (!health) {
+        order.by_health.clear();
+    }
+    if (!progress && !health) {
+        it.fini();
+        return;
+    }
+
+    std::vector<OrderedEnemy>& enemies = order.enemies;
+    enemies.clear();
+    order.frame ++;
+    while (it.next()) {
+        auto pp = it.field<const PathProgress>(0);
+        auto p = it.field<const Position>(1);
+        auto h = it.field<const Health>(2);
+        for (auto i : it) {
+            flecs::entity_t id = it.entity(i);
+            uint32_t key = (uint32_t)id;
+            if (key >= order.slots.size()) {
+                order.slots.resize(key + 1, EnemySlot{0, 0});
+            }
+            order.slots[key] = {order.frame, (uint32_t)enemies.size()};
+            enemies.push_back({id, pp[i].value, h[i].value, p[i]});
+        }
+    }
+
+    // Other than for enemies reused from their pool, health only changes when
+    // ApplyDamage applies the damage of a frame. Only enemies that were hit in
+    // the last frame move more than a few places in the health order.
+    if (progress) {
+        update_index(order, order.by_progress, {}, progress_less);
+    }
+    if (health) {
+        update_index(order, order.by_health, 
+            ecs.get<StageQueues>().damage, health_less);
+    }
+}
+
+float distance_sq(const Position& p, const Position& e) {
+    float dx = e.x - p.x, dy = e.y - p.y, dz = e.z - p.z;
+    return dx * dx + dy * dy + dz * dz;
+}
+
+bool in_range(const Position& p, const OrderedEnemy& e) {
+    return distance_sq(p, e.position) < TurretRange * TurretRange;
+}
+
+// Enemy in range that is furthest along the path. Sections of the path within
+// range are visited from the end, and the enemies in each section from the 
+// furthest one, so the first enemy in range is the result.
+const OrderedEnemy* find_first(const std::vector<OrderedEnemy>& enemies,
+    const std::vector<path_range>& ranges, const Position& p)
+{
+    for (auto r = ranges.rbegin(); r != ranges.rend(); r ++) {
+        auto e = std::upper_bound(enemies.begin(), enemies.end(), r->to,
+            [](float v, const OrderedEnemy& oe) { return v < oe.progress; });
+        while (e != enemies.begin()) {
+            -- e;
+            if (e->progress < r->from) {
+                break;
+            }
+            if (in_range(p, *e)) {
+                return &*e;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Enemy in range that is least far along the path
+const OrderedEnemy* find_last(const std::vector<OrderedEnemy>& enemies,
+    const std::vector<path_range>& ranges, const Position& p)
+{
+    for (const path_range& r : ranges) {
+        auto e = std::lower_bound(enemies.begin(), enemies.end(), r.from,
+            [](const OrderedEnemy& oe, float v) { return oe.progress < v; });
+        for (; e != enemies.end() && e->progress <= r.to; e ++) {
+            if (in_range(p, *e)) {
+                return &*e;
             }
         }
     }
+    return nullptr;
+}
+
+// Enemy in range with the most or least health. Health doesn't depend on where
+// an enemy is, so unlike for progress the walk over the index can't be limited
+// to the sections of the path in range. The enemies near the turret are found
+// first. With m nearby enemies out of n, a walk visits about n / m entries
+// before it finds one in range, while selecting the best nearby enemy takes m
+// steps. The index is only walked when that is cheaper, and never for more
+// than m entries.
+const OrderedEnemy* find_by_health(flecs::world& stage, const SpatialQuery& q,
+    const EnemyOrder& order, const Position& p, bool strongest)
+{
+    SearchResult& nearby = stage_queue(stage).nearby;
+    vec3 pos = {p.x, p.y, p.z};
+    q.findn(stage, pos, TurretRange, nearby);
+
+    size_t near_count = ecs_vec_count(&nearby.results);
+    if (!near_count) {
+        return nullptr;
+    }
+
+    const std::vector<OrderedEnemy>& enemies = order.by_health;
+    size_t count = enemies.size();
+    if (near_count * near_count > count) {
+        size_t walk = std::min(count, near_count);
+        for (size_t n = 0; n < walk; n ++) {
+            const OrderedEnemy& e = enemies[strongest ? count - 1 - n : n];
+            if (in_range(p, e)) {
+                return &e;
+            }
+        }
+    }
+
+    const OrderedEnemy *result = nullptr;
+    for (const ecs_oct_entity_t& n : nearby) {
+        const OrderedEnemy *e = order.find(n.id);
+        if (!e || !in_range(p, *e)) {
+            continue;
+        }
+        if (!result || (strongest ? health_less(*result, *e) : 
+            health_less(*e, *result))) 
+        {
+            result = e;
+        }
+    }
+    return result;
 }
 
 void FindTarget(flecs::iter& it, size_t i, Turret& turret, Target& target, 
-    Position& p, const SpatialQuery& q, SpatialQueryResult& qr) 
+    Position& p, TurretCoverage& cov, const TargetingPolicy& policy,
+    const SpatialQuery& q, const EnemyOrder& order, const Level& lvl) 
 {
     if (target.target) {
         // Already has a target
         return;
     }
 
-    flecs::entity enemy;
-    float distance = 0, min_distance = 0;
+    flecs::entity_t found = 0;
+    float dist_sq = 0;
+    if (policy.value == TargetPolicy::Closest) {
+        // Select the closest enemy within TurretRange as target
+        flecs::systems::physics::oct_nearest_t nearest;
+        if (q.find_nearest(it.world(), p, TurretRange, nearest)) {
+            found = nearest.id;
+            dist_sq = nearest.dist_sq;
+        }
+    } else {
+        const OrderedEnemy *e = nullptr;
+        if (policy.value == TargetPolicy::First || 
+            policy.value == TargetPolicy::Last) 
+        {
+            if (cov.version != lvl.version) {
+                lvl.path.ranges(p.x, p.z, TurretRange, cov.ranges);
+                cov.version = lvl.version;
+            }
 
-    // Find all enemies around the turret's position within TurretRange
-    q.findn(p, TurretRange, qr);
-    for (auto e : qr) {
-        distance = glm_vec3_distance(p, e.pos);
-        if (distance > TurretRange) {
-            continue;
+            if (policy.value == TargetPolicy::First) {
+                e = find_first(order.by_progress, cov.ranges, p);
+            } else {
+                e = find_last(order.by_progress, cov.ranges, p);
+            }
+        } else {
+            flecs::world stage = it.world();
+            e = find_by_health(stage, q, order, p, 
+                policy.value == TargetPolicy::Strongest);
         }
 
-        if (!min_distance || distance < min_distance) {
-            min_distance = distance;
-            enemy = it.world().entity(e.id);
+        if (e) {
+            found = e->id;
+            dist_sq = distance_sq(p, e->position);
         }
     }
 
-    if (min_distance) {
-        // Select the closest enemy in range as target
-        target.target = enemy;
-        target.distance = min_distance;
+    // The turret is added to the Targeters of the enemy when the stage queues
+    // are flushed.
+    if (found) {
+        flecs::world stage = it.world();
+        target.target = stage.entity(found);
+        target.distance = sqrtf(dist_sq);
+        stage_queue(stage).targets.push_back({it.entity(i), found});
     }
 }
 
-void AimTarget(flecs::iter& it, size_t i,
-    Turret& turret, Target& target, Position& p) 
-{
-    flecs::entity enemy = target.target;
-    if (enemy && enemy.is_alive()) {
-        flecs::entity e = it.entity(i);
-
-        Position target_p = enemy.get<Position>();
-        vec3 diff;
-        glm_vec3_sub(target_p, target.prev_position, diff);
+// Clear the target of turrets that target an enemy that is deleted
+void ClearTargets(flecs::iter& it, size_t i, Targeters& t) {
+    // Turrets are deleted with the world. Test this before creating a world
+    // object, as releasing the object would try to delete the world again.
+    if (ecs_is_fini(it.c_ptr()->world)) {
+        return;
+    }
 
-        target.prev_position[0] = target_p.x;
-        target.prev_position[1] = target_p.y;
-        target.prev_position[2] = target_p.z;
-        float distance = glm_vec3_distance(p, target_p);
+    flecs::world ecs = it.world();
+    flecs::entity enemy = it.entity(i);
+    for (flecs::entity_t id : t.turrets) {
+        if (!ecs.is_alive(id)) {
+            continue;
+        }
 
-        // Crude correction for enemy movement and bullet travel time
-        flecs::entity beam = e.target<prefabs::Laser::Head::Beam>();
-        if (!beam) {
-            glm_vec3_scale(diff, distance * 1, diff);
-            glm_vec3_add(target_p, diff, target_p);
+        Target *target = ecs.entity(id).try_get_mut<Target>();
+        if (target && target->target == enemy) {
+            target->target = flecs::entity::null();
+            target->lock = false;
         }
+    }
+}
+
+void AimTarget(flecs::iter& it) {
+    while (it.next()) {
+        auto target = it.field<Target>(1);
+        auto p = it.field<Position>(2);
+        auto rig = it.field<TurretRig>(3);
+        const Level& lvl = it.field<const Level>(4)[0];
+        int32_t count = static_cast<int32_t>(it.count());
+        float increment = TurretRotateSpeed * it.delta_time();
+
+        for (int32_t start = 0; start < count; start += AimBatchSize) {
+            int32_t end = start + AimBatchSize;
+            if (end > count) {
+                end = count;
+            }
+
+            int32_t index[AimBatchSize];
+            AimBatch b;
+
+            // Gather the aim positions of turrets with a target in one pass,
+            // so the kernel can run over contiguous arrays. Targets are 
+            // cleared when their enemy is deleted, so they're always alive.
+            int32_t n = 0;
+            for (int32_t i = start; i < end; i ++) {
+                flecs::entity enemy = target[i].target;
+                if (!enemy) {
+                    continue;
+                }
+
+                Position target_p = enemy.get<Position>();
+                float distance = glm_vec3_distance(p[i], target_p);
+                if (distance > TurretRange) {
+                    // Target is out of range, find a new one next frame
+                    target[i].target = flecs::entity::null();
+                    target[i].lock = false;
+                    continue;
+                }
+
+                // Aim at where the enemy is on the path by the time the bullet
+                // gets there. The travel time depends on the aim position, so 
+                // refine once.
+                if (!rig[i].beam) {
+                    const PathProgress& pp = enemy.get<PathProgress>();
+                    float travel = distance;
+                    for (int r = 0; r < 2; r ++) {
+                        transform::Position2 future = lvl.path.eval(
+                            pp.value + EnemySpeed * (travel / BulletSpeed));
+                        target_p.x = future.x;
+                        target_p.z = future.y;
+                        travel = glm_vec3_distance(p[i], target_p);
+                    }
+                }
 
-        target.aim_position[0] = target_p.x;
-        target.aim_position[1] = target_p.y;
-        target.aim_position[2] = target_p.z;            
+                target[i].aim_position[0] = target_p.x;
+                target[i].aim_position[1] = target_p.y;
+                target[i].aim_position[2] = target_p.z;
 
-        float angle = look_at(p, target_p);
+                b.dx[n] = target_p.x - p[i].x;
+                b.dz[n] = target_p.z - p[i].z;
+                b.rotation[n] = rig[i].head_rotation.get()->y;
+                index[n] = i;
+                n ++;
+            }
 
-        flecs::entity head = e.target<prefabs::Turret::Head>();
-        Rotation r = head.get<Rotation>();
-        r.y = rotate_to(r.y, angle, TurretRotateSpeed * it.delta_time());
-        head.set<Rotation>(r);
-        target.angle = angle;
-        target.lock = (r.y == angle) * (distance < TurretRange);
+            aim_batch(b, n, increment);
+
+            // The head is only rotated by its turret, so the rotation is 
+            // written in place instead of with a (deferred) set. Transforms are
+            // computed for all entities each frame, so nothing depends on an 
+            // OnSet event.
+            for (int32_t k = 0; k < n; k ++) {
+                Target& t = target[index[k]];
+                rig[index[k]].head_rotation.get()->y = b.rotation[k];
+                t.angle = b.angle[k];
+                t.lock = b.rotation[k] == b.angle[k];
+            }
+        }
     }
 }
 
@@ -537,11 +1817,11 @@ void FireCountdown(flecs::iter& it, size_t i,
 }
 
 void FireAtTarget(flecs::iter& it, size_t i,
-    Turret& turret, Target& target, Position& p)
+    Turret& turret, Target& target, Position& p, TurretRig& rig,
+    ImpactQueue *impacts)
 {
     auto ecs = it.world();
-    bool is_laser = it.is_set(3);
-    flecs::entity e = it.entity(i);
+    bool is_laser = it.is_set(5);
 
     if (turret.t_since_fire < turret.fire_interval) {
         // Cooldown so we don't shoot too fast
@@ -563,47 +1843,66 @@ void FireAtTarget(flecs::iter& it, size_t i,
             pos.x += 1.7 * TurretCannonLength * -v[0];
             pos.z += 1.7 * TurretCannonLength * -v[2];
             glm_vec3_scale(v, BulletSpeed, v);
-            pos.x += sin(angle) * 0.8 * TurretCannonOffset * turret.lr;
+
+            // Offset perpendicular to the aim direction. The sine and cosine of
+            // the aim angle follow from the horizontal direction, which avoids
+            // calling sin and cos for each shot.
+            float h = sqrtf(v[0] * v[0] + v[2] * v[2]);
+            float sin_angle = h > 0 ? v[2] / h : 0;
+            float cos_angle = h > 0 ? -v[0] / h : 1;
+            pos.x += sin_angle * 0.8 * TurretCannonOffset * turret.lr;
             pos.y = 1.1;
-            pos.z += cos(angle) * 0.8 * TurretCannonOffset * turret.lr;
+            pos.z += cos_angle * 0.8 * TurretCannonOffset * turret.lr;
 
             // Alternate between left and right barrel
             flecs::entity barrel;
             if (turret.lr == -1) {
-                barrel = e.target<prefabs::Cannon::Head::BarrelLeft>();
+                barrel = rig.barrel_left;
             } else {
-                barrel = e.target<prefabs::Cannon::Head::BarrelRight>();
+                barrel = rig.barrel_right;
             }
             turret.lr = -turret.lr;
 
             // Move active barrel backwards to simulate recoil
             barrel.set<Recoil>({ RecoilAmount });
 
-            // Create a bullet and nozzle flash
-            ecs.entity().is_a<prefabs::Bullet>()
-                .child_of<particles>()
-                .set<Position>(pos)
-                .set<Velocity>({-v[0], 0, -v[2]});
-            ecs.entity().is_a<prefabs::NozzleFlash>()
-                .child_of<particles>()
-                .set<Position>(pos)
-                .set<Rotation>({0, angle, 0});
+            if (impacts) {
+                // The aim position is where the target is on its path by the
+                // time the round gets there, so the round hits after the time
+                // it takes to travel to the aim position. The round is drawn
+                // as a tracer particle that expires on impact.
+                float dx = target_p[0] - pos.x, dz = target_p[2] - pos.z;
+                float travel = sqrtf(dx * dx + dz * dz) / BulletSpeed;
+                impacts->push(target.target, travel);
+
+                effect tracer(ecs.get<Effects>().tracer);
+                int32_t e = tracer.emit(pos);
+                tracer.buffer.vx[e] = -v[0];
+                tracer.buffer.vz[e] = -v[2];
+                tracer.buffer.age[e] = glm_max(0, 
+                    tracer.props.properties.lifespan - travel);
+            } else {
+                // Create a bullet that collides with enemies
+                pool_spawn(ecs, ecs.entity<prefabs::Bullet>())
+                    .set<Position>(pos)
+                    .set<Velocity>({-v[0], 0, -v[2]});
+            }
+
+            // Create nozzle flash
+            effect(ecs.get<Effects>().nozzle_flash).emit(pos, angle);
 
             // Create nozzle flash light
-            ecs.entity()
-                .child_of<particles>()
+            pool_spawn(ecs, ecs.entity<prefabs::Light>())
                 .set<Position>({pos.x, pos.y, pos.z})
                 .set<PointLight>({{0.5, 0.4, 0.2}, 0.4})
                 .set<ExplosionLight>({1.0, 7.0}); 
         } else {
             // Enable laser beam
-            e.target<prefabs::Laser::Head::Beam>().enable();
+            rig.beam.enable();
             pos.x += 1.4 * -v[0];
             pos.y = 1.1;
             pos.z += 1.4 * -v[2];
-            ecs.scope<particles>().entity().is_a<prefabs::Bolt>()
-                .set<Position>(pos)
-                .set<Rotation>({0, angle, 0}); 
+            effect(ecs.get<Effects>().bolt).emit(pos, angle);
         }
 
         turret.t_since_fire = 0;
@@ -611,50 +1910,46 @@ void FireAtTarget(flecs::iter& it, size_t i,
 }
 
 void BeamControl(flecs::iter& it, size_t i,
-    Position& p, Turret& turret, Target& target) 
+    Position& p, Turret& turret, Target& target, TurretRig& rig) 
 {
-    flecs::entity beam = it.entity(i).target<prefabs::Laser::Head::Beam>();
+    flecs::entity beam = rig.beam;
     if (beam && (!target.target || !target.lock)) {
         if (beam.enabled()) {
             // Disable beam if laser turret has no target
             beam.disable();
-            beam.set<Box>({0.0, 0.0, 0});
+            *rig.beam_box.get() = {0.0, 0.0, 0};
         }
         return;
     }
 
     if (target.lock && beam && beam.enabled()) {
         flecs::entity enemy = target.target;
-        if (!enemy.is_alive()) {
-            return;
-        }
 
         // Position beam at enemy
         Position target_pos = enemy.get<Position>();
         float distance = glm_vec3_distance(p, target_pos);
-        beam.set<Position>({ (distance / 2), 0.1, 0.0 });
-        beam.set<Box>({BeamSize, BeamSize, distance});
+        *rig.beam_position.get() = { (distance / 2), 0.1, 0.0 };
+        *rig.beam_box.get() = {BeamSize, BeamSize, distance};
 
         // Subtract health from enemy as long as beam is firing
-        enemy.get([&](Health& h, HitCooldown& hc) {
-            h.value -= BeamDamage * it.delta_time();
-            hc.value = HitCooldownInitialValue;
-        });
+        flecs::world stage = it.world();
+        defer_damage(stage, enemy, BeamDamage * it.delta_time());
 
         // Generate spark   
         {     
-            float x_r = randf(ECS_PI_2);
-            float y_r = randf(ECS_PI_2);
-            float z_r = randf(ECS_PI_2);
-            float speed = randf(5) + 2.0;
-            float size = randf(0.15);
-
-            it.world().scope<particles>().entity().is_a<prefabs::Ion>()
-                .child_of<particles>()
-                .set<Position>({target_pos.x, target_pos.y, target_pos.z}) 
-                .set<Box>({size, size, size})
-                .set<Velocity>({
-                    cos(x_r) * speed, fabs(cos(y_r) * speed), cos(z_r) * speed});
+            RandomStream& rng = it.world().get_mut<Random>().sparks;
+            float x_r = rng.randf(ECS_PI_2);
+            float y_r = rng.randf(ECS_PI_2);
+            float z_r = rng.randf(ECS_PI_2);
+            float speed = rng.randf(5) + 2.0;
+            float size = rng.randf(0.15);
+
+            effect ion(it.world().get<Effects>().ion);
+            int32_t e = ion.emit(target_pos);
+            ion.buffer.size[e] = size;
+            ion.buffer.vx[e] = cos(x_r) * speed;
+            ion.buffer.vy[e] = fabs(cos(y_r) * speed);
+            ion.buffer.vz[e] = cos(z_r) * speed;
         }
     }
 }
@@ -677,163 +1972,709 @@ void DecreaseHitCoolDown(flecs::iter& it, size_t, HitCooldown& hc) {
    }
 }
 
-void ProgressParticle(flecs::iter& it, size_t i,
-    ParticleLifespan& pl, const Particle& p, Box *box, Color *color, Velocity *vel)
-{
-    if (box) {
-        box->width *= pow(p.size_decay, it.delta_time());
-        box->height *= pow(p.size_decay, it.delta_time());
-        box->depth *= pow(p.size_decay, it.delta_time());
+// Multiply all members of a column of float vectors with the same factor.
+// The loop has no dependencies between elements, so it is vectorized.
+void scale_column(float *values, int32_t count, float factor) {
+    for (int32_t i = 0; i < count; i ++) {
+        values[i] *= factor;
+    }
+}
+
+void ProgressParticle(flecs::iter& it) {
+    while (it.next()) {
+        auto pl = it.field<ParticleLifespan>(0);
+        const Particle& p = it.field<const Particle>(1)[0];
+        int32_t count = static_cast<int32_t>(it.count());
+        float dt = it.delta_time();
+
+        // Particle properties are shared with the prefab, so the decay factors
+        // are the same for all particles in the table. Components that aren't
+        // owned by the particles are left alone.
+        Box *box = nullptr;
+        if (it.is_set(2) && it.is_self(2)) {
+            box = &it.field<Box>(2)[0];
+            scale_column(&box->width, count * 3, powf(p.size_decay, dt));
+        }
+        if (it.is_set(3) && it.is_self(3)) {
+            Color *color = &it.field<Color>(3)[0];
+            scale_column(&color->r, count * 3, powf(p.color_decay, dt));
+        }
+        if (it.is_set(4) && it.is_self(4)) {
+            Velocity *vel = &it.field<Velocity>(4)[0];
+            scale_column(&vel->x, count * 3, powf(p.velocity_decay, dt));
+        }
+
+        for (int32_t i = 0; i < count; i ++) {
+            pl[i].t += dt;
+        }
+
+        // Delete expired particles after the table is updated. Deletes are
+        // deferred, and are applied together when the frame is merged.
+        for (int32_t i = 0; i < count; i ++) {
+            bool expired = pl[i].t > p.lifespan;
+            if (box) {
+                expired |= (box[i].width + box[i].height + box[i].depth) < 0.1;
+            }
+            if (expired) {
+                defer_release(it.entity(i));
+            }
+        }
     }
-    if (color) {
-        color->r *= pow(p.color_decay, it.delta_time());
-        color->g *= pow(p.color_decay, it.delta_time());
-        color->b *= pow(p.color_decay, it.delta_time()); 
+}
+
+// Add a column multiplied by a factor to another column. Like scale_column the
+// loop is vectorized.
+void add_column(float *values, const float *add, int32_t count, float factor) {
+    for (int32_t i = 0; i < count; i ++) {
+        values[i] += add[i] * factor;
     }
-    if (vel) {
-        vel->x *= pow(p.velocity_decay, it.delta_time());
-        vel->y *= pow(p.velocity_decay, it.delta_time());
-        vel->z *= pow(p.velocity_decay, it.delta_time());
+}
+
+void ProgressParticleBuffer(flecs::iter& it, size_t, 
+    ParticleBuffer& pb, const ParticleEffect& fx)
+{
+    const Particle& p = fx.properties;
+    int32_t count = pb.count;
+    float dt = it.delta_time();
+
+    float size_decay = powf(p.size_decay, dt);
+    float color_decay = powf(p.color_decay, dt);
+    float velocity_decay = powf(p.velocity_decay, dt);
+
+    scale_column(pb.size, count, size_decay);
+    scale_column(pb.r, count, color_decay);
+    scale_column(pb.g, count, color_decay);
+    scale_column(pb.b, count, color_decay);
+    scale_column(pb.vx, count, velocity_decay);
+    scale_column(pb.vy, count, velocity_decay);
+    scale_column(pb.vz, count, velocity_decay);
+    add_column(pb.x, pb.vx, count, dt);
+    add_column(pb.y, pb.vy, count, dt);
+    add_column(pb.z, pb.vz, count, dt);
+
+    for (int32_t i = 0; i < count; i ++) {
+        pb.age[i] += dt;
     }
 
-    pl.t += it.delta_time();
-    if (pl.t > p.lifespan || ((box->width + box->height + box->depth) < 0.1)) {
-        it.entity(i).destruct();
+    // Iterate backwards, as removing moves the last particle into the slot of
+    // the removed particle.
+    for (int32_t i = count - 1; i >= 0; i --) {
+        if (pb.age[i] > p.lifespan || (pb.size[i] * 3) < 0.1) {
+            pb.remove(i);
+        }
     }
 }
 
 void explode(flecs::world& ecs, Position& p, float pC, float rC, Color rgbRnd, Color rgbC) {
+    const Effects& fx = ecs.get<Effects>();
+    RandomStream& rng = ecs.get_mut<Random>().explosions;
+
     // Create explosion particles that fade into smoke
+    effect smoke(fx.smoke);
     for (int s = 0; s < SmokeParticleCount * pC; s ++) {
-        float red = randf(rgbRnd.r) + rgbC.r;
-        float green = randf(rgbRnd.g) + rgbC.g;
-        float blue = randf(rgbRnd.b) + rgbC.b;
-        float size = SmokeSize * randf(1.0) * rC;
+        float red = rng.randf(rgbRnd.r) + rgbC.r;
+        float green = rng.randf(rgbRnd.g) + rgbC.g;
+        float blue = rng.randf(rgbRnd.b) + rgbC.b;
+        float size = SmokeSize * rng.randf(1.0) * rC;
 
         Position pp;
-        pp.x = p.x + randf(ExplodeRadius) - ExplodeRadius / 2; 
-        pp.y = p.y + randf(ExplodeRadius) - ExplodeRadius / 2;
-        pp.z = p.z + randf(ExplodeRadius) - ExplodeRadius / 2;
-
-        ecs.scope<particles>().entity().is_a<prefabs::Smoke>()
-            .set<Position>(pp)
-            .set<Box>({size, size, size})
-            .set<Color>({red, green, blue});
+        pp.x = p.x + rng.randf(ExplodeRadius) - ExplodeRadius / 2; 
+        pp.y = p.y + rng.randf(ExplodeRadius) - ExplodeRadius / 2;
+        pp.z = p.z + rng.randf(ExplodeRadius) - ExplodeRadius / 2;
+
+        int32_t e = smoke.emit(pp);
+        smoke.buffer.size[e] = size;
+        smoke.buffer.r[e] = red;
+        smoke.buffer.g[e] = green;
+        smoke.buffer.b[e] = blue;
     }
 
     // Create sparks
+    effect spark(fx.spark);
     for (int s = 0; s < SparkParticleCount * pC; s ++) {
-        float x_r = randf(ECS_PI_2);
-        float y_r = randf(ECS_PI_2);
-        float z_r = randf(ECS_PI_2);
-        float speed = randf(SparkInitialVelocity) * rC + 2.0;
-        float size = SparkSize + randf(0.2);
-
-        ecs.scope<particles>().entity().is_a<prefabs::Spark>()
-            .set<Position>({p.x, p.y, p.z}) 
-            .set<Box>({size, size, size})
-            .set<Velocity>({
-                cos(x_r) * speed, fabs(cos(y_r) * speed), cos(z_r) * speed});
+        float x_r = rng.randf(ECS_PI_2);
+        float y_r = rng.randf(ECS_PI_2);
+        float z_r = rng.randf(ECS_PI_2);
+        float speed = rng.randf(SparkInitialVelocity) * rC + 2.0;
+        float size = SparkSize + rng.randf(0.2);
+
+        int32_t e = spark.emit(p);
+        spark.buffer.size[e] = size;
+        spark.buffer.vx[e] = cos(x_r) * speed;
+        spark.buffer.vy[e] = fabs(cos(y_r) * speed);
+        spark.buffer.vz[e] = cos(z_r) * speed;
     }
 
     // Create explosion light
-    ecs.entity()
-        .child_of<particles>()
+    pool_spawn(ecs, ecs.entity<prefabs::Light>())
         .set<Position>({p.x, p.y, p.z})
         .set<PointLight>({{rgbC.r, rgbC.g, rgbC.b}, 1.25f + pC / 2.0f})
         .set<ExplosionLight>({0.75f * (0.5f + pC / 2.0f), 1.5f});
 }
 
-void HitTarget(flecs::iter& it, size_t i, Position& p, Health& h, Box& b, 
-    HitCooldown& hit_cooldown, const SpatialQuery& q, SpatialQueryResult& qr)
-{    
+// Create explosion after the current system is done. Used by systems that run
+// on worker threads, as explosions add particles to shared buffers.
+void defer_explode(flecs::world& stage, const Position& p, float pC, float rC, 
+    Color rgbRnd, Color rgbC) 
+{
+    stage_queue(stage).explosions.push_back({p, pC, rC, rgbRnd, rgbC});
+}
+
+void HitTarget(flecs::iter& it) {
     flecs::world ecs = it.world();
-    flecs::entity enemy = it.entity(i);
-    float range = b.width / 2;
-
-    // Test whether bullet hit an enemy
-    q.findn(p, range, qr);
-    for (auto e : qr) {
-        it.world().entity(e.id).destruct();
-        auto prevHealth = h.value;
-        h.value -= BulletDamage;
-        if (prevHealth > 0.9 && h.value < 0.9) {
-            explode(ecs, p, 0.2, 0.3, {0.01, 0.3, 0.3}, {0.05, 0.7, 0.2});
-            enemy.set<Color>({0.05, 0.2, 0.6});
-        } else if (prevHealth > 0.7 && h.value < 0.7) {
-            explode(ecs, p, 0.4, 0.5, {0.01, 0.3, 0.3}, {0.01, 0.2, 0.8});
-            enemy.set<Color>({0.2, 0.05, 0.4});
-        } else if (prevHealth > 0.5 && h.value < 0.5) {
-            explode(ecs, p, 0.5, 0.5, {0.3, 0.01, 0.3}, {0.01, 0.01, 0.7});
-            enemy.set<Color>({0.2, 0.05, 0.2});
-        } else if (prevHealth > 0.3 && h.value < 0.3) {
-            explode(ecs, p, 0.6, 0.7, {0.5, 0.2, 0.5}, {0.8, 0.01, 0.8});
-            enemy.set<Color>({0.1, 0.03, 0.0});
-        }
-        hit_cooldown.value = HitCooldownInitialValue; // For color effect
-    }
-}
-
-void DestroyEnemy(flecs::entity e, Health& h, Position& p) {
-    flecs::world ecs = e.world();
-    if (h.value <= 0) {
-        e.destruct();
-        explode(ecs, p, 1.1, 1.0, {0.5, 0.2, 0.1}, {0.7, 0.1, 0.05});
+    const Broadphase& bp = ecs.get<Broadphase>();
+    int32_t stage_id = ecs.get_stage_id();
+    int32_t stage_count = ecs.get_stage_count();
+
+    // The broadphase is a singleton, so it would only be matched by a single
+    // thread. Instead, collision pairs are divided over the threads by enemy.
+    it.fini();
+
+    // Each bullet is paired with at most one enemy, so a bullet can't hit
+    // multiple enemies before it is deleted
+    for (auto& pair : bp.pairs()) {
+        if ((int32_t)(pair.a % stage_count) != stage_id) {
+            continue;
+        }
+
+        defer_release(ecs.entity(pair.b));
+        defer_damage(ecs, pair.a, BulletDamage);
     }
 }
 
-void init_components(flecs::world& ecs) {
-    ecs.component<Game>()
-        .member("window", &Game::window)
-        .member("level", &Game::window)
-        .member("center", &Game::center)
-        .member("size", &Game::size);
+// Apply impacts of analytic cannon rounds that are due
+void ApplyImpacts(flecs::iter& it, size_t, ImpactQueue& q) {
+    flecs::world ecs = it.world();
+    q.time += it.delta_time();
 
-    ecs.component<Enemy>();
-    ecs.component<Laser>();
-    ecs.component<Bullet>();
+    while (!q.impacts.empty() && q.impacts.front().time <= q.time) {
+        flecs::entity_t enemy = q.impacts.front().target;
+        std::pop_heap(q.impacts.begin(), q.impacts.end(), 
+            std::greater<Impact>());
+        q.impacts.pop_back();
 
-    ecs.component<Particle>()
-        .member("size_decay", &Particle::size_decay)
-        .member("color_decay", &Particle::color_decay)
-        .member("velocity_decay", &Particle::velocity_decay)
-        .member("lifespan", &Particle::lifespan)
-        .add(flecs::OnInstantiate, flecs::Inherit);
+        // Target was destroyed or made it to the end while round was in flight
+        if (ecs.is_alive(enemy)) {
+            defer_damage(ecs, enemy, BulletDamage);
+        }
+    }
+}
 
-    ecs.component<ParticleLifespan>();
+// Apply the damage dealt this frame. Damage is sorted by enemy and amount, so
+// the damage of an enemy is added up in the same order for any number of
+// threads, and its health is only modified once. Enemies emit an event when
+// they drop below a health tier or die, so no system has to test the health of
+// all enemies each frame. The damage is kept until the next frame, so the
+// enemy order can tell which enemies were hit.
+void ApplyDamage(flecs::iter& it, size_t, StageQueues& queues) {
+    flecs::world ecs = it.world();
+    std::vector<Damage>& damage = queues.damage;
+    damage.clear();
+    for (StageQueue& q : queues.stages) {
+        damage.insert(damage.end(), q.damage.begin(), q.damage.end());
+        q.damage.clear();
+    }
 
-    ecs.component<Health>()
-        .member("value", &Health::value);
-    
-    ecs.component<HitCooldown>()
-        .member("value", &HitCooldown::value);
+    std::sort(damage.begin(), damage.end(), 
+        [](const Damage& a, const Damage& b) {
+            if (a.enemy != b.enemy) return a.enemy < b.enemy;
+            return a.amount < b.amount;
+        });
 
-    ecs.component<Turret>()
-        .member("fire_interval", &Turret::fire_interval);
+    size_t i = 0, count = damage.size();
+    while (i < count) {
+        flecs::entity_t id = damage[i].enemy;
+        float amount = 0;
+        for (; i < count && damage[i].enemy == id; i ++) {
+            amount += damage[i].amount;
+        }
 
-    ecs.component<Target>()
-        .member("target", &Target::target)
-        .member("prev_position", &Target::prev_position)
-        .member("aim_position", &Target::aim_position)
-        .member("angle", &Target::angle)
-        .member("distance", &Target::distance)
-        .member("lock", &Target::lock);
+        flecs::entity enemy = ecs.entity(id);
+        if (!enemy.is_alive()) {
+            continue;
+        }
+
+        float prev = 0, cur = 0;
+        enemy.get([&](Health& h, HitCooldown& hc) {
+            prev = h.value;
+            h.value -= amount;
+            cur = h.value;
+            hc.value = HitCooldownInitialValue; // For color effect
+        });
+
+        for (int t = health_tier(prev); t < health_tier(cur); t ++) {
+            ecs.event<HealthTierCrossed>()
+                .id<Enemy>()
+                .entity(enemy)
+                .ctx(HealthTierCrossed{t})
+                .emit();
+        }
+
+        if (prev > 0 && cur <= 0) {
+            ecs.event<EnemyDied>()
+                .id<Enemy>()
+                .entity(enemy)
+                .emit();
+        }
+    }
 }
 
-void init_game(flecs::world& ecs) {
-    // Singleton with global game data
-    Game& g = ecs.ensure<Game>();
-    g.center = { toX(TileCountX / 2), 0, toZ(TileCountZ / 2) };
-    g.size = TileCountX * (TileSize + TileSpacing) + 2;
+void EnemyHealthTier(flecs::iter& it, size_t i, Position& p) {
+    flecs::world ecs = it.world();
+    const HealthTier& t = HealthTiers[it.param<HealthTierCrossed>()->tier];
+    defer_explode(ecs, p, t.pC, t.rC, t.rgb_rnd, t.rgb_c);
+    it.entity(i).set<Color>(t.color);
+}
 
-    // Camera, lighting & canvas configuration
-    ecs.script().filename("etc/assets/app.flecs").run();
+void DestroyEnemy(flecs::iter& it, size_t i, Position& p) {
+    flecs::world ecs = it.world();
+    defer_release(it.entity(i));
+    defer_explode(ecs, p, 1.1, 1.0, {0.5, 0.2, 0.1}, {0.7, 0.1, 0.05});
+}
 
-    // Prefab assets
-    ecs.script().filename("etc/assets/materials.flecs").run();
-    ecs.script().filename("etc/assets/tree.flecs").run();
-    ecs.script().filename("etc/assets/tile.flecs").run();
-    ecs.script().filename("etc/assets/particle.flecs").run();
+// Apply work queued by systems that ran on worker threads. Which thread queued
+// the work depends on the number of threads, so work is sorted before it is
+// applied. This keeps entity ids and random numbers the same for any number of
+// threads.
+void FlushStageQueues(flecs::iter& it, size_t, StageQueues& queues) {
+    flecs::world ecs = it.world();
+    std::vector<flecs::entity_t>& release = queues.release;
+    std::vector<Explosion>& explosions = queues.explosions;
+    for (StageQueue& q : queues.stages) {
+        // Add turrets to the enemies they target before enemies are released,
+        // so that their target is cleared when the enemy is deleted.
+        for (TargetLink& l : q.targets) {
+            std::vector<flecs::entity_t>& turrets = 
+                ecs.entity(l.enemy).get_mut<Targeters>().turrets;
+            if (std::find(turrets.begin(), turrets.end(), l.turret) == 
+                turrets.end()) 
+            {
+                turrets.push_back(l.turret);
+            }
+        }
+        q.targets.clear();
+
+        release.insert(release.end(), q.release.begin(), q.release.end());
+        explosions.insert(explosions.end(), 
+            q.explosions.begin(), q.explosions.end());
+        q.release.clear();
+        q.explosions.clear();
+    }
+
+    std::sort(release.begin(), release.end());
+    release.erase(std::unique(release.begin(), release.end()), release.end());
+    for (flecs::entity_t e : release) {
+        pool_release(ecs.entity(e));
+    }
+
+    std::stable_sort(explosions.begin(), explosions.end(), 
+        [](const Explosion& a, const Explosion& b) {
+            if (a.p.x != b.p.x) return a.p.x < b.p.x;
+            if (a.p.y != b.p.y) return a.p.y < b.p.y;
+            if (a.p.z != b.p.z) return a.p.z < b.p.z;
+            return a.pC < b.pC;
+        });
+    for (Explosion& e : explosions) {
+        explode(ecs, e.p, e.pC, e.rC, e.rgb_rnd, e.rgb_c);
+    }
+
+    release.clear();
+    explosions.clear();
+}
+
+// Recording and replay
+
+// Records of a recording. Values are stored in native byte order.
+enum class RecordKind : uint8_t {
+    Camera = 1, // Camera moved, followed by its Position and Rotation
+    Frame = 2   // End of frame, followed by checksum of the simulation state
+};
+
+static const char RecordingMagic[4] = {'T', 'D', 'R', 'C'};
+static const uint32_t RecordingVersion = 4;
+static const long RecordingFramesOffset = 8; // Patched when recording closes
+
+template <typename T>
+void record_write(FILE *f, const T& value) {
+    fwrite(&value, sizeof(T), 1, f);
+}
+
+template <typename T>
+bool record_read(FILE *f, T& value) {
+    return fread(&value, sizeof(T), 1, f) == 1;
+}
+
+// Create recording and write the scenario to its header
+bool recording_create(Recording& r, const char *filename, const Scenario& s) {
+    r = Recording();
+    r.file = fopen(filename, "wb");
+    if (!r.file) {
+        return false;
+    }
+
+    fwrite(RecordingMagic, sizeof(RecordingMagic), 1, r.file);
+    record_write(r.file, RecordingVersion);
+    record_write(r.file, r.frames);
+    record_write(r.file, s.seed);
+    record_write(r.file, s.fps);
+    record_write(r.file, s.cannons);
+    record_write(r.file, s.lasers);
+    record_write(r.file, s.enemies);
+    record_write(r.file, s.spawn_interval);
+    record_write(r.file, s.map_width);
+    record_write(r.file, s.map_height);
+    record_write(r.file, s.chunk_radius);
+    record_write(r.file, s.analytic_projectiles);
+    record_write(r.file, s.targeting);
+    record_write(r.file, s.reroute_interval);
+    return true;
+}
+
+// Open recording for replay, and read the scenario from its header
+bool recording_open(Recording& r, const char *filename, Scenario& s) {
+    r = Recording();
+    r.file = fopen(filename, "rb");
+    if (!r.file) {
+        return false;
+    }
+
+    r.replay = true;
+
+    char magic[4];
+    uint32_t version = 0;
+    bool ok = fread(magic, sizeof(magic), 1, r.file) == 1;
+    ok = ok && !memcmp(magic, RecordingMagic, sizeof(magic));
+    ok = ok && record_read(r.file, version) && version == RecordingVersion;
+    ok = ok && record_read(r.file, r.frames);
+    ok = ok && record_read(r.file, s.seed);
+    ok = ok && record_read(r.file, s.fps);
+    ok = ok && record_read(r.file, s.cannons);
+    ok = ok && record_read(r.file, s.lasers);
+    ok = ok && record_read(r.file, s.enemies);
+    ok = ok && record_read(r.file, s.spawn_interval);
+    ok = ok && record_read(r.file, s.map_width);
+    ok = ok && record_read(r.file, s.map_height);
+    ok = ok && record_read(r.file, s.chunk_radius);
+    ok = ok && record_read(r.file, s.analytic_projectiles);
+    ok = ok && record_read(r.file, s.targeting);
+    ok = ok && record_read(r.file, s.reroute_interval);
+    if (!ok) {
+        fclose(r.file);
+        r.file = nullptr;
+        return false;
+    }
+
+    s.frames = r.frames;
+    return true;
+}
+
+// Close recording. When recording, the number of frames is written to the
+// header, as it isn't known until the session ends.
+void recording_close(Recording& r) {
+    if (!r.file) {
+        return;
+    }
+
+    if (!r.replay) {
+        fseek(r.file, RecordingFramesOffset, SEEK_SET);
+        record_write(r.file, r.frame);
+    }
+
+    fclose(r.file);
+    r.file = nullptr;
+}
+
+// FNV-1a hash
+uint32_t hash_bytes(const void *ptr, size_t size, uint32_t h = 2166136261u) {
+    const uint8_t *bytes = static_cast<const uint8_t*>(ptr);
+    for (size_t i = 0; i < size; i ++) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Checksum of the simulation state. The hashes of entities are added up, so
+// the checksum doesn't depend on the order in which entities are stored.
+uint32_t state_checksum(flecs::world& ecs) {
+    uint32_t result = 0;
+
+    ecs.each([&](const PathProgress& pp, const Position& p, const Health& h) {
+        uint32_t e = hash_bytes(&pp, sizeof(pp));
+        e = hash_bytes(&p, sizeof(p), e);
+        result += hash_bytes(&h, sizeof(h), e);
+    });
+
+    ecs.query_builder<const Position, const Velocity>()
+        .with<Bullet>()
+        .build()
+        .each([&](const Position& p, const Velocity& v) {
+            result += hash_bytes(&v, sizeof(v), hash_bytes(&p, sizeof(p)));
+        });
+
+    ecs.each([&](const Turret& t, const Target& target) {
+        uint32_t e = hash_bytes(&t, sizeof(t));
+        result += hash_bytes(&target.lock, sizeof(target.lock), e);
+    });
+
+    if (const ImpactQueue *q = ecs.try_get<ImpactQueue>()) {
+        for (const Impact& i : q->impacts) {
+            uint32_t e = hash_bytes(&i.time, sizeof(i.time));
+            result += hash_bytes(&i.target, sizeof(i.target), e);
+        }
+    }
+
+    ecs.each([&](const ParticleBuffer& pb) {
+        uint32_t e = hash_bytes(&pb.count, sizeof(pb.count));
+        e = hash_bytes(pb.x, pb.count * sizeof(float), e);
+        e = hash_bytes(pb.y, pb.count * sizeof(float), e);
+        e = hash_bytes(pb.z, pb.count * sizeof(float), e);
+        result += hash_bytes(pb.size, pb.count * sizeof(float), e);
+    });
+
+    return result;
+}
+
+// Write the camera transform when it changed, or apply the transform of the
+// recording when replaying.
+void RecordCamera(Recording& r, Position& p, Rotation& rot) {
+    if (!r.file) {
+        return;
+    }
+
+    if (r.replay) {
+        int c = fgetc(r.file);
+        if (c == static_cast<uint8_t>(RecordKind::Camera)) {
+            record_read(r.file, r.camera);
+            record_read(r.file, r.camera_rotation);
+        } else if (c != EOF) {
+            ungetc(c, r.file);
+        }
+        p = r.camera;
+        rot = r.camera_rotation;
+    } else if (memcmp(&p, &r.camera, sizeof(p)) || 
+        memcmp(&rot, &r.camera_rotation, sizeof(rot))) 
+    {
+        record_write(r.file, RecordKind::Camera);
+        record_write(r.file, p);
+        record_write(r.file, rot);
+        r.camera = p;
+        r.camera_rotation = rot;
+    }
+}
+
+// Write the checksum of the frame, or compare it with the recording
+void RecordFrame(flecs::iter& it, size_t, Recording& r) {
+    if (!r.file) {
+        return;
+    }
+
+    flecs::world ecs = it.world();
+    uint32_t checksum = state_checksum(ecs);
+    if (r.replay) {
+        RecordKind kind;
+        uint32_t expected = 0;
+        bool ok = record_read(r.file, kind) && kind == RecordKind::Frame;
+        ok = ok && record_read(r.file, expected);
+        if ((!ok || checksum != expected) && r.diverged == -1) {
+            r.diverged = r.frame;
+        }
+    } else {
+        record_write(r.file, RecordKind::Frame);
+        record_write(r.file, checksum);
+    }
+
+    r.frame ++;
+}
+
+void init_components(flecs::world& ecs) {
+    ecs.component<Game>()
+        .member("window", &Game::window)
+        .member("level", &Game::window)
+        .member("center", &Game::center)
+        .member("size", &Game::size)
+        .member("tile_size", &Game::tile_size);
+
+    ecs.component<Enemy>();
+    ecs.component<Laser>();
+    ecs.component<Bullet>();
+
+    ecs.component<Particle>()
+        .member("size_decay", &Particle::size_decay)
+        .member("color_decay", &Particle::color_decay)
+        .member("velocity_decay", &Particle::velocity_decay)
+        .member("lifespan", &Particle::lifespan)
+        .add(flecs::OnInstantiate, flecs::Inherit);
+
+    ecs.component<ParticleLifespan>();
+
+    ecs.component<ParticleEffect>()
+        .member("properties", &ParticleEffect::properties)
+        .member("size", &ParticleEffect::size)
+        .member("color", &ParticleEffect::color)
+        .member("velocity", &ParticleEffect::velocity);
+
+    ecs.component<Scenario>()
+        .member("cannons", &Scenario::cannons)
+        .member("lasers", &Scenario::lasers)
+        .member("enemies", &Scenario::enemies)
+        .member("spawn_interval", &Scenario::spawn_interval)
+        .member("map_width", &Scenario::map_width)
+        .member("map_height", &Scenario::map_height)
+        .member("chunk_radius", &Scenario::chunk_radius)
+        .member("frames", &Scenario::frames)
+        .member("fps", &Scenario::fps)
+        .member("threads", &Scenario::threads)
+        .member("seed", &Scenario::seed)
+        .member("analytic_projectiles", &Scenario::analytic_projectiles)
+        .member("targeting", &Scenario::targeting)
+        .member("reroute_interval", &Scenario::reroute_interval);
+
+    ecs.component<Random>();
+
+    ecs.component<Recording>()
+        .on_remove([](Recording& r) {
+            recording_close(r);
+        })
+        .member("frames", &Recording::frames)
+        .member("frame", &Recording::frame)
+        .member("diverged", &Recording::diverged);
+
+    ecs.component<TileChunk>()
+        .member("x", &TileChunk::x)
+        .member("y", &TileChunk::y)
+        .member("materialized", &TileChunk::materialized)
+        .member("dirty", &TileChunk::dirty);
+
+    ecs.component<Effects>()
+        .member("smoke", &Effects::smoke)
+        .member("spark", &Effects::spark)
+        .member("ion", &Effects::ion)
+        .member("bolt", &Effects::bolt)
+        .member("nozzle_flash", &Effects::nozzle_flash)
+        .member("tracer", &Effects::tracer);
+
+    ecs.component<ImpactQueue>()
+        .member("time", &ImpactQueue::time);
+
+    ecs.component<ExplosionLight>()
+        .member("intensity", &ExplosionLight::intensity)
+        .member("decay", &ExplosionLight::decay);
+
+    ecs.component<EntityPool>()
+        .member("capacity", &EntityPool::capacity)
+        .member("hits", &EntityPool::hits)
+        .member("misses", &EntityPool::misses)
+        .add(flecs::OnInstantiate, flecs::DontInherit);
+
+    ecs.component<PathProgress>()
+        .member("value", &PathProgress::value)
+        .member("version", &PathProgress::version);
+
+    ecs.component<Health>()
+        .member("value", &Health::value);
+    
+    ecs.component<HitCooldown>()
+        .member("value", &HitCooldown::value);
+
+    ecs.component<Turret>()
+        .member("fire_interval", &Turret::fire_interval);
+
+    ecs.component<TurretRig>()
+        .member("head", &TurretRig::head)
+        .member("barrel_left", &TurretRig::barrel_left)
+        .member("barrel_right", &TurretRig::barrel_right)
+        .member("beam", &TurretRig::beam);
+
+    ecs.component<Targeters>();
+
+    ecs.component<TargetPolicy>();
+
+    ecs.component<TargetingPolicy>()
+        .member("value", &TargetingPolicy::value)
+        .add(flecs::OnInstantiate, flecs::Inherit);
+
+    ecs.component<TurretCoverage>()
+        .member("version", &TurretCoverage::version);
+
+    ecs.component<EnemyOrder>();
+
+    ecs.component<Target>()
+        .member("target", &Target::target)
+        .member("aim_position", &Target::aim_position)
+        .member("angle", &Target::angle)
+        .member("distance", &Target::distance)
+        .member("lock", &Target::lock);
+}
+
+// Create entity that stores the particles of an effect prefab
+flecs::entity init_effect(flecs::world& ecs, flecs::entity prefab) {
+    ParticleEffect fx;
+    fx.properties = prefab.get<Particle>();
+    fx.size = prefab.get<Box>().width;
+    fx.color = prefab.get<Color>();
+    fx.velocity = {0, 0, 0};
+    if (const Velocity *v = prefab.try_get<Velocity>()) {
+        fx.velocity = *v;
+    }
+
+    flecs::entity e = ecs.scope<particles>().entity(prefab.name())
+        .add<ParticleBuffer>()
+        .set<ParticleEffect>(fx);
+
+    // Material is used when rendering the particles
+    if (const Emissive *em = prefab.try_get<Emissive>()) {
+        e.set<Emissive>(*em);
+    }
+    if (const Specular *sp = prefab.try_get<Specular>()) {
+        e.set<Specular>(*sp);
+    }
+
+    return e;
+}
+
+void init_game(flecs::world& ecs) {
+    // Singleton with global game data
+    Game& g = ecs.ensure<Game>();
+    const Scenario& s = ecs.ensure<Scenario>();
+    g.center = { toX(s.map_width / 2, s.map_width), 0, toZ(s.map_height / 2) };
+    g.size = std::max(s.map_width, s.map_height) * (TileSize + TileSpacing) + 2;
+    g.tile_size = TileSize + TileSpacing;
+
+    // Find bullets that hit enemies. Analytic cannon rounds don't create 
+    // bullets, so they don't need a broadphase.
+    if (s.analytic_projectiles) {
+        ecs.set<ImpactQueue>({});
+    } else {
+        ecs.set<Broadphase>({ecs.id<Enemy>(), ecs.id<Bullet>(), true});
+    }
+
+    // Run per entity systems on worker threads
+    if (s.threads > 1) {
+        ecs.set_threads(s.threads);
+    }
+
+    StageQueues queues;
+    queues.stages.resize(ecs.get_stage_count());
+    ecs.set<StageQueues>(queues);
+
+    EnemyOrder order;
+    order.policies = ecs.query_builder<const TargetingPolicy>()
+        .with<Turret>()
+        .cached()
+        .build();
+    ecs.set<EnemyOrder>(order);
+
+    // Random numbers only depend on the seed of the scenario
+    ecs.set<Random>(Random(s.seed));
+
+    // Camera, lighting & canvas configuration
+    ecs.script().filename("etc/assets/app.flecs").run();
+
+    // Prefab assets
+    ecs.script().filename("etc/assets/materials.flecs").run();
+    ecs.script().filename("etc/assets/tree.flecs").run();
+    ecs.script().filename("etc/assets/tile.flecs").run();
+    ecs.script().filename("etc/assets/particle.flecs").run();
     ecs.script().filename("etc/assets/bullet.flecs").run();
     ecs.script().filename("etc/assets/nozzle_flash.flecs").run();
     ecs.script().filename("etc/assets/smoke.flecs").run();
@@ -844,127 +2685,497 @@ void init_game(flecs::world& ecs) {
     ecs.script().filename("etc/assets/turret.flecs").run();
     ecs.script().filename("etc/assets/cannon.flecs").run();
     ecs.script().filename("etc/assets/laser.flecs").run();
+
+    // Types can't be registered while systems run on multiple threads, so 
+    // register the types that are first used by systems up front
+    ecs.component<enemies>();
+    ecs.component<particles>();
+    ecs.entity<prefabs::Enemy>();
+    ecs.entity<prefabs::Bullet>();
+    ecs.entity<prefabs::Light>();
+    ecs.entity<prefabs::Turret::Head>();
+    ecs.entity<prefabs::Cannon::Head::BarrelLeft>();
+    ecs.entity<prefabs::Cannon::Head::BarrelRight>();
+    ecs.entity<prefabs::Laser::Head::Beam>();
+
+    // Targeting policy of the scenario overrides the policy of the prefabs
+    if (s.targeting >= 0) {
+        ecs.entity<prefabs::Turret>().set<TargetingPolicy>(
+            {static_cast<TargetPolicy>(s.targeting)});
+    }
+
+    // Effects that store particles in a buffer instead of as entities
+    ecs.set<Effects>({
+        init_effect(ecs, ecs.entity<prefabs::Smoke>()),
+        init_effect(ecs, ecs.entity<prefabs::Spark>()),
+        init_effect(ecs, ecs.entity<prefabs::Ion>()),
+        init_effect(ecs, ecs.entity<prefabs::Bolt>()),
+        init_effect(ecs, ecs.entity<prefabs::NozzleFlash>()),
+        init_effect(ecs, ecs.entity<prefabs::Tracer>())
+    });
+}
+
+// Cache the slots of a turret after its prefab is instantiated
+void init_turret_rig(flecs::entity e) {
+    TurretRig rig;
+    rig.head = e.target<prefabs::Turret::Head>();
+    rig.barrel_left = e.target<prefabs::Cannon::Head::BarrelLeft>();
+    rig.barrel_right = e.target<prefabs::Cannon::Head::BarrelRight>();
+    rig.beam = e.target<prefabs::Laser::Head::Beam>();
+    rig.head_rotation = rig.head.get_ref<Rotation>();
+    if (rig.beam) {
+        rig.beam_position = rig.beam.get_ref<Position>();
+        rig.beam_box = rig.beam.get_ref<Box>();
+    }
+    e.set<TurretRig>(rig);
+}
+
+// Turret on tile
+void add_turret(flecs::world& ecs, const Level& lvl, int x, int z, 
+    bool laser) 
+{
+    auto e = ecs.entity().set<Position>({
+        toX(x, lvl.width), TileHeight / 2, toZ(z)});
+    e.child_of<turrets>();
+    if (laser) {
+        e.is_a<prefabs::Laser>();
+        e.target<prefabs::Laser::Head::Beam>().disable();
+    } else {
+        e.is_a<prefabs::Cannon>();
+    }
+    init_turret_rig(e);
+}
+
+// Value between 0 and 1 derived from tile coordinates, so that the trees of a
+// chunk look the same each time the chunk is materialized.
+float tile_noise(int x, int z, uint32_t seed) {
+    uint32_t h = (uint32_t)x * 73856093u ^ (uint32_t)z * 19349663u ^ 
+        seed * 83492791u;
+    h ^= h >> 13;
+    h *= 0x5bd1e995u;
+    h ^= h >> 15;
+    return (float)(h & 0xFFFF) / 65535.0f;
+}
+
+// Tilemap kinds are indexed by TileKind. Their appearance is copied from the
+// tile prefabs.
+void tile_kinds(flecs::world& ecs, Tilemap& tm) {
+    flecs::entity tile = ecs.entity<prefabs::Tile>();
+    flecs::entity path = ecs.entity<prefabs::Path>();
+
+    tm.tile_size = TileSize + TileSpacing;
+    tm.kinds[(int)TileKind::Turret] = {tile.get<Color>(), tile.get<Box>().height};
+    tm.kinds[(int)TileKind::Path] = {path.get<Color>(), path.get<Box>().height};
+    tm.kinds[(int)TileKind::Other] = tm.kinds[(int)TileKind::Turret];
+}
+
+// Create the tilemap and the tree entities of a chunk
+void materialize_chunk(flecs::world& ecs, const Level& lvl, 
+    flecs::entity chunk, const TileChunk& tc) 
+{
+    int x_start = tc.x * ChunkSize, z_start = tc.y * ChunkSize;
+    int x_end = std::min(x_start + ChunkSize, lvl.width);
+    int z_end = std::min(z_start + ChunkSize, lvl.height);
+
+    // Ground tiles aren't entities, but are rendered from the chunk tilemap
+    chunk.insert([&](Tilemap& tm) {
+        tile_kinds(ecs, tm);
+        tm.resize(x_end - x_start, z_end - z_start);
+        for (int x = x_start; x < x_end; x ++) {
+            for (int z = z_start; z < z_end; z ++) {
+                tm.set(x - x_start, z - z_start, 
+                    (uint8_t)tc.kinds[TileChunk::index(x, z)]);
+            }
+        }
+    });
+
+    for (int x = x_start; x < x_end; x ++) {
+        for (int z = z_start; z < z_end; z ++) {
+            float xc = toX(x, lvl.width);
+            float zc = toZ(z);
+
+            if (tc.trees[TileChunk::index(x, z)]) {
+                ecs.entity().child_of(chunk)
+                    .set<Position>({xc, TileHeight / 2, zc})
+                    .set<prefabs::Tree>({
+                        1.5f + tile_noise(x, z, 0) * 2.5f,
+                        tile_noise(x, z, 1) * 0.1f
+                    })
+                    .set<Rotation>({0, tile_noise(x, z, 2) * ECS_PI_2});
+            }
+        }
+    }
+}
+
+// Mark chunks within the chunk radius of a position
+void mark_chunks(const Level& lvl, std::vector<bool>& marked, const Position& p) {
+    float r = lvl.chunk_radius / (TileSize + TileSpacing);
+    float x = from_x(p.x, lvl.width), z = from_z(p.z);
+    int width = lvl.width, height = lvl.height;
+    if (x + r < 0 || z + r < 0 || x - r >= width || z - r >= height) {
+        return;
+    }
+
+    int x_min = glm_clamp(x - r, 0, width - 1) / ChunkSize;
+    int x_max = glm_clamp(x + r, 0, width - 1) / ChunkSize;
+    int z_min = glm_clamp(z - r, 0, height - 1) / ChunkSize;
+    int z_max = glm_clamp(z + r, 0, height - 1) / ChunkSize;
+    for (int cz = z_min; cz <= z_max; cz ++) {
+        for (int cx = x_min; cx <= x_max; cx ++) {
+            marked[cz * lvl.chunks_x + cx] = true;
+        }
+    }
+}
+
+// Materialize chunks that are close to the camera or an enemy, and release the
+// entities of chunks that aren't. At most budget chunks are materialized per
+// update to prevent frame spikes, or all chunks if budget is -1.
+void update_chunks(flecs::world& ecs, const Level& lvl, int budget) {
+    std::vector<bool> marked(lvl.chunks.size());
+
+    ecs.query_builder<const Position>()
+        .with<graphics::Camera>()
+        .build()
+        .each([&](const Position& p) {
+            mark_chunks(lvl, marked, p);
+        });
+
+    ecs.query_builder<const Position>()
+        .with<Enemy>()
+        .build()
+        .each([&](const Position& p) {
+            mark_chunks(lvl, marked, p);
+        });
+
+    for (size_t i = 0; i < lvl.chunks.size(); i ++) {
+        flecs::entity chunk = lvl.chunks[i];
+        const TileChunk& cur = chunk.get<TileChunk>();
+        bool release = cur.materialized && (!marked[i] || cur.dirty);
+        if (!release && (!marked[i] || cur.materialized || !budget)) {
+            continue;
+        }
+
+        // Adding or removing the tilemap moves the chunk to another table, so
+        // work on a copy of the chunk data.
+        TileChunk tc = cur;
+        bool changed = false;
+        if (tc.materialized && (!marked[i] || tc.dirty)) {
+            ecs.delete_with(flecs::ChildOf, chunk);
+            chunk.remove<Tilemap>();
+            tc.materialized = false;
+            changed = true;
+        }
+
+        if (marked[i] && !tc.materialized && budget) {
+            materialize_chunk(ecs, lvl, chunk, tc);
+            tc.materialized = true;
+            tc.dirty = false;
+            changed = true;
+            budget --;
+        }
+
+        if (changed) {
+            chunk.set<TileChunk>(tc);
+        }
+    }
+}
+
+// Path that winds back and forth over the map, for maps that don't have the
+// size of the default map.
+std::vector<Waypoint> winding_path(int width, int height) {
+    std::vector<Waypoint> result;
+    result.push_back({0, 1});
+
+    bool right = true;
+    for (int z = 1; z < height - 1; z += 2) {
+        float x = right ? width - 2 : 1;
+        result.push_back({x, (float)z});
+        if (z + 2 < height - 1) {
+            result.push_back({x, (float)(z + 2)});
+        }
+        right = !right;
+    }
+
+    return result;
+}
+
+// Find tile that connects two parts of the path that are far apart, so that
+// opening it shortens the route to the exit. Returns false if there is none.
+bool find_shortcut(const flow_field& flow, const grid<TileKind>& tiles, 
+    int& x_out, int& y_out) 
+{
+    int best = 0;
+    for (int x = 1; x < tiles.width() - 1; x ++) {
+        for (int y = 1; y < tiles.height() - 1; y ++) {
+            if (tiles(x, y) != TileKind::Turret) {
+                continue;
+            }
+
+            // Tiles on opposite sides of the shortcut
+            for (int d = 0; d < 2; d ++) {
+                int a = flow.distance(x + dir[d].x, y + dir[d].y);
+                int b = flow.distance(x - dir[d].x, y - dir[d].y);
+                if (a == flow_field::None || b == flow_field::None) {
+                    continue;
+                }
+
+                int saved = abs(a - b) - 2;
+                if (saved > best) {
+                    best = saved;
+                    x_out = x;
+                    y_out = y;
+                }
+            }
+        }
+    }
+    return best > 0;
 }
 
 // Build level
 void init_level(flecs::world& ecs) {
     Game& g = ecs.ensure<Game>();
+    Scenario s = ecs.ensure<Scenario>();
+    Random& rnd = ecs.ensure<Random>();
+    bool random_turrets = s.cannons < 0 && s.lasers < 0;
+    int width = s.map_width, height = s.map_height;
+
+    // Tile kinds of the whole map, which are copied to the chunks and the flow
+    // field once the level is built
+    grid<TileKind> tiles(width, height);
+
+    std::vector<Waypoint> points;
+    if (width == TileCountX && height == TileCountZ) {
+        points = {
+            {0, 1}, {8, 1}, {8, 3}, {1, 3}, {1, 8}, {4, 8}, {4, 5}, {8, 5}, 
+            {8, 7}, {6, 7}, {6, 9}, {11, 9}, {11, 1}, {18, 1}, {18, 3}, {16, 3}, 
+            {16, 5}, {18, 5}, {18, 7}, {16, 7}, {16, 9}, {18, 9}, {18, 12}, 
+            {1, 12}, {1, 18}, {3, 18}, {3, 15}, {5, 15}, {5, 18}, {7, 18}, 
+            {7, 15}, {9, 15}, {9, 18}, {12, 18}, {12, 14}, {18, 14}, {18, 16}, 
+            {14, 16}, {14, 19}, {19, 19}
+        };
+    } else {
+        points = winding_path(width, height);
+    }
 
-    grid<TileKind> *path = new grid<TileKind>(
-        TileCountX * LevelScale, TileCountZ * LevelScale);
+    Waypoints waypoints(&tiles, points);
 
-    Waypoints waypoints(path, {
-        {0, 1}, {8, 1}, {8, 3}, {1, 3}, {1, 8}, {4, 8}, {4, 5}, {8, 5}, {8, 7},
-        {6, 7}, {6, 9}, {11, 9}, {11, 1}, {18, 1}, {18, 3}, {16, 3}, {16, 5},
-        {18, 5}, {18, 7}, {16, 7}, {16, 9}, {18, 9}, {18, 12}, {1, 12}, {1, 18},
-        {3, 18}, {3, 15}, {5, 15}, {5, 18}, {7, 18}, {7, 15}, {9, 15}, {9, 18},
-        {12, 18}, {12, 14}, {18, 14}, {18, 16}, {14, 16}, {14, 19}, {19, 19}
-    });
+    // Enemies walk from the spawn point at the end of the path to its start
+    std::unique_ptr<flow_field> flow(new flow_field(tiles));
+    flow->add_exit(points.front().x, points.front().y);
+    flow->build();
 
-    transform::Position2 spawn_point = {
-        toX(LevelScale * TileCountX - 1), 
-        toZ(LevelScale * TileCountZ - 1)
-    };
+    // The shortcut starts out closed, so no turrets or trees are put on it
+    int shortcut_x = -1, shortcut_y = -1;
+    if (s.reroute_interval > 0 && 
+        find_shortcut(*flow, tiles, shortcut_x, shortcut_y)) 
+    {
+        tiles.set(shortcut_x, shortcut_y, TileKind::Other);
+    }
 
-    g.level = ecs.entity()
-        .child_of<Level>()
-        .set<Level>({path, spawn_point});
+    Level lvl(std::move(flow), points.back().x, points.back().y);
+    lvl.chunk_radius = s.chunk_radius;
+    lvl.shortcut_x = shortcut_x;
+    lvl.shortcut_y = shortcut_y;
 
     ecs.entity("GroundPlane")
         .child_of<level>()
-        .set<Position>({0, -2.7, toZ(TileCountZ / 2 - 0.5)})
-        .set<Box>({toX(TileCountX + 0.5) * 20, 5, toZ(TileCountZ + 2) * 10})
+        .set<Position>({0, -2.7, toZ(height / 2 - 0.5)})
+        .set<Box>({toX(width + 0.5, width) * 20, 5, toZ(height + 2) * 10})
         .set<Color>({0.11, 0.15, 0.1});
 
-    for (int x = 0; x < TileCountX * LevelScale; x ++) {
-        for (int z = 0; z < TileCountZ * LevelScale; z++) {
-            float xc = toX(x);
-            float zc = toZ(z);
+    // Tiles and trees are stored in chunks, turrets are created right away
+    std::vector<TileChunk> chunks(lvl.chunks_x * lvl.chunks_y);
+    for (int y = 0; y < lvl.chunks_y; y ++) {
+        for (int x = 0; x < lvl.chunks_x; x ++) {
+            chunks[y * lvl.chunks_x + x].x = x;
+            chunks[y * lvl.chunks_x + x].y = y;
+        }
+    }
 
-            auto t = ecs.scope<level>().entity().set<Position>({xc, 0, zc});
-            if (path[0](x, z) == TileKind::Path) {
-                t.is_a<prefabs::Path>();
-            } else if (path[0](x, z) == TileKind::Turret) {
-                t.is_a<prefabs::Tile>();
+    for (int x = 0; x < width; x ++) {
+        for (int z = 0; z < height; z++) {
+            TileChunk& tc = chunks[
+                (z / ChunkSize) * lvl.chunks_x + (x / ChunkSize)];
+            tc.kinds[TileChunk::index(x, z)] = tiles(x, z);
+        }
+    }
 
-                bool canTurret = false;
-                if (x < (TileCountX * LevelScale - 1) && (z < (TileCountZ * LevelScale - 1))) {
-                    canTurret |= (path[0](x + 1, z) == TileKind::Path);
-                    canTurret |= (path[0](x, z + 1) == TileKind::Path);
-                }
-                if (x && z) {
-                    canTurret |= (path[0](x - 1, z) == TileKind::Path);
-                    canTurret |= (path[0](x, z - 1) == TileKind::Path);
-                }
+    std::vector<int> turret_slots;
+    for (int x = 0; x < width; x ++) {
+        for (int z = 0; z < height; z++) {
+            if (tiles(x, z) != TileKind::Turret) {
+                continue;
+            }
 
-                auto e = ecs.entity().set<Position>({xc, TileHeight / 2, zc});
-                if (!canTurret || (randf(1) > 0.3)) {
-                    if (randf(1) > 0.05) {
-                        e.child_of<level>();
-                        e.set<prefabs::Tree>({
-                            1.5f + randf(2.5),
-                            randf(0.1)
-                        });
-                        e.set<Rotation>({0, randf(2.0 * M_PI)});
-                    } else {
-                        e.destruct();
-                    }
-                } else {
-                    e.child_of<turrets>();
-                    if (randf(1) > 0.3) {
-                        e.is_a<prefabs::Cannon>();
-                    } else {
-                        e.is_a<prefabs::Laser>();
-                        e.target<prefabs::Laser::Head::Beam>().disable();
-                    }
-                }
-            } else if (path[0](x, z) == TileKind::Other) {
-                t.is_a<prefabs::Tile>();
+            bool canTurret = false;
+            if (x < (width - 1) && (z < (height - 1))) {
+                canTurret |= (tiles(x + 1, z) == TileKind::Path);
+                canTurret |= (tiles(x, z + 1) == TileKind::Path);
+            }
+            if (x && z) {
+                canTurret |= (tiles(x - 1, z) == TileKind::Path);
+                canTurret |= (tiles(x, z - 1) == TileKind::Path);
             }
+
+            TileChunk& tc = chunks[
+                (z / ChunkSize) * lvl.chunks_x + (x / ChunkSize)];
+            if (canTurret && !random_turrets) {
+                turret_slots.push_back(z * width + x);
+            } else if (!canTurret || (rnd.turrets.randf(1) > 0.3)) {
+                tc.trees[TileChunk::index(x, z)] = rnd.level.randf(1) > 0.05;
+            } else {
+                add_turret(ecs, lvl, x, z, rnd.turrets.randf(1) <= 0.3);
+            }
+        }
+    }
+
+    // Put the requested number of turrets on random slots. If there are more
+    // turrets than slots, the remaining turrets are not created.
+    int cannons = s.cannons > 0 ? s.cannons : 0;
+    int lasers = s.lasers > 0 ? s.lasers : 0;
+    for (size_t i = 0; i < turret_slots.size(); i ++) {
+        size_t r = i + rnd.turrets.randi(turret_slots.size() - i);
+        std::swap(turret_slots[i], turret_slots[r]);
+
+        int x = turret_slots[i] % width, z = turret_slots[i] / width;
+        if (i < (size_t)cannons) {
+            add_turret(ecs, lvl, x, z, false);
+        } else if (i < (size_t)(cannons + lasers)) {
+            add_turret(ecs, lvl, x, z, true);
+        } else {
+            TileChunk& tc = chunks[
+                (z / ChunkSize) * lvl.chunks_x + (x / ChunkSize)];
+            tc.trees[TileChunk::index(x, z)] = rnd.level.randf(1) > 0.05;
         }
     }
+
+    for (const TileChunk& tc : chunks) {
+        lvl.chunks.push_back(ecs.scope<level>().entity()
+            .set<TileChunk>(tc)
+            .set<Position>({toX(tc.x * ChunkSize, width), 0, 
+                toZ(tc.y * ChunkSize)})
+            .add<transform::TransformOnce>());
+    }
+
+    g.level = ecs.entity()
+        .child_of<Level>()
+        .set<Level>(std::move(lvl));
+
+    // Spread out initial enemies over the path
+    const Level& l = g.level.get<Level>();
+    for (int i = 0; i < s.enemies; i ++) {
+        spawn_enemy(ecs, l, l.path.length() * i / s.enemies);
+    }
+
+    // Create tile entities for chunks that are visible at start
+    update_chunks(ecs, l, -1);
 }
 
+// Delete level entities that the world can't clean up by itself. Turrets refer
+// to the parts of their prefab instance (slots) with pairs that don't fragment.
+// When the world is deleted, it can delete a part before the turret that
+// refers to it, which leaves a pair with a deleted target. Must be called
+// before the world is deleted.
+void fini_level(flecs::world& ecs) {
+    ecs.delete_with(flecs::ChildOf, ecs.entity<turrets>());
+}
+
+// Systems marked as multi_threaded run on worker threads when the scenario has
+// more than one thread. These systems only modify the entity they're iterating,
+// and can only create entities or modify shared data through stage queues.
 void init_systems(flecs::world& ecs) {
+    Scenario s = ecs.ensure<Scenario>();
+
     ecs.scope(ecs.entity("tower_defense"), [&](){ // Keep root scope clean
 
+    // Record or replay camera movement. Runs after the camera controller, and
+    // before the camera is used to materialize chunks.
+    ecs.system<Recording, Position, Rotation>("RecordCamera")
+        .term_at(0).singleton()
+        .with<graphics::Camera>()
+        .each(RecordCamera);
+
     // Spawn enemies periodically
-    ecs.system<const Game>("SpawnEnemy")
+    auto spawn = ecs.system<const Game>("SpawnEnemy")
         .term_at(0).singleton()
-        .interval(EnemySpawnInterval)
+        .interval(s.spawn_interval)
         .each(SpawnEnemy);
+    if (s.spawn_interval <= 0) {
+        spawn.disable();
+    }
+
+    // Create and delete tile entities of chunks as the camera and enemies move
+    ecs.system<const Level>("UpdateChunks")
+        .term_at(0).src(ecs.get<Game>().level)
+        .interval(ChunkUpdateInterval)
+        .each([](flecs::iter& it, size_t, const Level& lvl) {
+            flecs::world ecs = it.world();
+            update_chunks(ecs, lvl, ChunkMaterializeBudget);
+        });
+
+    // Open and close the shortcut, so enemies have to change route
+    auto reroute = ecs.system<Level>("ToggleShortcut")
+        .term_at(0).src(ecs.get<Game>().level)
+        .interval(s.reroute_interval)
+        .each(ToggleShortcut);
+    if (s.reroute_interval <= 0) {
+        reroute.disable();
+    }
 
     // Move enemies
-    ecs.system<Position, Direction, const Game>("MoveEnemy")
-        .term_at(2).singleton()
+    ecs.system<PathProgress, Position, const Level>("MoveEnemy")
+        .term_at(2).src(ecs.get<Game>().level)
         .with<Enemy>()
+        .multi_threaded()
         .each(MoveEnemy);
 
-    // Clear invalid target for turrets
-    ecs.system<Target, Position>("ClearTarget")
-        .each(ClearTarget);
+    // The enemy index is updated by the first search after enemies moved, so
+    // update it before turrets search it from multiple threads. This also
+    // syncs the workers, so turrets don't read enemy positions while they move.
+    ecs.system<SpatialQuery>("UpdateEnemyIndex")
+        .term_at(0).second<Enemy>().src<prefabs::Turret>()
+        .each([](SpatialQuery& q) {
+            q.update();
+        });
+
+    // Clear target of turrets when the enemy they target is deleted
+    ecs.observer<Targeters>("ClearTargets")
+        .event(flecs::OnRemove)
+        .each(ClearTargets);
+
+    // Order enemies by progress and health for the targeting policies
+    ecs.system<const PathProgress, const Position, const Health>
+            ("UpdateEnemyOrder")
+        .with<Enemy>()
+        .run(UpdateEnemyOrder);
 
     // Find target for turrets
-    ecs.system<Turret, Target, Position, const SpatialQuery, SpatialQueryResult>
-            ("FindTarget")
-        .term_at(3).up(flecs::IsA).second<Enemy>() // SpatialQuery(up, Enemy)
-        .term_at(4).second<Enemy>()                // (SpatialQueryResult, Enemy)
+    ecs.system<Turret, Target, Position, TurretCoverage, const TargetingPolicy,
+            const SpatialQuery, const EnemyOrder, const Level>("FindTarget")
+        .term_at(5).up(flecs::IsA).second<Enemy>() // SpatialQuery(up, Enemy)
+        .term_at(6).singleton()
+        .term_at(7).src(ecs.get<Game>().level)
+        .multi_threaded()
         .each(FindTarget);
 
     // Aim turret at enemies
-    ecs.system<Turret, Target, Position>("AimTarget")
-        .each(AimTarget);
+    ecs.system<Turret, Target, Position, TurretRig, const Level>("AimTarget")
+        .term_at(4).src(ecs.get<Game>().level)
+        .multi_threaded()
+        .run(AimTarget);
 
     // Countdown until next fire
     ecs.system<Turret, Target>("FireCountdown")
         .each(FireCountdown);
 
     // Aim beam at target
-    ecs.system<Position, Turret, Target>("BeamControl")
+    ecs.system<Position, Turret, Target, TurretRig>("BeamControl")
         .each(BeamControl);
 
     // Fire bullets at enemies
-    ecs.system<Turret, Target, Position>("FireAtTarget")
+    ecs.system<Turret, Target, Position, TurretRig, ImpactQueue*>
+            ("FireAtTarget")
+        .term_at(4).singleton()
         .with<Laser>().optional()
         .each(FireAtTarget);
 
@@ -974,47 +3185,104 @@ void init_systems(flecs::world& ecs) {
 
     // Decrease recoil amount over time
     ecs.system<Recoil>("DecreaseRecoil")
+        .multi_threaded()
         .each(DecreaseRecoil);
 
     // Decrease recoil amount over time
     ecs.system<HitCooldown>("DecreaseHitCooldown")
+        .multi_threaded()
         .each(DecreaseHitCoolDown);
 
-    // Simple particle system
+    // Simple particle system. Only bullets are particle entities, which are too
+    // few to make splitting them over threads worth the sync.
     ecs.system<ParticleLifespan, const Particle, Box*, Color*, Velocity*>
             ("ProgressParticle")
         .term_at(1).up(flecs::IsA) // shared particle properties
-        .each(ProgressParticle);
+        .run(ProgressParticle);
+
+    // Particles of effects that are stored in buffers
+    ecs.system<ParticleBuffer, const ParticleEffect>("ProgressParticleBuffer")
+        .each(ProgressParticleBuffer);
+
+    // Bullets only exist when cannon hits aren't resolved analytically
+    if (ecs.has<Broadphase>()) {
+        // Collision pairs are computed when they're first requested, so 
+        // compute them before they're requested from multiple threads.
+        ecs.system<Broadphase>("UpdateCollisions")
+            .term_at(0).singleton()
+            .each([](Broadphase& bp) {
+                bp.update();
+            });
+
+        // Test for collisions with enemies
+        ecs.system<const Broadphase>("HitTarget")
+            .term_at(0).singleton()
+            .multi_threaded()
+            .run(HitTarget);
+    }
+
+    // Apply damage of analytic cannon rounds when they reach their target
+    ecs.system<ImpactQueue>("ApplyImpacts")
+        .term_at(0).singleton()
+        .each(ApplyImpacts);
+
+    // Apply damage dealt by bullets and beams
+    ecs.system<StageQueues>("ApplyDamage")
+        .term_at(0).singleton()
+        .each(ApplyDamage);
 
-    // Test for collisions with enemies
-    ecs.system<Position, Health, Box, HitCooldown, const SpatialQuery, SpatialQueryResult>
-            ("HitTarget")
-        .term_at(4).up(flecs::IsA).second<Bullet>() // SpatialQuery(up, Bullet)
-        .term_at(5).second<Bullet>()                // (SpatialQueryResult, Bullet)
-        .each(HitTarget);
+    // Explode and change color when enemy drops below a health tier
+    ecs.observer<Position>("EnemyHealthTier")
+        .with<Enemy>()
+        .event<HealthTierCrossed>()
+        .each(EnemyHealthTier);
 
     // Destroy enemy when health goes to 0
-    ecs.system<Health, Position>("DestroyEnemy")
+    ecs.observer<Position>("DestroyEnemy")
         .with<Enemy>()
+        .event<EnemyDied>()
         .each(DestroyEnemy);
 
+    // Release entities and create explosions queued by worker threads
+    ecs.system<StageQueues>("FlushStageQueues")
+        .term_at(0).singleton()
+        .each(FlushStageQueues);
+
     // Decrease intensity of explosion light over time
     ecs.system<ExplosionLight, PointLight>("UpdateExplosionLight")
         .each([](flecs::iter& it, size_t i, ExplosionLight& l, PointLight& p) {
             flecs::entity e = it.entity(i);
             l.intensity -= l.decay * it.delta_time();
             if (l.intensity <= 0) {
-                e.destruct();
+                pool_release(e);
             } else {
                 p.intensity = l.intensity;
             }
         });
+
+    // Record or verify the state of the simulation at the end of the frame.
+    // The system is immediate, so it sees the state after all commands of the
+    // frame are merged, regardless of which other systems run.
+    ecs.system<Recording>("RecordFrame")
+        .term_at(0).singleton()
+        .kind(flecs::PostFrame)
+        .immediate()
+        .each(RecordFrame);
+
+    // The app deletes the world after the frame in which the game quits
+    ecs.system("FiniLevel")
+        .kind(flecs::PostFrame)
+        .run([](flecs::iter& it) {
+            flecs::world ecs = it.world();
+            if (ecs.should_quit()) {
+                fini_level(ecs);
+            }
+        });
     });
 }
 
-int main(int argc, char *argv[]) {
-    flecs::world ecs(argc, argv);
-
+// Modules used by the simulation, which doesn't include the renderer
+void init_modules(flecs::world& ecs) {
     ecs.import<flecs::components::transform>();
     ecs.import<flecs::components::graphics>();
     ecs.import<flecs::components::geometry>();
@@ -1024,15 +3292,506 @@ int main(int argc, char *argv[]) {
     ecs.import<flecs::systems::transform>();
     ecs.import<flecs::systems::physics>();
     ecs.import<flecs::game>();
+}
+
+// Targeting policy by name, or -1 if the name isn't a policy
+int targeting_policy(const char *name) {
+    static const char *names[] = {
+        "closest", "first", "last", "strongest", "weakest"
+    };
+
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i ++) {
+        if (!strcmp(name, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef TOWER_DEFENSE_HEADLESS
+
+// Scenarios of the benchmark suite. Parameters of a scenario can be overridden
+// from the command line.
+std::vector<Scenario> bench_scenarios() {
+    std::vector<Scenario> result;
+
+    // Same load as the game
+    result.push_back(Scenario("default"));
+
+    // Level without enemies
+    Scenario idle("idle");
+    idle.spawn_interval = 0;
+    result.push_back(idle);
+
+    // Lots of enemies, so that turrets always have a target
+    Scenario swarm("swarm");
+    swarm.enemies = 1000;
+    swarm.spawn_interval = 0.02;
+    result.push_back(swarm);
+
+    // Lots of enemies, turrets target the enemy furthest along the path
+    Scenario first("first");
+    first.enemies = 1000;
+    first.spawn_interval = 0.02;
+    first.targeting = static_cast<int>(TargetPolicy::First);
+    result.push_back(first);
+
+    // Cannons on all turret slots
+    Scenario cannons("cannons");
+    cannons.cannons = 1000;
+    cannons.enemies = 500;
+    result.push_back(cannons);
+
+    // Cannons that resolve hits without bullet entities
+    Scenario analytic("analytic");
+    analytic.cannons = 1000;
+    analytic.enemies = 500;
+    analytic.analytic_projectiles = true;
+    result.push_back(analytic);
+
+    // Lasers on all turret slots
+    Scenario lasers("lasers");
+    lasers.lasers = 1000;
+    lasers.enemies = 500;
+    result.push_back(lasers);
+
+    // Shortcut in the path that opens and closes, so enemies change route
+    Scenario reroute("reroute");
+    reroute.enemies = 200;
+    reroute.reroute_interval = 2;
+    result.push_back(reroute);
+
+    // Map with a million tiles, of which only a few chunks are materialized
+    Scenario large("large");
+    large.map_width = 1000;
+    large.map_height = 1000;
+    large.cannons = 2000;
+    large.lasers = 500;
+    large.spawn_interval = 0.02;
+    large.frames = 1800;
+    result.push_back(large);
+
+    return result;
+}
+
+// Override scenario parameter with command line argument
+bool scenario_arg(Scenario& s, const char *arg, const char *value) {
+    if (!strcmp(arg, "--frames")) {
+        s.frames = atoi(value);
+    } else if (!strcmp(arg, "--fps")) {
+        s.fps = atof(value);
+    } else if (!strcmp(arg, "--cannons")) {
+        s.cannons = atoi(value);
+    } else if (!strcmp(arg, "--lasers")) {
+        s.lasers = atoi(value);
+    } else if (!strcmp(arg, "--enemies")) {
+        s.enemies = atoi(value);
+    } else if (!strcmp(arg, "--spawn-interval")) {
+        s.spawn_interval = atof(value);
+    } else if (!strcmp(arg, "--map-width")) {
+        s.map_width = std::max(3, atoi(value));
+    } else if (!strcmp(arg, "--map-height")) {
+        s.map_height = std::max(3, atoi(value));
+    } else if (!strcmp(arg, "--chunk-radius")) {
+        s.chunk_radius = atof(value);
+    } else if (!strcmp(arg, "--threads")) {
+        s.threads = std::max(1, atoi(value));
+    } else if (!strcmp(arg, "--seed")) {
+        s.seed = strtoull(value, nullptr, 10);
+    } else if (!strcmp(arg, "--projectiles")) {
+        s.analytic_projectiles = !strcmp(value, "analytic");
+    } else if (!strcmp(arg, "--reroute-interval")) {
+        s.reroute_interval = atof(value);
+    } else if (!strcmp(arg, "--targeting")) {
+        s.targeting = targeting_policy(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Peak resident memory of the process in kilobytes, or 0 if not available
+long peak_rss_kb() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (!getrusage(RUSAGE_SELF, &usage)) {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return 0;
+}
+
+// Number of (enabled, non-prefab) entities with id
+int count_entities(flecs::world& ecs, flecs::id_t id) {
+    return ecs.query_builder().with(id).build().count();
+}
+
+// Run scenario in a new world at a fixed time step, and write the time spent
+// in each system and the number of entities as JSON. Returns false if the
+// scenario is a replay that doesn't match its recording, or if the flow field
+// doesn't match a full rebuild after tiles changed.
+bool run_scenario(const Scenario& s, const Recording& rec, bool last) {
+    flecs::world ecs;
+
+    init_modules(ecs);
+    init_components(ecs);
+    ecs.set<Scenario>(s);
+    init_game(ecs);
+    init_level(ecs);
+    init_systems(ecs);
+
+    if (rec.file) {
+        ecs.set<Recording>(rec);
+    }
+
+    ecs_measure_system_time(ecs, true);
+
+    // Spatial queries publish the statistics of the previous frame, so add
+    // them up over the run. Structure is reported as of the last frame.
+    struct index_stats {
+        flecs::entity owner;
+        flecs::entity filter;
+        SpatialQueryStats last;
+        int64_t query_count, nodes_visited, result_count;
+        double update_time;
+    };
+
+    std::vector<index_stats> indices;
+    auto index_query = ecs.query_builder<const SpatialQueryStats>()
+        .term_at(0).second(flecs::Wildcard)
+        .query_flags(EcsQueryMatchPrefab) // Turret prefab owns the query
+        .build();
+
+    float delta_time = 1.0f / s.fps;
+    double total = 0, max = 0;
+    int frame;
+    for (frame = 0; frame < s.frames; frame ++) {
+        ecs_time_t t = {};
+        ecs_time_measure(&t);
+        if (!ecs.progress(delta_time)) {
+            break;
+        }
+
+        double elapsed = ecs_time_measure(&t);
+        total += elapsed;
+        if (elapsed > max) {
+            max = elapsed;
+        }
+
+        index_query.each([&](flecs::iter& it, size_t i, 
+            const SpatialQueryStats& st) 
+        {
+            flecs::entity owner = it.entity(i);
+            flecs::entity filter = it.pair(0).second();
+            index_stats *is = nullptr;
+            for (index_stats& cur : indices) {
+                if (cur.owner == owner && cur.filter == filter) {
+                    is = &cur;
+                }
+            }
+            if (!is) {
+                indices.push_back({owner, filter, st, 0, 0, 0, 0});
+                is = &indices.back();
+            }
+
+            is->last = st;
+            is->query_count += st.query_count;
+            is->nodes_visited += st.nodes_visited;
+            is->result_count += st.result_count;
+            is->update_time += st.update_time;
+        });
+    }
+
+    struct system_time {
+        std::string name;
+        double time;
+    };
+
+    std::vector<system_time> systems;
+    ecs.query_builder().with(flecs::System).build().each([&](flecs::entity e) {
+        double time = ecs_system_get(ecs, e)->time_spent;
+        if (time > 0) { // Skip systems that didn't run
+            systems.push_back({ e.path(".", "").c_str(), time });
+        }
+    });
+
+    std::sort(systems.begin(), systems.end(), 
+        [](const system_time& a, const system_time& b) {
+            return a.time > b.time;
+        });
+
+    int32_t buffered_particles = 0;
+    ecs.each([&](const ParticleBuffer& pb) {
+        buffered_particles += pb.count;
+    });
+
+    int lasers = count_entities(ecs, ecs.id<Laser>());
+
+    int32_t materialized = 0;
+    ecs.each([&](const TileChunk& tc) {
+        materialized += tc.materialized;
+    });
+
+    // Tiles of which the incrementally updated distance to an exit doesn't
+    // match the distance of a flow field that is computed from scratch
+    const Level& lvl = ecs.get<Game>().level.get<Level>();
+    flow_field rebuilt(*lvl.flow);
+    rebuilt.build();
+    int32_t flow_errors = 0;
+    for (int x = 0; x < lvl.width; x ++) {
+        for (int y = 0; y < lvl.height; y ++) {
+            flow_errors += rebuilt.distance(x, y) != lvl.flow->distance(x, y);
+        }
+    }
+
+    printf("  {\n");
+    printf("    \"scenario\": \"%s\",\n", s.name);
+    printf("    \"frames\": %d,\n", frame);
+    printf("    \"fps\": %g,\n", s.fps);
+    printf("    \"spawn_interval\": %g,\n", s.spawn_interval);
+    printf("    \"threads\": %d,\n", s.threads);
+    printf("    \"seed\": %llu,\n", (unsigned long long)s.seed);
+    printf("    \"map\": {\"width\": %d, \"height\": %d, \"chunks\": %d, "
+        "\"materialized_chunks\": %d},\n", s.map_width, s.map_height,
+            ecs.count<TileChunk>(), materialized);
+    printf("    \"frame_time\": {\"total_ms\": %.3f, \"avg_ms\": %.4f, "
+        "\"max_ms\": %.4f},\n", 
+            total * 1000, frame ? total * 1000 / frame : 0, max * 1000);
+    printf("    \"systems\": [\n");
+    for (size_t i = 0; i < systems.size(); i ++) {
+        printf("      {\"name\": \"%s\", \"total_ms\": %.3f, "
+            "\"avg_ms\": %.4f}%s\n", 
+                systems[i].name.c_str(), systems[i].time * 1000, 
+                frame ? systems[i].time * 1000 / frame : 0,
+                i < systems.size() - 1 ? "," : "");
+    }
+    printf("    ],\n");
+    printf("    \"entities\": {\"total\": %d, \"enemies\": %d, "
+        "\"cannons\": %d, \"lasers\": %d, \"bullets\": %d, "
+        "\"particles\": %d, \"buffered_particles\": %d},\n",
+            ecs_get_entities(ecs).alive_count,
+            count_entities(ecs, ecs.id<Enemy>()),
+            count_entities(ecs, ecs.id<Turret>()) - lasers,
+            lasers,
+            count_entities(ecs, ecs.id<Bullet>()),
+            count_entities(ecs, ecs.id<ParticleLifespan>()),
+            buffered_particles);
+    printf("    \"path\": {\"changes\": %d, \"length\": %.2f, "
+        "\"flow_errors\": %d},\n", 
+            lvl.version, lvl.path.length(), flow_errors);
+    printf("    \"spatial_queries\": [\n");
+    for (size_t i = 0; i < indices.size(); i ++) {
+        const index_stats& is = indices[i];
+        printf("      {\"owner\": \"%s\", \"filter\": \"%s\", "
+            "\"entities\": %d, \"nodes\": %d, \"leaves\": %d, "
+            "\"depth\": %d, \"max_leaf_entities\": %d, \"dropped\": %d, "
+            "\"queries\": %lld, \"nodes_visited\": %lld, "
+            "\"results\": %lld, \"update_ms\": %.3f}%s\n",
+                is.owner.path(".", "").c_str(), 
+                is.filter.path(".", "").c_str(),
+                is.last.entity_count, is.last.node_count, is.last.leaf_count,
+                is.last.depth, is.last.max_leaf_entities, is.last.dropped,
+                (long long)is.query_count, (long long)is.nodes_visited,
+                (long long)is.result_count, is.update_time * 1000,
+                i < indices.size() - 1 ? "," : "");
+    }
+    printf("    ],\n");
+
+    std::vector<flecs::entity> pools;
+    ecs.query_builder<const EntityPool>()
+        .query_flags(EcsQueryMatchPrefab)
+        .build()
+        .each([&](flecs::entity prefab, const EntityPool&) {
+            pools.push_back(prefab);
+        });
+
+    printf("    \"pools\": [\n");
+    for (size_t i = 0; i < pools.size(); i ++) {
+        const EntityPool& pool = pools[i].get<EntityPool>();
+        printf("      {\"prefab\": \"%s\", \"capacity\": %d, "
+            "\"free\": %d, \"hits\": %lld, \"misses\": %lld}%s\n",
+                pools[i].path(".", "").c_str(), pool.capacity, 
+                (int)pool.free.size(), (long long)pool.hits, 
+                (long long)pool.misses, i < pools.size() - 1 ? "," : "");
+    }
+    printf("    ],\n");
+    bool matches = flow_errors == 0;
+    if (const Recording *r = ecs.try_get<Recording>()) {
+        printf("    \"%s\": {\"frames\": %d, \"checksum\": \"%08x\"", 
+            r->replay ? "replay" : "record", r->frame, state_checksum(ecs));
+        if (r->replay) {
+            printf(", \"diverged_frame\": %d", r->diverged);
+            matches &= r->diverged == -1 && r->frame == r->frames;
+        }
+        printf("},\n");
+    }
+
+    printf("    \"peak_rss_kb\": %ld\n", peak_rss_kb());
+    printf("  }%s\n", last ? "" : ",");
+    fflush(stdout);
+
+    fini_level(ecs);
+    return matches;
+}
+
+// Run benchmark scenarios without a window, and write results as JSON. A
+// single scenario can be recorded, and recordings can be replayed with a
+// different number of threads to check that they produce the same result.
+// Usage: tower_defense_headless [--list] [--scenario name|all] [--frames N]
+//   [--fps N] [--cannons N] [--lasers N] [--enemies N] [--spawn-interval S]
+//   [--map-width N] [--map-height N] [--chunk-radius R] [--threads N]
+//   [--seed N] [--projectiles bullets|analytic] [--reroute-interval S]
+//   [--targeting closest|first|last|strongest|weakest] [--record file]
+//   [--replay file]
+int main(int argc, char *argv[]) {
+    std::vector<Scenario> scenarios = bench_scenarios();
+    const char *name = "default";
+    const char *record = nullptr, *replay = nullptr;
+
+    for (int i = 1; i < argc; i ++) {
+        if (!strcmp(argv[i], "--list")) {
+            for (const Scenario& s : scenarios) {
+                printf("%s\n", s.name);
+            }
+            return 0;
+        } else if (!strcmp(argv[i], "--scenario") && i < argc - 1) {
+            name = argv[++ i];
+        } else if (!strcmp(argv[i], "--record") && i < argc - 1) {
+            record = argv[++ i];
+        } else if (!strcmp(argv[i], "--replay") && i < argc - 1) {
+            replay = argv[++ i];
+        } else if (!strcmp(argv[i], "--targeting") && i < argc - 1) {
+            if (targeting_policy(argv[++ i]) == -1) {
+                fprintf(stderr, "unknown targeting policy '%s'\n", argv[i]);
+                return 1;
+            }
+        }
+    }
+
+    // Replays take the scenario from the recording. Only the number of threads
+    // can be changed, as other parameters change the outcome.
+    if (replay) {
+        Scenario s("replay");
+        Recording rec;
+        if (!recording_open(rec, replay, s)) {
+            fprintf(stderr, "cannot read recording '%s'\n", replay);
+            return 1;
+        }
+
+        for (int i = 1; i < argc - 1; i ++) {
+            if (!strcmp(argv[i], "--threads")) {
+                scenario_arg(s, argv[i], argv[i + 1]);
+            }
+        }
+
+        printf("[\n");
+        bool matches = run_scenario(s, rec, true);
+        printf("]\n");
+        return matches ? 0 : 1;
+    }
+
+    std::vector<Scenario> selected;
+    for (Scenario s : scenarios) {
+        if (strcmp(name, "all") && strcmp(name, s.name)) {
+            continue;
+        }
+
+        for (int i = 1; i < argc - 1; i ++) {
+            if (scenario_arg(s, argv[i], argv[i + 1])) {
+                i ++;
+            }
+        }
+
+        selected.push_back(s);
+    }
+
+    if (selected.empty()) {
+        fprintf(stderr, "unknown scenario '%s'\n", name);
+        return 1;
+    }
+
+    Recording rec;
+    if (record) {
+        if (selected.size() != 1) {
+            fprintf(stderr, "can only record a single scenario\n");
+            return 1;
+        }
+        if (!recording_create(rec, record, selected[0])) {
+            fprintf(stderr, "cannot create recording '%s'\n", record);
+            return 1;
+        }
+    }
+
+    printf("[\n");
+    bool ok = true;
+    for (size_t i = 0; i < selected.size(); i ++) {
+        ok &= run_scenario(selected[i], rec, i == selected.size() - 1);
+    }
+    printf("]\n");
+
+    return ok ? 0 : 1;
+}
+
+#else
+
+// Sessions that are recorded run at a fixed time step, so that they can be
+// replayed by the headless runner.
+// Usage: tower_defense [--threads N] [--seed N] [--record file]
+int main(int argc, char *argv[]) {
+    flecs::world ecs(argc, argv);
+
+    init_modules(ecs);
     ecs.import<flecs::systems::sokol>();
 
     init_components(ecs);
+
+    Scenario s;
+    const char *record = nullptr;
+    for (int i = 1; i < argc - 1; i ++) {
+        if (!strcmp(argv[i], "--threads")) {
+            s.threads = std::max(1, atoi(argv[++ i]));
+        } else if (!strcmp(argv[i], "--seed")) {
+            s.seed = strtoull(argv[++ i], nullptr, 10);
+        } else if (!strcmp(argv[i], "--projectiles")) {
+            s.analytic_projectiles = !strcmp(argv[++ i], "analytic");
+        } else if (!strcmp(argv[i], "--targeting")) {
+            s.targeting = targeting_policy(argv[++ i]);
+            if (s.targeting == -1) {
+                fprintf(stderr, "unknown targeting policy '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--record")) {
+            record = argv[++ i];
+        }
+    }
+    ecs.set<Scenario>(s);
+
     init_game(ecs);
     init_level(ecs);
     init_systems(ecs);
 
-    ecs.app()
+    if (record) {
+        Recording rec;
+        if (!recording_create(rec, record, s)) {
+            fprintf(stderr, "cannot create recording '%s'\n", record);
+            return 1;
+        }
+        ecs.set<Recording>(rec);
+    }
+
+    flecs::app_builder app = ecs.app(); // Takes ownership of the world
+    if (record) {
+        app.delta_time(1.0f / s.fps);
+    }
+
+    return app
         .enable_rest()
         .enable_stats()
         .run();
-}
\ No newline at end of file
+}
+
+#endif